@@ -0,0 +1,335 @@
+/*
+    batch.c -- run a command on batches of changed paths.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "hash.h"
+#include "utils.h"
+
+extern char **environ;
+
+void
+batch_init(batch_t *batch, const char *command, unsigned long window,
+           size_t max_count, int max_running)
+{
+    assert(batch);
+    assert(command);
+    assert(max_running > 0);
+
+    batch->command = xmalloc(strlen(command) + 1);
+    strcpy(batch->command, command);
+    batch->window = window;
+    batch->max_count = max_count;
+    batch->max_running = max_running;
+    batch->running = 0;
+    batch->verbosity = 0;
+    batch->data = NULL;
+    batch->size = 0;
+    batch->capacity = 0;
+    batch->count = 0;
+    batch->started = 0;
+    batch->set = NULL;
+    batch->set_capacity = 0;
+}
+
+static void
+batch_reserve(batch_t *batch, size_t len)
+{
+    if (batch->size + len <= batch->capacity)
+        return;
+
+    while (batch->size + len > batch->capacity)
+        batch->capacity = batch->capacity == 0 ? 4096 : batch->capacity * 2;
+
+    batch->data = xrealloc(batch->data, batch->capacity);
+}
+
+/* Find the slot of the path at OFFSET, which is either its own slot or the
+   one of the same path added before. */
+static size_t
+batch_slot(batch_t *batch, size_t offset, size_t len)
+{
+    const char *path = batch->data + offset;
+    size_t mask = batch->set_capacity - 1;
+    size_t i = hash64(path, len, 0) & mask;
+
+    while (batch->set[i] != 0
+           && strcmp(batch->data + batch->set[i] - 1, path) != 0)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+static void
+batch_grow_set(batch_t *batch)
+{
+    uint32_t *old = batch->set;
+    size_t old_capacity = batch->set_capacity;
+
+    batch->set_capacity = old_capacity == 0 ? 64 : old_capacity * 2;
+    batch->set = xmalloc(sizeof(uint32_t) * batch->set_capacity);
+    memset(batch->set, 0, sizeof(uint32_t) * batch->set_capacity);
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old[i] == 0)
+            continue;
+
+        size_t offset = old[i] - 1;
+
+        batch->set[batch_slot(batch, offset, strlen(batch->data + offset))]
+            = old[i];
+    }
+
+    free(old);
+}
+
+/* Run the command with the collected paths on its standard input, which is
+   a memory file the command may also seek or map. */
+static void
+batch_run(batch_t *batch)
+{
+    int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+    fd = memfd_create("dirwatch-batch", MFD_CLOEXEC);
+#else
+    FILE *fp = tmpfile();
+
+    fd = fp == NULL ? -1 : dup(fileno(fp));
+
+    if (fp != NULL)
+        fclose(fp);
+#endif
+
+    size_t written = 0;
+
+    while (fd != -1 && written < batch->size)
+    {
+        ssize_t n = write(fd, batch->data + written, batch->size - written);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            close(fd);
+            fd = -1;
+            break;
+        }
+
+        written += n;
+    }
+
+    if (fd == -1 || lseek(fd, 0, SEEK_SET) == -1)
+    {
+        print_error(true, false, "cannot pass the paths to `%s'",
+                    batch->command);
+
+        if (fd != -1)
+            close(fd);
+
+        return;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t mask;
+    pid_t pid;
+    char *argv[] = { "sh", "-c", batch->command, NULL };
+
+    /* The signals read through signalfd are blocked, and the command must
+       not inherit that. */
+    sigemptyset(&mask);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fd, STDIN_FILENO);
+
+    int error = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fd);
+
+    if (error != 0)
+    {
+        errno = error;
+        print_error(true, false, "cannot run `%s'", batch->command);
+        return;
+    }
+
+    LOG_DEBUG_1(batch->verbosity, "Running `%s' on %zu paths, pid %d\n",
+                batch->command, batch->count, (int) pid);
+
+    batch->running++;
+}
+
+/* Run the command on the collected paths if there is a free slot, and start
+   a new batch. */
+static void
+batch_flush(batch_t *batch)
+{
+    if (batch->count == 0 || batch->running >= batch->max_running)
+        return;
+
+    batch_run(batch);
+
+    batch->size = 0;
+    batch->count = 0;
+    memset(batch->set, 0, sizeof(uint32_t) * batch->set_capacity);
+}
+
+/* Add the path of NAME inside DIR to the batch. It is built in place and
+   dropped again if it is already there. */
+void
+batch_add(batch_t *batch, uint64_t now, const char *dir, const char *name)
+{
+    size_t dirlen = strlen(dir);
+    size_t namelen = strlen(name);
+    bool slash = namelen > 0 && (dirlen == 0 || dir[dirlen - 1] != '/');
+    size_t offset = batch->size;
+    size_t len = dirlen + slash + namelen;
+
+    batch_reserve(batch, len + 1);
+
+    char *path = batch->data + offset;
+
+    memcpy(path, dir, dirlen);
+
+    if (slash)
+        path[dirlen] = '/';
+
+    memcpy(path + dirlen + slash, name, namelen);
+    path[len] = '\0';
+
+    if ((batch->count + 1) * 2 > batch->set_capacity)
+        batch_grow_set(batch);
+
+    size_t i = batch_slot(batch, offset, len);
+
+    if (batch->set[i] != 0)
+        return;
+
+    batch->set[i] = offset + 1;
+    batch->size += len + 1;
+
+    if (batch->count++ == 0)
+        batch->started = now;
+
+    if (batch->max_count > 0 && batch->count >= batch->max_count)
+        batch_flush(batch);
+}
+
+/* Run the batch if it is due. Returns the number of milliseconds until it
+   is, or -1 if there is nothing to wait for: no paths, or no free slot
+   until a command exits. */
+int
+batch_timeout(batch_t *batch, uint64_t now)
+{
+    if (batch->count == 0 || batch->running >= batch->max_running)
+        return -1;
+
+    if (now - batch->started >= batch->window
+        || (batch->max_count > 0 && batch->count >= batch->max_count))
+    {
+        batch_flush(batch);
+        return -1;
+    }
+
+    return batch->started + batch->window - now;
+}
+
+static void
+batch_report(batch_t *batch, int status)
+{
+    batch->running--;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) != 0)
+        print_error(false, false, "`%s' exited with status %d", batch->command,
+                    WEXITSTATUS(status));
+    else if (WIFSIGNALED(status))
+        print_error(false, false, "`%s' was killed by signal %d",
+                    batch->command, WTERMSIG(status));
+}
+
+/* Reap the commands that exited, and report the ones that failed. */
+void
+batch_reap(batch_t *batch)
+{
+    int status;
+
+    while (waitpid(-1, &status, WNOHANG) > 0)
+        batch_report(batch, status);
+}
+
+/* Run the command on the paths left, and wait for all the commands to
+   exit. */
+void
+batch_finish(batch_t *batch)
+{
+    while (batch->count > 0 || batch->running > 0)
+    {
+        if (batch->count > 0 && batch->running < batch->max_running)
+        {
+            batch_flush(batch);
+            continue;
+        }
+
+        int status;
+
+        if (waitpid(-1, &status, 0) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            break;
+        }
+
+        batch_report(batch, status);
+    }
+}
+
+void
+batch_free(batch_t *batch)
+{
+    free(batch->command);
+    free(batch->data);
+    free(batch->set);
+    batch->command = NULL;
+    batch->data = NULL;
+    batch->set = NULL;
+    batch->size = batch->capacity = batch->count = batch->set_capacity = 0;
+}
@@ -0,0 +1,66 @@
+/*
+    batch.h -- typedefs and prototypes for batch.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "utils.h"
+
+/* Default time to collect paths for, in milliseconds. */
+#define BATCH_WINDOW 100
+
+/* Paths collected to be passed to a command, which runs once the first of
+   them is WINDOW milliseconds old, or once there are MAX_COUNT of them. At
+   most MAX_RUNNING commands run at once: paths collected meanwhile wait for
+   the next run. Each path is only passed once per batch. */
+typedef struct
+{
+    char *command;         /* Run with `/bin/sh -c'. */
+    unsigned long window;  /* In milliseconds. */
+    size_t max_count;      /* 0 if there is no limit. */
+    int max_running;
+    int running;           /* Commands that were not reaped yet. */
+    verbosity_t verbosity;
+    char *data;            /* NUL-terminated paths. */
+    size_t size;
+    size_t capacity;
+    size_t count;          /* Number of paths in DATA. */
+    uint64_t started;      /* When the first path was added. */
+    uint32_t *set;         /* Offsets of the paths plus one, by hash. */
+    size_t set_capacity;
+} batch_t;
+
+__BEGIN_DECLS
+
+void batch_init(batch_t *batch, const char *command, unsigned long window,
+                size_t max_count, int max_running);
+void batch_add(batch_t *batch, uint64_t now, const char *dir,
+               const char *name);
+int batch_timeout(batch_t *batch, uint64_t now);
+void batch_reap(batch_t *batch);
+void batch_finish(batch_t *batch);
+void batch_free(batch_t *batch);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,339 @@
+/*
+    coalesce.c -- merge repeated events within a time window.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coalesce.h"
+#include "hash.h"
+#include "utils.h"
+
+/* The table grows when it is more than 3/4 full. */
+#define COALESCE_MIN_CAPACITY 64
+#define COALESCE_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+static uint64_t
+coalesce_hash(int wd, const char *dir, const char *name)
+{
+    hash64_state_t state;
+
+    hash64_init(&state, (uint64_t) wd);
+    hash64_update(&state, dir, strlen(dir) + 1);
+    hash64_update(&state, name, strlen(name));
+
+    return hash64_digest(&state);
+}
+
+static inline size_t
+coalesce_slot(coalesce_t *coalesce, uint64_t hash)
+{
+    return hash & (coalesce->capacity - 1);
+}
+
+static void
+coalesce_insert(coalesce_t *coalesce, coalesce_entry_t *entry)
+{
+    size_t i = coalesce_slot(coalesce, entry->hash);
+
+    while (coalesce->table[i] != NULL)
+        i = (i + 1) & (coalesce->capacity - 1);
+
+    coalesce->table[i] = entry;
+}
+
+static void
+coalesce_grow(coalesce_t *coalesce)
+{
+    size_t old_capacity = coalesce->capacity;
+    coalesce_entry_t **old_table = coalesce->table;
+
+    coalesce->capacity
+        = old_capacity == 0 ? COALESCE_MIN_CAPACITY : old_capacity * 2;
+    coalesce->table = xmalloc(sizeof(coalesce_entry_t *) * coalesce->capacity);
+    memset(coalesce->table, 0, sizeof(coalesce_entry_t *) * coalesce->capacity);
+
+    for (size_t i = 0; i < old_capacity; i++)
+        if (old_table[i] != NULL)
+            coalesce_insert(coalesce, old_table[i]);
+
+    free(old_table);
+}
+
+/* Remove ENTRY from the table, shifting back the entries that follow it in
+   the same probe sequence, so that no tombstones are needed. */
+static void
+coalesce_delete(coalesce_t *coalesce, coalesce_entry_t *entry)
+{
+    size_t mask = coalesce->capacity - 1;
+    size_t i = coalesce_slot(coalesce, entry->hash);
+
+    while (coalesce->table[i] != entry)
+        i = (i + 1) & mask;
+
+    for (size_t j = (i + 1) & mask; coalesce->table[j] != NULL;
+         j = (j + 1) & mask)
+    {
+        size_t home = coalesce_slot(coalesce, coalesce->table[j]->hash);
+
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            coalesce->table[i] = coalesce->table[j];
+            i = j;
+        }
+    }
+
+    coalesce->table[i] = NULL;
+    coalesce->size--;
+}
+
+static coalesce_entry_t *
+coalesce_find(coalesce_t *coalesce, uint64_t hash, int wd, const char *dir,
+              const char *name)
+{
+    if (coalesce->capacity == 0)
+        return NULL;
+
+    size_t mask = coalesce->capacity - 1;
+
+    for (size_t i = coalesce_slot(coalesce, hash); coalesce->table[i] != NULL;
+         i = (i + 1) & mask)
+    {
+        coalesce_entry_t *entry = coalesce->table[i];
+
+        if (entry->hash == hash && entry->wd == wd && STREQ(entry->name, name)
+            && STREQ(entry->dir, dir))
+            return entry;
+    }
+
+    return NULL;
+}
+
+/* Append ENTRY to a slot of the wheel, so that the events expiring on the
+   same tick are reported in the order they first happened. The head of a
+   slot links back to its tail through PREV. */
+static void
+coalesce_link(coalesce_entry_t **slot, coalesce_entry_t *entry)
+{
+    entry->next = NULL;
+
+    if (*slot == NULL)
+    {
+        entry->prev = entry;
+        *slot = entry;
+    }
+    else
+    {
+        entry->prev = (*slot)->prev;
+        (*slot)->prev->next = entry;
+        (*slot)->prev = entry;
+    }
+}
+
+static void
+coalesce_unlink(coalesce_entry_t **slot, coalesce_entry_t *entry)
+{
+    if (entry == *slot)
+    {
+        *slot = entry->next;
+
+        if (*slot != NULL)
+            (*slot)->prev = entry->prev;
+    }
+    else
+    {
+        entry->prev->next = entry->next;
+
+        if (entry->next != NULL)
+            entry->next->prev = entry->prev;
+        else
+            (*slot)->prev = entry->prev;
+    }
+}
+
+static void
+coalesce_emit(coalesce_t *coalesce, coalesce_entry_t *entry)
+{
+    coalesce_delete(coalesce, entry);
+    coalesce->callback(coalesce, entry->wd, entry->dir, entry->name,
+                       entry->mask, entry->count);
+    free(entry->dir);
+    free(entry->name);
+    free(entry);
+}
+
+void
+coalesce_init(coalesce_t *coalesce, uint64_t window,
+              coalesce_callback_t callback)
+{
+    assert(coalesce);
+    assert(window > 0);
+
+    coalesce->window = window;
+    coalesce->tick = (window + COALESCE_WINDOW_TICKS - 1)
+                     / COALESCE_WINDOW_TICKS;
+    coalesce->now = 0;
+    coalesce->table = NULL;
+    coalesce->capacity = 0;
+    coalesce->size = 0;
+    coalesce->callback = callback;
+    coalesce->data = NULL;
+
+    memset(coalesce->wheel, 0, sizeof coalesce->wheel);
+}
+
+/* Add an event at time NOW. The first event for a key opens a window of
+   the configured length, and the events that follow within it are merged
+   into one. */
+void
+coalesce_add(coalesce_t *coalesce, uint64_t now, int wd, const char *dir,
+             const char *name, uint32_t mask)
+{
+    uint64_t hash = coalesce_hash(wd, dir, name);
+    coalesce_entry_t *entry = coalesce_find(coalesce, hash, wd, dir, name);
+
+    if (entry != NULL)
+    {
+        entry->mask |= mask;
+        entry->count++;
+        return;
+    }
+
+    if (coalesce->size == 0)
+        coalesce->now = now / coalesce->tick;
+
+    if (coalesce->size + 1 > COALESCE_MAX_LOAD(coalesce->capacity))
+        coalesce_grow(coalesce);
+
+    entry = xmalloc(sizeof(coalesce_entry_t));
+    entry->hash = hash;
+    entry->expires = (now + coalesce->window + coalesce->tick - 1)
+                     / coalesce->tick;
+    entry->mask = mask;
+    entry->count = 1;
+    entry->wd = wd;
+    entry->dir = xmalloc(strlen(dir) + 1);
+    strcpy(entry->dir, dir);
+    entry->name = xmalloc(strlen(name) + 1);
+    strcpy(entry->name, name);
+
+    coalesce_link(&coalesce->wheel[entry->expires % COALESCE_WHEEL_SLOTS],
+                  entry);
+    coalesce_insert(coalesce, entry);
+    coalesce->size++;
+}
+
+/* Report the events whose window ended by time NOW. */
+void
+coalesce_expire(coalesce_t *coalesce, uint64_t now)
+{
+    uint64_t tick = now / coalesce->tick;
+
+    /* After a long pause, one turn of the wheel is enough to find every
+       expired entry. */
+    if (tick > coalesce->now + COALESCE_WHEEL_SLOTS)
+        coalesce->now = tick - COALESCE_WHEEL_SLOTS;
+
+    while (coalesce->size > 0 && coalesce->now < tick)
+    {
+        coalesce->now++;
+
+        coalesce_entry_t **slot
+            = &coalesce->wheel[coalesce->now % COALESCE_WHEEL_SLOTS];
+        coalesce_entry_t *entry = *slot;
+
+        /* A slot may also hold entries a whole turn or more ahead, if time
+           went by without expiring anything when they were added. */
+        while (entry != NULL)
+        {
+            coalesce_entry_t *next = entry->next;
+
+            if (entry->expires <= coalesce->now)
+            {
+                coalesce_unlink(slot, entry);
+                coalesce_emit(coalesce, entry);
+            }
+
+            entry = next;
+        }
+    }
+
+    if (coalesce->size == 0)
+        coalesce->now = tick;
+}
+
+/* Returns the number of milliseconds until the next tick at which events
+   may expire, or -1 if nothing is pending. */
+int
+coalesce_timeout(coalesce_t *coalesce, uint64_t now)
+{
+    if (coalesce->size == 0)
+        return -1;
+
+    return (int) (coalesce->tick - now % coalesce->tick);
+}
+
+/* Report all pending events, regardless of their windows. */
+void
+coalesce_flush(coalesce_t *coalesce)
+{
+    for (size_t i = 1; i <= COALESCE_WHEEL_SLOTS && coalesce->size > 0; i++)
+    {
+        coalesce_entry_t **slot
+            = &coalesce->wheel[(coalesce->now + i) % COALESCE_WHEEL_SLOTS];
+        coalesce_entry_t *entry = *slot;
+
+        *slot = NULL;
+
+        while (entry != NULL)
+        {
+            coalesce_entry_t *next = entry->next;
+            coalesce_emit(coalesce, entry);
+            entry = next;
+        }
+    }
+}
+
+void
+coalesce_free(coalesce_t *coalesce)
+{
+    for (size_t i = 0; i < COALESCE_WHEEL_SLOTS; i++)
+    {
+        coalesce_entry_t *entry = coalesce->wheel[i];
+
+        while (entry != NULL)
+        {
+            coalesce_entry_t *next = entry->next;
+            free(entry->dir);
+            free(entry->name);
+            free(entry);
+            entry = next;
+        }
+
+        coalesce->wheel[i] = NULL;
+    }
+
+    free(coalesce->table);
+    coalesce->table = NULL;
+    coalesce->capacity = 0;
+    coalesce->size = 0;
+}
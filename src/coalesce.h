@@ -0,0 +1,87 @@
+/*
+    coalesce.h -- typedefs and prototypes for coalesce.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __COALESCE_H__
+#define __COALESCE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of slots of the timing wheel, and number of ticks in a window.
+   A window spans less than a turn of the wheel, so that expiring an event
+   normally visits its slot only once. */
+#define COALESCE_WHEEL_SLOTS 64
+#define COALESCE_WINDOW_TICKS 32
+
+typedef struct coalesce coalesce_t;
+typedef struct coalesce_entry coalesce_entry_t;
+
+/* Called for every merged event when its window ends. MASK is the union of
+   the masks of the COUNT events merged. */
+typedef void (*coalesce_callback_t)(coalesce_t *coalesce, int wd,
+                                    const char *dir, const char *name,
+                                    uint32_t mask, size_t count);
+
+/* Events pending for one (watch, directory, name) key. */
+struct coalesce_entry
+{
+    coalesce_entry_t *prev; /* Previous entry in the same wheel slot. */
+    coalesce_entry_t *next; /* Next entry in the same wheel slot. */
+    uint64_t hash;
+    uint64_t expires; /* Tick at which the window ends. */
+    uint32_t mask;
+    size_t count;
+    int wd;
+    char *dir;
+    char *name;
+};
+
+/* Merges repeated events for the same file within a window. Pending events
+   are indexed by key in an open addressing hash table, and by expiry tick
+   in a hashed timing wheel, so adding an event and expiring one both take
+   constant time. Times are in milliseconds on any monotonic clock. */
+struct coalesce
+{
+    uint64_t window; /* Length of the window in milliseconds. */
+    uint64_t tick;   /* Length of a tick in milliseconds. */
+    uint64_t now;    /* The last tick processed. */
+    coalesce_entry_t *wheel[COALESCE_WHEEL_SLOTS];
+    coalesce_entry_t **table;
+    size_t capacity;
+    size_t size;
+    coalesce_callback_t callback;
+    void *data; /* User data for the callback. */
+};
+
+__BEGIN_DECLS
+
+void coalesce_init(coalesce_t *coalesce, uint64_t window,
+                   coalesce_callback_t callback);
+void coalesce_add(coalesce_t *coalesce, uint64_t now, int wd,
+                  const char *dir, const char *name, uint32_t mask);
+void coalesce_expire(coalesce_t *coalesce, uint64_t now);
+int coalesce_timeout(coalesce_t *coalesce, uint64_t now);
+void coalesce_flush(coalesce_t *coalesce);
+void coalesce_free(coalesce_t *coalesce);
+
+__END_DECLS
+
+#endif
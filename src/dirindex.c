@@ -0,0 +1,140 @@
+/*
+    dirindex.c -- client side of the index of dirutilsd.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dirindex.h"
+#include "utils.h"
+
+/* Returns the default path of the socket of dirutilsd, in the runtime
+   directory of the user, or in /tmp with the user ID in its name. */
+char *
+dirindex_socket_path()
+{
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    char *path;
+
+    if (dir != NULL && dir[0] == '/')
+    {
+        path = xmalloc(strlen(dir) + sizeof(DIRINDEX_SOCKET_NAME) + 1);
+        sprintf(path, "%s/%s", dir, DIRINDEX_SOCKET_NAME);
+    }
+    else
+    {
+        path = xmalloc(64);
+        snprintf(path, 64, "/tmp/dirutilsd-%lu.sock",
+                 (unsigned long) getuid());
+    }
+
+    return path;
+}
+
+/* Whether FIELD can be sent in a request. */
+static bool
+dirindex_field_ok(const char *field)
+{
+    return field[0] != '\0' && strpbrk(field, "\t\n") == NULL;
+}
+
+/* Ask dirutilsd listening at SOCKET_PATH for COMMAND with FLAGS on the
+   directory at DIRPATH, and PATTERN for FIND. Returns a stream positioned
+   at the results, or NULL with errno set if the daemon is not running or
+   does not index DIRPATH, so that the caller reads the directory itself. */
+FILE *
+dirindex_query(const char *socket_path, const char *command,
+               const char *flags, const char *pattern, const char *dirpath)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char *real = realpath(dirpath, NULL);
+
+    if (real == NULL)
+        return NULL;
+
+    if (strlen(socket_path) >= sizeof addr.sun_path
+        || !dirindex_field_ok(real)
+        || (pattern != NULL && !dirindex_field_ok(pattern)))
+    {
+        free(real);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd == -1 || connect(fd, (struct sockaddr *) &addr, sizeof addr) == -1)
+    {
+        int saved_errno = errno;
+
+        if (fd != -1)
+            close(fd);
+
+        free(real);
+        errno = saved_errno;
+        return NULL;
+    }
+
+    /* A daemon that is busy or stuck makes the caller walk instead. */
+    struct timeval timeout = { .tv_sec = DIRINDEX_TIMEOUT };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+    FILE *fp = fdopen(fd, "r+");
+
+    if (fp == NULL)
+    {
+        close(fd);
+        free(real);
+        return NULL;
+    }
+
+    /* Empty fields would be lost between two tabs. */
+    if (flags[0] == '\0')
+        flags = "-";
+
+    if (pattern != NULL)
+        fprintf(fp, "%s\t%s\t%s\t%s\n", command, flags, pattern, real);
+    else
+        fprintf(fp, "%s\t%s\t%s\n", command, flags, real);
+
+    free(real);
+
+    char status[256];
+
+    if (fflush(fp) != 0 || fgets(status, sizeof status, fp) == NULL
+        || strcmp(status, "OK\n") != 0)
+    {
+        fclose(fp);
+        errno = ENOENT;
+        return NULL;
+    }
+
+    return fp;
+}
@@ -0,0 +1,61 @@
+/*
+    dirindex.h -- typedefs and prototypes for dirindex.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __DIRINDEX_H__
+#define __DIRINDEX_H__
+
+#include <limits.h>
+#include <stdio.h>
+
+/* Name of the socket of dirutilsd, in $XDG_RUNTIME_DIR. */
+#define DIRINDEX_SOCKET_NAME "dirutilsd.sock"
+
+/* Longest request line accepted by dirutilsd. */
+#define DIRINDEX_MAX_REQUEST (2 * PATH_MAX + 64)
+
+/* Seconds a client waits on dirutilsd before walking the directory
+   itself. */
+#define DIRINDEX_TIMEOUT 5
+
+/* Queries to the index of dirutilsd go over a Unix stream socket, one per
+   connection. A request is a single line of fields separated by tabs: the
+   command (LIST, FIND or STATS), its flags or `-', the pattern of FIND,
+   and the absolute path of a directory. The answer starts with a line
+   that is either "OK" or "ERR" followed by a message, then the results,
+   until the daemon closes the connection. The daemon only listens once
+   its roots are indexed:
+
+   - LIST and FIND: the paths of the entries below the directory relative
+     to it, one per line, with a slash after those of directories. The
+     flag `r' lists the whole subtree.
+   - STATS: the counts of files, directories, links, entries and hidden
+     entries, and the size of the files, separated by spaces, as counted by
+     dirstats with the flags `r', `a' and `s'. */
+
+__BEGIN_DECLS
+
+char *dirindex_socket_path();
+FILE *dirindex_query(const char *socket_path, const char *command,
+                     const char *flags, const char *pattern,
+                     const char *dirpath);
+
+__END_DECLS
+
+#endif
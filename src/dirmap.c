@@ -19,41 +19,442 @@
 
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "dirmap.h"
+#include "hash.h"
+
+/* The tables grow when they are more than 3/4 full. */
+#define DIRMAP_MIN_CAPACITY 64
+#define DIRMAP_MAX_LOAD(capacity) ((capacity) / 4 * 3)
+
+static inline size_t
+dirmap_wd_slot(dirmap_t *map, int wd)
+{
+    /* Watch descriptors are small consecutive integers, so spread them
+       with a multiplicative hash. */
+    return ((uint64_t) wd * 0x9E3779B97F4A7C15ULL >> 32) & (map->capacity - 1);
+}
+
+static inline size_t
+dirmap_name_slot(dirmap_t *map, uint64_t hash)
+{
+    return hash & (map->capacity - 1);
+}
+
+static void
+dirmap_insert_wd(dirmap_t *map, dirmap_entry_t *entry)
+{
+    size_t i = dirmap_wd_slot(map, entry->wd);
+
+    while (map->by_wd[i] != NULL)
+        i = (i + 1) & (map->capacity - 1);
+
+    map->by_wd[i] = entry;
+}
+
+static void
+dirmap_insert_name(dirmap_t *map, dirmap_entry_t *entry)
+{
+    size_t i = dirmap_name_slot(map, entry->hash);
+
+    while (map->by_name[i] != NULL)
+        i = (i + 1) & (map->capacity - 1);
+
+    map->by_name[i] = entry;
+}
+
+static bool
+dirmap_grow(dirmap_t *map)
+{
+    size_t old_capacity = map->capacity;
+    dirmap_entry_t **old_by_wd = map->by_wd;
+    dirmap_entry_t **old_by_name = map->by_name;
+    size_t capacity
+        = old_capacity == 0 ? DIRMAP_MIN_CAPACITY : old_capacity * 2;
+
+    dirmap_entry_t **by_wd = calloc(capacity, sizeof(dirmap_entry_t *));
+    dirmap_entry_t **by_name = calloc(capacity, sizeof(dirmap_entry_t *));
+
+    if (by_wd == NULL || by_name == NULL)
+    {
+        free(by_wd);
+        free(by_name);
+        return false;
+    }
+
+    map->by_wd = by_wd;
+    map->by_name = by_name;
+    map->capacity = capacity;
+
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_by_wd[i] != NULL)
+        {
+            dirmap_insert_wd(map, old_by_wd[i]);
+            dirmap_insert_name(map, old_by_wd[i]);
+        }
+    }
+
+    free(old_by_wd);
+    free(old_by_name);
+
+    return true;
+}
+
+/* Remove slot I from TABLE by shifting back the entries that follow it in
+   the same probe sequence, so that no tombstones are needed. SLOT returns
+   the home slot of an entry. */
+static void
+dirmap_table_delete(dirmap_t *map, dirmap_entry_t **table, size_t i,
+                    size_t (*slot)(dirmap_t *, dirmap_entry_t *))
+{
+    size_t mask = map->capacity - 1;
+    size_t j = i;
+
+    while (true)
+    {
+        j = (j + 1) & mask;
+
+        if (table[j] == NULL)
+            break;
+
+        size_t home = slot(map, table[j]);
+
+        /* Move the entry at J into the hole at I, unless its home slot lies
+           cyclically in (I, J]. */
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            table[i] = table[j];
+            i = j;
+        }
+    }
+
+    table[i] = NULL;
+}
+
+static size_t
+dirmap_entry_wd_slot(dirmap_t *map, dirmap_entry_t *entry)
+{
+    return dirmap_wd_slot(map, entry->wd);
+}
+
+static size_t
+dirmap_entry_name_slot(dirmap_t *map, dirmap_entry_t *entry)
+{
+    return dirmap_name_slot(map, entry->hash);
+}
+
+static bool
+dirmap_count_len(dirmap_t *map, size_t len)
+{
+    if (len >= map->len_counts_size)
+    {
+        size_t size = map->len_counts_size == 0 ? 256 : map->len_counts_size;
+
+        while (len >= size)
+            size *= 2;
+
+        size_t *counts = realloc(map->len_counts, sizeof(size_t) * size);
+
+        if (counts == NULL)
+            return false;
+
+        memset(counts + map->len_counts_size, 0,
+               sizeof(size_t) * (size - map->len_counts_size));
+        map->len_counts = counts;
+        map->len_counts_size = size;
+    }
+
+    map->len_counts[len]++;
+
+    if (len > map->max_dirpath_len)
+        map->max_dirpath_len = len;
+
+    return true;
+}
+
+static void
+dirmap_uncount_len(dirmap_t *map, size_t len)
+{
+    map->len_counts[len]--;
+
+    while (map->max_dirpath_len > 0
+           && map->len_counts[map->max_dirpath_len] == 0)
+        map->max_dirpath_len--;
+}
 
 void
 dirmap_init(dirmap_t *map)
 {
-    map->entries = NULL;
+    map->by_wd = NULL;
+    map->by_name = NULL;
+    map->capacity = 0;
     map->size = 0;
     map->max_dirpath_len = 0;
+    map->len_counts = NULL;
+    map->len_counts_size = 0;
+    map->free_data = NULL;
+    map->newest = NULL;
+    map->oldest = NULL;
 }
 
-bool
-dirmap_add(dirmap_t *map, char *dirpath, int wd)
+static void
+dirmap_free_entry(dirmap_t *map, dirmap_entry_t *entry)
+{
+    if (entry->data != NULL && map->free_data != NULL)
+        map->free_data(entry->data);
+
+    free(entry->name);
+    free(entry);
+}
+
+static inline uint64_t
+dirmap_hash_name(dirmap_entry_t *parent, const char *name, size_t len)
+{
+    return hash64(name, len, (uint64_t) (uintptr_t) parent);
+}
+
+static inline bool
+dirmap_ends_with_slash(dirmap_entry_t *entry)
+{
+    return entry->namelen > 0 && entry->name[entry->namelen - 1] == '/';
+}
+
+/* Length of the path of ENTRY if its parent's path length is known. */
+static inline size_t
+dirmap_child_pathlen(dirmap_entry_t *entry)
+{
+    if (entry->parent == NULL)
+        return entry->namelen;
+
+    return entry->parent->pathlen + !dirmap_ends_with_slash(entry->parent)
+           + entry->namelen;
+}
+
+static void
+dirmap_set_pathlen(dirmap_t *map, dirmap_entry_t *entry, size_t len)
+{
+    if (entry->pathlen == len)
+        return;
+
+    dirmap_uncount_len(map, entry->pathlen);
+
+    /* The histogram was large enough for the old length. If it cannot grow
+       for the new one, keep the old length. */
+    if (!dirmap_count_len(map, len))
+    {
+        dirmap_count_len(map, entry->pathlen);
+        return;
+    }
+
+    entry->pathlen = len;
+}
+
+static void
+dirmap_link(dirmap_entry_t *entry, dirmap_entry_t *parent)
+{
+    entry->parent = parent;
+    entry->prev = NULL;
+    entry->next = parent != NULL ? parent->children : NULL;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry;
+
+    if (parent != NULL)
+        parent->children = entry;
+}
+
+static void
+dirmap_unlink(dirmap_entry_t *entry)
+{
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else if (entry->parent != NULL)
+        entry->parent->children = entry->next;
+
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+
+    entry->parent = entry->prev = entry->next = NULL;
+}
+
+/* Record ROOT as the root of ENTRY and everything below it. */
+static void
+dirmap_set_root(dirmap_entry_t *entry, dirmap_entry_t *root)
 {
-    assert(dirpath);
+    entry->root = root;
+
+    for (dirmap_entry_t *child = entry->children; child != NULL;
+         child = child->next)
+        dirmap_set_root(child, root);
+}
+
+/* Insert ENTRY as the most recently used one. */
+static void
+dirmap_lru_push(dirmap_t *map, dirmap_entry_t *entry)
+{
+    entry->older = map->newest;
+    entry->newer = NULL;
+
+    if (map->newest != NULL)
+        map->newest->newer = entry;
+    else
+        map->oldest = entry;
+
+    map->newest = entry;
+}
+
+static void
+dirmap_lru_unlink(dirmap_t *map, dirmap_entry_t *entry)
+{
+    if (entry->newer != NULL)
+        entry->newer->older = entry->older;
+    else
+        map->newest = entry->older;
+
+    if (entry->older != NULL)
+        entry->older->newer = entry->newer;
+    else
+        map->oldest = entry->newer;
+
+    entry->newer = entry->older = NULL;
+}
+
+static void
+dirmap_delete_from(dirmap_t *map, dirmap_entry_t **table, size_t home,
+                   dirmap_entry_t *entry,
+                   size_t (*slot)(dirmap_t *, dirmap_entry_t *))
+{
+    size_t i = home;
+
+    while (table[i] != entry)
+        i = (i + 1) & (map->capacity - 1);
+
+    dirmap_table_delete(map, table, i, slot);
+}
+
+/* Add the directory NAME inside PARENT, watched by WD. If PARENT is NULL,
+   NAME is the full path of a root directory. If WD is already mapped,
+   which happens when a directory is watched again, its entry is moved to
+   the new place instead. Returns the entry, or NULL if out of memory. */
+dirmap_entry_t *
+dirmap_add(dirmap_t *map, dirmap_entry_t *parent, const char *name, int wd)
+{
+    assert(name);
     assert(wd > 0);
 
-    map->entries
-        = realloc(map->entries, sizeof(dirmap_entry_t) * (map->size + 1));
+    dirmap_entry_t *entry = dirmap_find_by_wd(map, wd);
+
+    if (entry != NULL)
+        return dirmap_move(map, entry, parent, name) ? entry : NULL;
+
+    size_t namelen = strlen(name);
+
+    /* Trailing slashes of root paths would be doubled in the paths of
+       their children. */
+    while (parent == NULL && namelen > 1 && name[namelen - 1] == '/')
+        namelen--;
+
+    char *copy = strndup(name, namelen);
+
+    if (copy == NULL)
+        return NULL;
 
-    if (map->entries == NULL)
+    dirmap_entry_t *old = dirmap_find_child(map, parent, copy);
+
+    /* A directory that was replaced before the removal of the old one was
+       noticed. */
+    if (old != NULL)
+        dirmap_remove(map, old, NULL, NULL);
+
+    if (map->size + 1 > DIRMAP_MAX_LOAD(map->capacity) && !dirmap_grow(map))
     {
-        return false;
+        free(copy);
+        return NULL;
+    }
+
+    entry = malloc(sizeof(dirmap_entry_t));
+
+    if (entry == NULL)
+    {
+        free(copy);
+        return NULL;
+    }
+
+    entry->name = copy;
+
+    entry->namelen = namelen;
+    entry->hash = dirmap_hash_name(parent, entry->name, namelen);
+    entry->wd = wd;
+    entry->mask = 0;
+    entry->data = NULL;
+    entry->children = NULL;
+    entry->root = parent != NULL ? parent->root : entry;
+    dirmap_link(entry, parent);
+    entry->pathlen = dirmap_child_pathlen(entry);
+
+    if (!dirmap_count_len(map, entry->pathlen))
+    {
+        dirmap_unlink(entry);
+        free(entry->name);
+        free(entry);
+        return NULL;
     }
 
-    map->entries[map->size++]
-        = (dirmap_entry_t){ dirpath : strdup(dirpath), wd : wd };
+    dirmap_insert_wd(map, entry);
+    dirmap_insert_name(map, entry);
+    dirmap_lru_push(map, entry);
+    map->size++;
+
+    return entry;
+}
+
+/* Move ENTRY to NAME inside PARENT, after its directory was renamed. Only
+   ENTRY itself is updated, its subtree follows it. */
+bool
+dirmap_move(dirmap_t *map, dirmap_entry_t *entry, dirmap_entry_t *parent,
+            const char *name)
+{
+    assert(entry);
+    assert(name);
+
+    size_t namelen = strlen(name);
+
+    if (entry->parent == parent && entry->namelen == namelen
+        && memcmp(entry->name, name, namelen) == 0)
+        return true;
+
+    dirmap_entry_t *old = dirmap_find_child(map, parent, name);
+
+    /* The rename replaced an empty directory. */
+    if (old != NULL)
+        dirmap_remove(map, old, NULL, NULL);
+
+    char *newname = strdup(name);
+
+    if (newname == NULL)
+        return false;
 
-    size_t len = strlen(dirpath);
+    dirmap_delete_from(map, map->by_name, dirmap_name_slot(map, entry->hash),
+                       entry, &dirmap_entry_name_slot);
+    dirmap_unlink(entry);
 
-    map->max_dirpath_len
-        = map->max_dirpath_len < len ? len : map->max_dirpath_len;
+    free(entry->name);
+    entry->name = newname;
+    entry->namelen = namelen;
+    entry->hash = dirmap_hash_name(parent, newname, namelen);
+
+    dirmap_link(entry, parent);
+    dirmap_insert_name(map, entry);
+    dirmap_set_pathlen(map, entry, dirmap_child_pathlen(entry));
+
+    /* Moved to the tree of another root. */
+    if (entry->root != (parent != NULL ? parent->root : entry))
+        dirmap_set_root(entry, parent != NULL ? parent->root : entry);
 
     return true;
 }
@@ -64,25 +465,140 @@ dirmap_find_by_wd(dirmap_t *map, int wd)
     assert(map);
     assert(wd > 0);
 
-    for (size_t i = 0; i < map->size; i++)
+    if (map->capacity == 0)
+        return NULL;
+
+    for (size_t i = dirmap_wd_slot(map, wd); map->by_wd[i] != NULL;
+         i = (i + 1) & (map->capacity - 1))
+    {
+        if (map->by_wd[i]->wd == wd)
+            return map->by_wd[i];
+    }
+
+    return NULL;
+}
+
+/* Find the directory NAME inside PARENT, or the root NAME if PARENT is
+   NULL. */
+dirmap_entry_t *
+dirmap_find_child(dirmap_t *map, dirmap_entry_t *parent, const char *name)
+{
+    assert(map);
+    assert(name);
+
+    if (map->capacity == 0)
+        return NULL;
+
+    size_t len = strlen(name);
+    uint64_t hash = dirmap_hash_name(parent, name, len);
+
+    for (size_t i = dirmap_name_slot(map, hash); map->by_name[i] != NULL;
+         i = (i + 1) & (map->capacity - 1))
     {
-        if (map->entries[i].wd == wd)
-            return &map->entries[i];
+        dirmap_entry_t *entry = map->by_name[i];
+
+        if (entry->hash == hash && entry->parent == parent
+            && entry->namelen == len && memcmp(entry->name, name, len) == 0)
+            return entry;
     }
 
     return NULL;
 }
 
+/* Remove ENTRY and everything below it, calling CALLBACK for each removed
+   entry, children first. */
+void
+dirmap_remove(dirmap_t *map, dirmap_entry_t *entry,
+              dirmap_remove_callback_t callback, void *data)
+{
+    assert(entry);
+
+    while (entry->children != NULL)
+        dirmap_remove(map, entry->children, callback, data);
+
+    if (callback != NULL)
+        callback(entry, data);
+
+    dirmap_delete_from(map, map->by_wd, dirmap_wd_slot(map, entry->wd), entry,
+                       &dirmap_entry_wd_slot);
+    dirmap_delete_from(map, map->by_name, dirmap_name_slot(map, entry->hash),
+                       entry, &dirmap_entry_name_slot);
+    dirmap_unlink(entry);
+    dirmap_lru_unlink(map, entry);
+    dirmap_uncount_len(map, entry->pathlen);
+    map->size--;
+
+    dirmap_free_entry(map, entry);
+}
+
+/* Record that ENTRY was just used, which makes it the newest entry. */
+void
+dirmap_touch(dirmap_t *map, dirmap_entry_t *entry)
+{
+    assert(entry);
+
+    if (map->newest == entry)
+        return;
+
+    dirmap_lru_unlink(map, entry);
+    dirmap_lru_push(map, entry);
+}
+
+/* Build the full path of ENTRY into BUF, like snprintf(): the path is only
+   written if it fits into SIZE bytes including the terminating NUL, and its
+   length is returned either way. The cached path length of ENTRY is
+   refreshed on the way, since it goes stale when an ancestor is renamed. */
+size_t
+dirmap_path(dirmap_t *map, dirmap_entry_t *entry, char *buf, size_t size)
+{
+    assert(entry);
+
+    size_t len = 0;
+
+    for (dirmap_entry_t *e = entry; e != NULL; e = e->parent)
+    {
+        len += e->namelen;
+
+        if (e->parent != NULL && !dirmap_ends_with_slash(e->parent))
+            len++;
+    }
+
+    dirmap_set_pathlen(map, entry, len);
+
+    if (len + 1 > size)
+        return len;
+
+    char *p = buf + len;
+
+    *p = '\0';
+
+    for (dirmap_entry_t *e = entry; e != NULL; e = e->parent)
+    {
+        p -= e->namelen;
+        memcpy(p, e->name, e->namelen);
+
+        if (e->parent != NULL && !dirmap_ends_with_slash(e->parent))
+            *--p = '/';
+    }
+
+    return len;
+}
+
 void
 dirmap_free(dirmap_t *map)
 {
-    if (map->entries != NULL)
+    if (map->by_wd != NULL)
     {
-        for (size_t i = 0; i < map->size; i++)
-            if (map->entries[i].dirpath != NULL)
-                free(map->entries[i].dirpath);
+        for (size_t i = 0; i < map->capacity; i++)
+        {
+            if (map->by_wd[i] != NULL)
+                dirmap_free_entry(map, map->by_wd[i]);
+        }
 
-        free(map->entries);
-        map->entries = NULL;
+        free(map->by_wd);
+        free(map->by_name);
     }
+
+    free(map->len_counts);
+    dirmap_init(map);
 }
@@ -22,31 +22,79 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #define DIRMAP_INIT                                                           \
     {                                                                         \
-        .entries = NULL, .size = 0                                            \
+        .by_wd = NULL, .by_name = NULL, .capacity = 0, .size = 0,             \
+        .max_dirpath_len = 0, .len_counts = NULL, .len_counts_size = 0,       \
+        .free_data = NULL, .newest = NULL, .oldest = NULL                     \
     }
 
-typedef struct
+typedef struct dirmap_entry dirmap_entry_t;
+
+/* A watched directory. Directories form a tree: each entry only stores its
+   own name and a link to its parent, so renaming a directory is a single
+   entry update no matter how many directories are below it. Roots have no
+   parent and store their full path as the name, and every entry records
+   the root of its tree. Pointers to entries stay valid until the entry is
+   removed. */
+struct dirmap_entry
 {
-    char *dirpath;
+    dirmap_entry_t *parent;
+    dirmap_entry_t *children; /* First child. */
+    dirmap_entry_t *prev;     /* Previous sibling. */
+    dirmap_entry_t *next;     /* Next sibling. */
+    dirmap_entry_t *newer;    /* Neighbours in the order of last use. */
+    dirmap_entry_t *older;
+    dirmap_entry_t *root; /* The root above the entry, or itself. */
+    char *name;
+    size_t namelen;
+    size_t pathlen; /* Length of the full path when it was last built. */
+    uint64_t hash;  /* Hash of the parent and the name. */
     int wd;
-} dirmap_entry_t;
+    uint32_t mask; /* On roots, the events watched for in their tree. */
+    void *data; /* Data of the user, released with the free_data hook. */
+};
 
+/* Maps watch descriptors to directories, and (parent, name) pairs to
+   directories. Both indexes are open addressing hash tables with linear
+   probing, sharing the same capacity, which is always a power of two. */
 typedef struct
 {
-    dirmap_entry_t *entries;
+    dirmap_entry_t **by_wd;
+    dirmap_entry_t **by_name;
+    size_t capacity;
     size_t size;
     size_t max_dirpath_len;
+    size_t *len_counts; /* Number of entries for each path length. */
+    size_t len_counts_size;
+    void (*free_data)(void *data); /* Called for the data of every entry
+                                      that is freed, if not NULL. */
+    dirmap_entry_t *newest;        /* Entries from the most recently used,
+                                      or added, to the least. */
+    dirmap_entry_t *oldest;
 } dirmap_t;
 
+/* Called for every entry removed by dirmap_remove(). */
+typedef void (*dirmap_remove_callback_t)(dirmap_entry_t *entry, void *data);
+
 __BEGIN_DECLS
 
 void dirmap_init(dirmap_t *map);
-bool dirmap_add(dirmap_t *map, char *dirpath, int wd);
+dirmap_entry_t *dirmap_add(dirmap_t *map, dirmap_entry_t *parent,
+                           const char *name, int wd);
+bool dirmap_move(dirmap_t *map, dirmap_entry_t *entry,
+                 dirmap_entry_t *parent, const char *name);
+void dirmap_remove(dirmap_t *map, dirmap_entry_t *entry,
+                   dirmap_remove_callback_t callback, void *data);
+void dirmap_touch(dirmap_t *map, dirmap_entry_t *entry);
 void dirmap_free(dirmap_t *map);
 dirmap_entry_t *dirmap_find_by_wd(dirmap_t *map, int wd);
+dirmap_entry_t *dirmap_find_child(dirmap_t *map, dirmap_entry_t *parent,
+                                  const char *name);
+size_t dirmap_path(dirmap_t *map, dirmap_entry_t *entry, char *buf,
+                   size_t size);
 
 __END_DECLS
 
@@ -18,16 +18,24 @@
 */
 
 #include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
 #include <getopt.h>
+#include <limits.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "dirindex.h"
+#include "dirwalk.h"
+#include "dupfind.h"
+#include "throttle.h"
 #include "utils.h"
 
 #define MAX_PATHS 128
@@ -40,14 +48,36 @@ typedef struct
     FILE *outbuf;
     int limit;
     size_t filecount;
+    bool duplicates;
+    int jobs;
+    char *pattern;       /* Only print the entries with a matching name, if
+                            not NULL. */
+    char *daemon_socket; /* Ask dirutilsd at this socket first, if not
+                            NULL. */
 } config_t;
 
+enum
+{
+    OPT_IONICE = CHAR_MAX + 1,
+    OPT_RATE,
+    OPT_ADAPTIVE,
+    OPT_NAME,
+    OPT_DAEMON
+};
+
 static struct option const long_options[] = {
     {"help",       no_argument,       NULL, 'h'},
+    { "duplicates", no_argument,      NULL, 'd'},
+    { "jobs",      required_argument, NULL, 'j'},
     { "recursive", no_argument,       NULL, 'r'},
     { "version",   no_argument,       NULL, 'v'},
     { "limit",     required_argument, NULL, 'l'},
     { "output",    required_argument, NULL, 'o'},
+    { "ionice",    required_argument, NULL, OPT_IONICE},
+    { "rate",      required_argument, NULL, OPT_RATE},
+    { "adaptive",  required_argument, NULL, OPT_ADAPTIVE},
+    { "name",      required_argument, NULL, OPT_NAME},
+    { "daemon",    optional_argument, NULL, OPT_DAEMON},
     { NULL,        0,                 NULL, 0  },
 };
 
@@ -58,8 +88,18 @@ config_t config = {
     .outbuf = NULL,
     .limit = 0,
     .filecount = 0,
+    .duplicates = false,
+    .jobs = 0,
+    .pattern = NULL,
+    .daemon_socket = NULL,
 };
 
+/* Candidate files collected in duplicates mode. */
+static dupfind_t dupfind = DUPFIND_INIT;
+
+/* Limits the rate of directory reads. */
+static throttle_t throttle = THROTTLE_INIT;
+
 static void
 outbuf_printf(const char *fmt, ...)
 {
@@ -98,6 +138,9 @@ dirscan_cleanup()
         fclose(config.outbuf);
     }
 
+    dupfind_free(&dupfind);
+    free(config.daemon_socket);
+
     if (config.dirpaths == NULL)
         return;
 
@@ -123,90 +166,117 @@ dirscan_init(int argc, char **argv)
     }
 }
 
-__attribute__((__nonnull__)) static void
-dirscan_read_dirent(char *path, u_char type)
+static dirwalk_action_t
+dirscan_visit(dirwalk_t *walk, const dirwalk_entry_t *entry)
 {
     if (config.limit > 0 && config.filecount >= config.limit)
-        return;
+        return DIRWALK_STOP;
 
-    if (type == DT_DIR)
-    {
-        DIR *dir;
-        struct dirent *entry;
+    /* Entries that do not match are not printed, but the directories
+       among them are still descended into. */
+    bool match = config.duplicates || config.pattern == NULL
+                 || fnmatch(config.pattern, entry->name, 0) == 0;
 
-        outbuf_printf("%s/\n", path);
+    if (match)
         config.filecount++;
 
-        if (!config.recursive)
-            return;
+    if (entry->type == DT_DIR)
+    {
+        if (!config.duplicates && match)
+            outbuf_printf("%s/\n", entry->path);
 
-        dir = opendir(path);
+        return config.recursive ? DIRWALK_CONTINUE : DIRWALK_SKIP;
+    }
 
-        if (!dir)
-            print_error(true, true, "failed to open child directory: %s",
-                        path);
+    if (!match)
+        return DIRWALK_SKIP;
 
-        while ((entry = readdir(dir)) != NULL)
-        {
-            if (STREQ(entry->d_name, ".") || STREQ(entry->d_name, ".."))
-                continue;
+    if (config.duplicates)
+    {
+        struct stat st;
 
-            size_t pathlen = strlen(path);
-            char *newpath = xmalloc(pathlen + strlen(entry->d_name) + 2);
+        if (!dirwalk_stat(walk, entry, &st))
+            print_error(true, false, "cannot stat `%s'", entry->path);
+        else if (S_ISREG(st.st_mode) && st.st_size > 0)
+            dupfind_add(&dupfind, entry->path, st.st_size, st.st_dev,
+                        st.st_ino);
+    }
+    else
+        outbuf_puts((char *) entry->path);
 
-            strcpy(newpath, path);
+    return DIRWALK_SKIP;
+}
 
-            if (path[pathlen - 1] != '/')
-                strcat(newpath, "/");
+static bool
+dirscan_error(dirwalk_t *walk, const dirwalk_entry_t *entry)
+{
+    print_error(true, true,
+                entry->depth == 0 ? "failed to open directory: %s"
+                                  : "failed to open child directory: %s",
+                entry->path);
 
-            strcat(newpath, entry->d_name);
+    return false;
+}
 
-            dirscan_read_dirent(newpath, entry->d_type);
-            free(newpath);
-        }
+/* Print the entries of DIRPATH from the index of dirutilsd. Returns false
+   if the daemon is not running or does not index DIRPATH. */
+static bool
+dirscan_query_daemon(const char *dirpath)
+{
+    const char *command = config.pattern != NULL ? "FIND" : "LIST";
+    FILE *fp = dirindex_query(config.daemon_socket, command,
+                              config.recursive ? "r" : "", config.pattern,
+                              dirpath);
 
-        closedir(dir);
-    }
-    else
+    if (fp == NULL)
+        return false;
+
+    /* Paths are joined the way the walker joins them. */
+    size_t dirlen = strlen(dirpath);
+    bool slash = dirlen > 0 && dirpath[dirlen - 1] != '/';
+    char *line = NULL;
+    size_t size = 0;
+
+    while (getline(&line, &size, fp) != -1)
     {
-        outbuf_puts(path);
+        if (config.limit > 0 && config.filecount >= config.limit)
+            break;
+
         config.filecount++;
+        outbuf_printf("%s%s%s", dirpath, slash ? "/" : "", line);
     }
-}
 
-static void
-dirscan_read_dirs()
-{
-    for (int i = 0; i < config.count; i++)
-    {
-        DIR *dir = opendir(config.dirpaths[0]);
-        struct dirent *entry;
+    free(line);
 
-        if (!dir)
-            print_error(true, true, "failed to open directory: %s",
-                        config.dirpaths[0]);
-
-        while ((entry = readdir(dir)) != NULL)
-        {
-            if (STREQ(entry->d_name, ".") || STREQ(entry->d_name, ".."))
-                continue;
+    /* Part of the entries are printed already, walking would repeat
+       them. */
+    if (ferror(fp))
+        print_error(true, true, "%s: lost the answer of dirutilsd", dirpath);
 
-            size_t pathlen = strlen(config.dirpaths[0]);
-            char *path = xmalloc(pathlen + strlen(entry->d_name) + 2);
+    fclose(fp);
 
-            strcpy(path, config.dirpaths[0]);
+    return true;
+}
 
-            if (path[pathlen - 1] != '/')
-                strcat(path, "/");
+static void
+dirscan_read_dirs()
+{
+    dirwalk_t walk = DIRWALK_INIT;
 
-            strcat(path, entry->d_name);
+    walk.visit = &dirscan_visit;
+    walk.error = &dirscan_error;
+    walk.throttle = &throttle;
 
-            dirscan_read_dirent(path, entry->d_type);
-            free(path);
-        }
+    for (int i = 0; i < config.count; i++)
+    {
+        if (config.daemon_socket != NULL && !config.duplicates
+            && dirscan_query_daemon(config.dirpaths[i]))
+            continue;
 
-        closedir(dir);
+        dirwalk_run(&walk, config.dirpaths[i]);
     }
+
+    dirwalk_free(&walk);
 }
 
 static void
@@ -217,13 +287,34 @@ Scans the given DIRECTORY or DIRECTORIES and prints the file paths in the\
  DIRECTORY or DIRECTORIES.\n\
 \n\
 Options:\n\
+      --daemon[=SOCKET]   Ask the index of dirutilsd listening at SOCKET\n\
+                           (default: its default socket) for the entries,\n\
+                           and only read the directories it does not\n\
+                           index.\n\
+  -d, --duplicates        Print groups of regular files with identical\n\
+                           contents instead of the file list. Groups are\n\
+                           separated by empty lines. Empty files are\n\
+                           ignored, and hard links to the same file are\n\
+                           only listed once.\n\
   -h, --help              Show this help and exit.\n\
+  -j, --jobs=<N>          Use N threads to hash files in duplicates mode.\n\
+                           Defaults to the number of online CPUs.\n\
   -l, --limit=<LIMIT>     Set a limit on how many files/directories the program\n\
                            should scan.\n\
+      --name=PATTERN      Only print the entries whose name matches the\n\
+                           shell PATTERN.\n\
   -o, --output=<FILE>     Save the scanned file list into the FILE.\n\
   -r, --recursive         Scan the directories recursively.\n\
   -v, --version           Show the version information of this program.\n\
 \n\
+I/O control options:\n\
+      --adaptive=MS       Slow down while the average latency of directory\n\
+                           reads is above MS milliseconds.\n\
+      --ionice=CLASS[:LEVEL]\n\
+                          Set the I/O scheduling class (realtime,\n\
+                           best-effort or idle) and LEVEL (0-7).\n\
+      --rate=OPS          Limit directory reads to OPS per second.\n\
+\n\
 This program is a part of dirutils v%s.\n\
 Report bugs to: <%s>.\n\
 Dirutils home page: <%s>.\n\
@@ -254,6 +345,7 @@ int
 main(int argc, char **argv)
 {
     int c, option_index;
+    double rate = 0, latency_threshold = 0;
 
     config.outbuf = stdout;
 
@@ -261,7 +353,7 @@ main(int argc, char **argv)
     set_program_name(argv[0]);
 
     while (
-        (c = getopt_long(argc, argv, "hrvo:l:", long_options, &option_index))
+        (c = getopt_long(argc, argv, "dhj:rvo:l:", long_options, &option_index))
         != -1)
     {
         switch (c)
@@ -278,6 +370,26 @@ main(int argc, char **argv)
                 config.recursive = true;
                 break;
 
+            case 'd':
+                config.duplicates = true;
+                break;
+
+            case 'j':
+            {
+                char *end;
+
+                errno = 0;
+                unsigned long jobs = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg || jobs < 1
+                    || jobs > INT_MAX)
+                    print_error(false, true,
+                                "Invalid number of jobs specified.");
+
+                config.jobs = jobs;
+            }
+            break;
+
             case 'l':
                 config.limit = atoi(optarg);
 
@@ -320,14 +432,64 @@ main(int argc, char **argv)
             }
             break;
 
+            case OPT_NAME:
+                config.pattern = optarg;
+                break;
+
+            case OPT_DAEMON:
+                free(config.daemon_socket);
+                config.daemon_socket = optarg != NULL ? strdup(optarg)
+                                                      : dirindex_socket_path();
+                break;
+
+            case OPT_IONICE:
+            {
+                ioprio_class_t class;
+                int level;
+
+                if (!throttle_parse_ioprio(optarg, &class, &level))
+                    print_error(false, true, "invalid I/O priority: %s",
+                                optarg);
+
+                if (!throttle_set_ioprio(class, level))
+                    print_error(true, true, "cannot set I/O priority");
+            }
+            break;
+
+            case OPT_RATE:
+                if (!throttle_parse_value(optarg, &rate))
+                    print_error(false, true, "invalid rate: %s", optarg);
+
+                break;
+
+            case OPT_ADAPTIVE:
+                if (!throttle_parse_value(optarg, &latency_threshold))
+                    print_error(false, true, "invalid latency threshold: %s",
+                                optarg);
+
+                break;
+
             case '?':
             default:
                 exit(EXIT_FAILURE);
         }
     }
 
+    throttle_init(&throttle, rate, latency_threshold / 1000);
+
     dirscan_init(argc, argv);
     dirscan_read_dirs();
 
+    if (config.duplicates)
+    {
+        if (config.jobs == 0)
+        {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            config.jobs = cpus < 1 ? 1 : cpus;
+        }
+
+        dupfind_run(&dupfind, config.jobs, config.outbuf);
+    }
+
     return 0;
 }
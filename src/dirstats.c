@@ -18,13 +18,26 @@
 */
 
 #include <dirent.h>
+#include <errno.h>
 #include <getopt.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirindex.h"
+#include "dirmap.h"
+#include "dirwalk.h"
+#include "snapshot.h"
+#include "throttle.h"
 #include "utils.h"
+#include "watcher.h"
 
 #ifdef HAVE_SYS_STAT_H
 #include <sys/stat.h>
@@ -42,6 +55,8 @@ typedef struct
     size_t childcount;
     size_t hiddencount;
     size_t dirsize;
+    time_t newest_mtime; /* Only computed in cold data mode. */
+    time_t newest_atime; /* Only computed in cold data mode. */
 } dirstats_t;
 
 typedef struct
@@ -49,52 +64,67 @@ typedef struct
     bool recursive;
     bool count_hidden_files;
     bool filesize;
+    bool inode_order;
+    long cold_days;     /* Cold data mode if greater than 0. */
+    time_t cold_cutoff; /* Entries older than this are cold. */
+    bool follow;            /* Keep the totals up to date from events. */
+    unsigned long interval; /* Seconds between two totals when following. */
+    char *daemon_socket;    /* Ask dirutilsd at this socket first, if not
+                               NULL. */
     verbosity_t verbosity;
 } dirstats_config_t;
 
-static const struct option long_options[] = {
-    {"recursive", no_argument,       NULL, 'r'},
-    { "all",      no_argument,       NULL, 'a'},
-    { "verbose",  optional_argument, NULL, 'V'},
-    { "version",  no_argument,       NULL, 'v'},
-    { "help",     no_argument,       NULL, 'h'},
-    { "size",     no_argument,       NULL, 's'},
-    { NULL,       0,                 NULL, 0  }
-};
+/* Number of cold subtrees kept for the report. */
+#define DIRSTATS_COLD_TOP 20
 
-static dirstats_config_t config;
+/* How often the totals are printed when following, in seconds. */
+#define DIRSTATS_INTERVAL 60
 
-static ssize_t
-get_file_size(char *filename, bool seek_back)
+/* A subtree where nothing was modified or accessed since the cutoff. */
+typedef struct
 {
+    char *path;
     size_t size;
+    time_t newest;
+} dirstats_cold_t;
 
-#ifdef HAVE_SYS_STAT_H
-    struct stat statresult;
-
-    if (stat(filename, &statresult) != 0)
-        return -1;
-
-    size = statresult.st_size;
-#else
-    FILE *fp = fopen(filename, "r");
-
-    if (fp == NULL)
-        return -1;
-
-    if (fseek(fp, 0, SEEK_END) != 0)
-        return -1;
+enum
+{
+    OPT_IONICE = CHAR_MAX + 1,
+    OPT_RATE,
+    OPT_ADAPTIVE,
+    OPT_COLD,
+    OPT_INTERVAL,
+    OPT_DAEMON
+};
 
-    size = ftell(fp);
+static const struct option long_options[] = {
+    {"recursive",    no_argument,       NULL, 'r'},
+    { "all",         no_argument,       NULL, 'a'},
+    { "verbose",     optional_argument, NULL, 'V'},
+    { "version",     no_argument,       NULL, 'v'},
+    { "help",        no_argument,       NULL, 'h'},
+    { "size",        no_argument,       NULL, 's'},
+    { "inode-order", no_argument,       NULL, 'i'},
+    { "ionice",      required_argument, NULL, OPT_IONICE},
+    { "rate",        required_argument, NULL, OPT_RATE},
+    { "adaptive",    required_argument, NULL, OPT_ADAPTIVE},
+    { "cold",        required_argument, NULL, OPT_COLD},
+    { "follow",      no_argument,       NULL, 'f'},
+    { "interval",    required_argument, NULL, OPT_INTERVAL},
+    { "daemon",      optional_argument, NULL, OPT_DAEMON},
+    { NULL,          0,                 NULL, 0  }
+};
 
-    if (seek_back)
-        fseek(fp, 0, SEEK_SET);
+static dirstats_config_t config;
 
-    fclose(fp);
-#endif
+/* Limits the rate of directory reads and stats. */
+static throttle_t throttle = THROTTLE_INIT;
 
-    return size;
-}
+/* The largest cold subtrees found so far, sorted by size in descending
+   order. None of them is inside another. */
+static dirstats_cold_t cold_top[DIRSTATS_COLD_TOP];
+static size_t cold_top_count = 0;
 
 static void
 usage(int status)
@@ -105,7 +135,20 @@ The current directory is the default.\n\n\
 Options:\n\
   -a, --all                  Do not ignore hidden files/directories\n\
                               (files/directories starting with `.').\n\
+      --daemon[=SOCKET]      Ask the index of dirutilsd listening at SOCKET\n\
+                              (default: its default socket) for the totals,\n\
+                              and only read DIRECTORY if it is not indexed.\n\
+  -f, --follow               Keep watching DIRECTORY after the totals are\n\
+                              computed, and print them again every interval.\n\
+                              They are kept up to date from inotify events,\n\
+                              reading only the files that changed.\n\
   -h, --help                 Show this help and exit.\n\
+  -i, --inode-order          Read the metadata of the entries and descend\n\
+                              into subdirectories in inode number order.\n\
+                              This greatly reduces seeking on rotating disks\n\
+                              when the metadata is not cached yet.\n\
+      --interval=SECS        With --follow, print the totals every SECS\n\
+                              seconds (default: 60).\n\
   -r, --recursive            Recursively count files/directories and\n\
                               their sizes under DIRECTORY.\n\
   -s, --size                 Show size of DIRECTORY.\n\
@@ -113,6 +156,19 @@ Options:\n\
                               If no LEVEL is specified, LEVEL 1 gets enabled.\n\
   -v, --version              Show the program version information.\n\
 \n\
+I/O control options:\n\
+      --adaptive=MS          Slow down while the average latency of directory\n\
+                              reads and stats is above MS milliseconds.\n\
+      --ionice=CLASS[:LEVEL] Set the I/O scheduling class (realtime,\n\
+                              best-effort or idle) and LEVEL (0-7).\n\
+      --rate=OPS             Limit directory reads and stats to OPS per\n\
+                              second.\n\
+\n\
+Cold data options:\n\
+      --cold=DAYS            Also list the largest subtrees under DIRECTORY\n\
+                              where nothing was modified or accessed in the\n\
+                              last DAYS days. Implies -r and -s.\n\
+\n\
 This program is a part of dirutils v%s.\n\
 Report bugs to: <%s>.\n\
 Dirutils home page: <%s>.\n\
@@ -136,142 +192,249 @@ Written by Ar Rakin <rakinar2@onesoftnet.eu.org>.\n",
             PROGRAM_NAME, VERSION);
 }
 
-static bool
-get_dirstats(char *dirpath, dirstats_t *destptr, dirstats_config_t *config,
-             char **error_path)
+static void
+dirstats_cold_update(dirstats_t *stats, time_t mtime, time_t atime)
 {
-    *error_path = NULL;
+    if (mtime > stats->newest_mtime)
+        stats->newest_mtime = mtime;
 
-    DIR *dir = opendir(dirpath);
+    if (atime > stats->newest_atime)
+        stats->newest_atime = atime;
+}
 
-    if (dir == NULL)
+/* Record the fully cold subtree at DIRPATH. Called after all of its
+   subdirectories have been read, so any cold subtree inside it that was
+   recorded before is replaced by it. */
+static void
+dirstats_cold_add(char *dirpath, dirstats_t *stats)
+{
+    size_t len = strlen(dirpath);
+    size_t kept = 0;
+
+    for (size_t i = 0; i < cold_top_count; i++)
     {
-        *error_path = strdup(dirpath);
-        return false;
+        if (strncmp(cold_top[i].path, dirpath, len) == 0
+            && cold_top[i].path[len] == '/')
+            free(cold_top[i].path);
+        else
+            cold_top[kept++] = cold_top[i];
+    }
+
+    cold_top_count = kept;
+
+    if (cold_top_count == DIRSTATS_COLD_TOP)
+    {
+        if (cold_top[cold_top_count - 1].size >= stats->dirsize)
+            return;
+
+        free(cold_top[--cold_top_count].path);
     }
 
-    size_t childcount = 0, filecount = 0, dircount = 0, linkcount = 0,
-           hiddencount = 0;
+    size_t i = cold_top_count++;
 
-    size_t dirsize = 0;
+    for (; i > 0 && cold_top[i - 1].size < stats->dirsize; i--)
+        cold_top[i] = cold_top[i - 1];
 
-    struct dirent *dirent;
+    cold_top[i] = (dirstats_cold_t){
+        .path = xmalloc(strlen(dirpath) + 1),
+        .size = stats->dirsize,
+        .newest = stats->newest_mtime > stats->newest_atime
+                      ? stats->newest_mtime
+                      : stats->newest_atime,
+    };
 
-    while ((dirent = readdir(dir)) != NULL)
+    strcpy(cold_top[i].path, dirpath);
+}
+
+/* State of a get_dirstats() walk. FRAMES holds the statistics of every
+   directory from the root down to the one being read. */
+typedef struct
+{
+    dirstats_config_t *config;
+    dirstats_t *frames;
+    size_t frames_capacity;
+    char **error_path;
+} dirstats_walk_t;
+
+static dirwalk_action_t
+get_dirstats_pre(dirwalk_t *walk, const dirwalk_entry_t *dir)
+{
+    dirstats_walk_t *state = walk->data;
+    dirstats_config_t *config = state->config;
+
+    if (dir->depth >= state->frames_capacity)
     {
-        if (STREQ(dirent->d_name, ".") || STREQ(dirent->d_name, ".."))
-            continue;
+        state->frames_capacity = state->frames_capacity == 0
+                                     ? 16
+                                     : state->frames_capacity * 2;
+        state->frames = xrealloc(state->frames, sizeof(dirstats_t)
+                                                    * state->frames_capacity);
+    }
 
-        if (dirent->d_type == DT_REG && config->filesize)
-        {
-            if (dirent->d_name[0] != '.'
-                || (dirent->d_name[0] == '.' && config != NULL
-                    && config->count_hidden_files))
-            {
-                char *newpath
-                    = malloc(strlen(dirpath) + strlen(dirent->d_name) + 2);
+    dirstats_t *stats = &state->frames[dir->depth];
 
-                if (newpath == NULL)
-                    return false;
+    *stats = (dirstats_t){ 0 };
 
-                strcpy(newpath, dirpath);
-                strcat(newpath, "/");
-                strcat(newpath, dirent->d_name);
+    LOG_DEBUG_1(config->verbosity, "reading directory: %s\n", dir->path);
 
-                size_t size = get_file_size(newpath, false);
+    if (config->cold_days > 0)
+    {
+        struct stat st;
 
-                if (size == -1)
-                {
-                    LOG_DEBUG_1(config->verbosity,
-                                "ERROR calculating size of `%s'\n", newpath);
-                    print_error(true, false, "cannot calculate size of `%s'",
-                                newpath);
-                    free(newpath);
-                    exit(EXIT_FAILURE);
-                }
+        if (fstat(dir->fd, &st) == 0)
+            stats->newest_mtime = st.st_mtime;
+    }
 
-                if (config->filesize)
-                {
-                    LOG_DEBUG_2(config->verbosity, "Size: %zu bytes: %s\n",
-                                size, newpath);
-                }
+    return DIRWALK_CONTINUE;
+}
 
-                free(newpath);
-                dirsize += size;
-            }
-        }
+/* Account a single entry into the statistics of its parent directory, and
+   decide whether to descend into it. */
+static dirwalk_action_t
+get_dirstats_visit(dirwalk_t *walk, const dirwalk_entry_t *entry)
+{
+    dirstats_walk_t *state = walk->data;
+    dirstats_config_t *config = state->config;
+    dirstats_t *stats = &state->frames[entry->depth - 1];
+    bool hidden = entry->name[0] == '.';
+    bool descend = entry->type == DT_DIR && config->recursive
+                   && (!hidden || config->count_hidden_files);
+    struct stat st;
+    bool have_stat = false;
+
+    /* Directories that are descended into account their own times. The
+       access times of directories are ignored, since reading them is
+       exactly what this program does. */
+    if (config->cold_days > 0 && !descend)
+    {
+        have_stat = dirwalk_stat(walk, entry, &st);
 
-        if (dirent->d_name[0] == '.')
-        {
-            hiddencount++;
+        if (!have_stat)
+            print_error(true, false, "cannot stat `%s'", entry->path);
+        else
+            dirstats_cold_update(stats, st.st_mtime,
+                                 S_ISDIR(st.st_mode) ? 0 : st.st_atime);
+    }
 
-            if (config == NULL || !config->count_hidden_files)
-                continue;
+    if (entry->type == DT_REG && config->filesize
+        && (!hidden || config->count_hidden_files))
+    {
+        if (!have_stat && !dirwalk_stat(walk, entry, &st))
+        {
+            LOG_DEBUG_1(config->verbosity, "ERROR calculating size of `%s'\n",
+                        entry->path);
+            print_error(true, false, "cannot calculate size of `%s'",
+                        entry->path);
+            exit(EXIT_FAILURE);
         }
 
-        if (dirent->d_type == DT_REG)
-            filecount++;
-        else if (dirent->d_type == DT_DIR)
-        {
-            dircount++;
+        LOG_DEBUG_2(config->verbosity, "Size: %zu bytes: %s\n",
+                    (size_t) st.st_size, entry->path);
 
-            if (config != NULL && config->recursive)
-            {
-                dirstats_t stats;
+        stats->dirsize += st.st_size;
+    }
 
-                char *newpath
-                    = malloc(strlen(dirpath) + strlen(dirent->d_name) + 2);
+    if (hidden)
+    {
+        stats->hiddencount++;
 
-                if (newpath == NULL)
-                    return false;
+        if (!config->count_hidden_files)
+            return DIRWALK_SKIP;
+    }
 
-                strcpy(newpath, dirpath);
-                strcat(newpath, "/");
-                strcat(newpath, dirent->d_name);
+    if (entry->type == DT_REG)
+        stats->filecount++;
+    else if (entry->type == DT_DIR)
+        stats->dircount++;
+    else if (entry->type == DT_LNK)
+        stats->linkcount++;
 
-                newpath[strlen(dirpath) + strlen(dirent->d_name) + 1] = '\0';
+    stats->childcount++;
 
-                LOG_DEBUG_1(config->verbosity, "reading directory: %s\n",
-                            newpath);
+    return descend ? DIRWALK_CONTINUE : DIRWALK_SKIP;
+}
 
-                if (!get_dirstats(newpath, &stats, config, error_path))
-                {
-                    LOG_DEBUG_3(config->verbosity,
-                                "ERROR reading directory: %s\n", newpath);
-                    free(newpath);
-                    return false;
-                }
+/* Called once all entries of a directory were read. The statistics of the
+   directory are complete, so they are folded into its parent's. */
+static dirwalk_action_t
+get_dirstats_post(dirwalk_t *walk, const dirwalk_entry_t *dir)
+{
+    dirstats_walk_t *state = walk->data;
+    dirstats_config_t *config = state->config;
+    dirstats_t *stats = &state->frames[dir->depth];
 
-                LOG_DEBUG_2(config->verbosity,
-                            "successfully read directory: %s\n", newpath);
+    LOG_DEBUG_2(config->verbosity, "successfully read directory: %s\n",
+                dir->path);
 
-                free(newpath);
+    if (config->cold_days > 0 && stats->newest_mtime < config->cold_cutoff
+        && stats->newest_atime < config->cold_cutoff)
+        dirstats_cold_add((char *) dir->path, stats);
 
-                filecount += stats.filecount;
-                childcount += stats.childcount;
-                dircount += stats.dircount;
-                linkcount += stats.linkcount;
-                hiddencount += dirent->d_name[0] == '.' ? stats.childcount
-                                                        : stats.hiddencount;
-                dirsize += stats.dirsize;
-            }
-        }
-        else if (dirent->d_type == DT_LNK)
-            linkcount++;
+    if (dir->depth == 0)
+        return DIRWALK_CONTINUE;
 
-        childcount++;
-    }
+    dirstats_t *parent = &state->frames[dir->depth - 1];
+
+    parent->filecount += stats->filecount;
+    parent->childcount += stats->childcount;
+    parent->dircount += stats->dircount;
+    parent->linkcount += stats->linkcount;
+    parent->hiddencount
+        += dir->name[0] == '.' ? stats->childcount : stats->hiddencount;
+    parent->dirsize += stats->dirsize;
+
+    if (config->cold_days > 0)
+        dirstats_cold_update(parent, stats->newest_mtime,
+                             stats->newest_atime);
+
+    return DIRWALK_CONTINUE;
+}
+
+static bool
+get_dirstats_error(dirwalk_t *walk, const dirwalk_entry_t *entry)
+{
+    dirstats_walk_t *state = walk->data;
 
-    closedir(dir);
+    LOG_DEBUG_3(state->config->verbosity, "ERROR reading directory: %s\n",
+                entry->path);
 
-    destptr->childcount = childcount;
-    destptr->filecount = filecount;
-    destptr->dircount = dircount;
-    destptr->linkcount = linkcount;
-    destptr->hiddencount = hiddencount;
-    destptr->dirsize = dirsize;
+    *state->error_path = strdup(entry->path);
 
-    return true;
+    return false;
+}
+
+static bool
+get_dirstats(char *dirpath, dirstats_t *destptr, dirstats_config_t *config,
+             char **error_path)
+{
+    *error_path = NULL;
+
+    dirstats_walk_t state = {
+        .config = config,
+        .frames = NULL,
+        .frames_capacity = 0,
+        .error_path = error_path,
+    };
+
+    dirwalk_t walk = DIRWALK_INIT;
+
+    walk.flags = config->inode_order ? DIRWALK_INODE_ORDER : 0;
+    walk.pre = &get_dirstats_pre;
+    walk.visit = &get_dirstats_visit;
+    walk.post = &get_dirstats_post;
+    walk.error = &get_dirstats_error;
+    walk.throttle = &throttle;
+    walk.data = &state;
+
+    bool ok = dirwalk_run(&walk, dirpath);
+
+    if (ok)
+        *destptr = state.frames[0];
+
+    dirwalk_free(&walk);
+    free(state.frames);
+
+    return ok;
 }
 
 typedef struct
@@ -368,17 +531,572 @@ print_dirstats(dirstats_t *stats)
     printf("\n");
 }
 
+static void
+print_cold_subtrees()
+{
+    printf("Largest subtrees not modified or accessed in the last %ld "
+           "day%s:\n",
+           config.cold_days, config.cold_days != 1 ? "s" : "");
+
+    if (cold_top_count == 0)
+        printf("  (none)\n");
+
+    for (size_t i = 0; i < cold_top_count; i++)
+    {
+        format_size_t format = format_size(cold_top[i].size);
+        char date[32] = "never";
+
+        if (cold_top[i].newest > 0)
+            strftime(date, sizeof date, "%Y-%m-%d",
+                     localtime(&cold_top[i].newest));
+
+        printf("  %8.1lf%c  %-10s  %s\n", format.value, format.unit, date,
+               cold_top[i].path);
+
+        free(cold_top[i].path);
+    }
+
+    cold_top_count = 0;
+}
+
+/* Follow mode. The tree is watched by a watcher that keeps a snapshot of
+   every watched directory, and the totals are those of the entries of the
+   snapshots. Every entry keeps the type and size it was counted with, so
+   that removing it subtracts exactly what was added, and only the files
+   named by events are read again. */
+static watcher_t follow_watcher;
+static int root_wd;
+static dirstats_t totals;
+
+/* An entry to count or read again, named by its directory and name. */
+typedef struct
+{
+    int wd;
+    char *name;
+} dirstats_pending_t;
+
+typedef struct
+{
+    dirstats_pending_t *items;
+    size_t count;
+    size_t capacity;
+} dirstats_pending_list_t;
+
+/* Entries found in new directories, counted once the crawl is done, and
+   files modified since the totals were last printed. */
+static dirstats_pending_list_t created;
+static dirstats_pending_list_t modified;
+
+/* Set while the tree is rescanned after a queue overflow, which counts
+   everything again. */
+static bool rescanning = false;
+
+static void
+dirstats_pending_add(dirstats_pending_list_t *list, int wd, const char *name)
+{
+    /* Repeated writes to the same file are read once. */
+    if (list->count > 0 && list->items[list->count - 1].wd == wd
+        && strcmp(list->items[list->count - 1].name, name) == 0)
+        return;
+
+    if (list->count == list->capacity)
+    {
+        list->capacity = list->capacity == 0 ? 16 : list->capacity * 2;
+        list->items = xrealloc(list->items,
+                               sizeof(dirstats_pending_t) * list->capacity);
+    }
+
+    dirstats_pending_t *item = &list->items[list->count++];
+
+    item->wd = wd;
+    item->name = xmalloc(strlen(name) + 1);
+    strcpy(item->name, name);
+}
+
+/* Whether DIR is a hidden directory or below one, not counting the root. */
+static bool
+dirstats_is_hidden(dirmap_entry_t *dir)
+{
+    for (; dir->parent != NULL; dir = dir->parent)
+        if (dir->name[0] == '.')
+            return true;
+
+    return false;
+}
+
+/* Count the entry NAME of a directory, as get_dirstats_visit() and
+   get_dirstats_post() would. Entries below a hidden directory are hidden
+   as well. */
+static void
+dirstats_count_entry(dirstats_t *stats, bool in_hidden, const char *name,
+                     unsigned char type, uint64_t size)
+{
+    bool hidden = in_hidden || name[0] == '.';
+
+    if (type == DT_REG && config.filesize
+        && (!hidden || config.count_hidden_files))
+        stats->dirsize += size;
+
+    if (hidden)
+    {
+        stats->hiddencount++;
+
+        if (!config.count_hidden_files)
+            return;
+    }
+
+    if (type == DT_REG)
+        stats->filecount++;
+    else if (type == DT_DIR)
+        stats->dircount++;
+    else if (type == DT_LNK)
+        stats->linkcount++;
+
+    stats->childcount++;
+}
+
+/* Count the entries of DIR and of every watched directory below it. */
+static void
+dirstats_count_tree(dirstats_t *stats, dirmap_entry_t *dir)
+{
+    snapshot_t *snapshot = dir->data;
+    bool in_hidden = dirstats_is_hidden(dir);
+
+    if (snapshot != NULL)
+        for (uint32_t i = 0; i < snapshot->count; i++)
+            dirstats_count_entry(stats, in_hidden,
+                                 snapshot_name(snapshot,
+                                               &snapshot->entries[i]),
+                                 snapshot->entries[i].type,
+                                 snapshot->entries[i].size);
+
+    for (dirmap_entry_t *child = dir->children; child != NULL;
+         child = child->next)
+        dirstats_count_tree(stats, child);
+}
+
+/* Add DELTA to the totals, or subtract it if ADD is false. */
+static void
+dirstats_apply(const dirstats_t *delta, bool add)
+{
+    if (add)
+    {
+        totals.filecount += delta->filecount;
+        totals.dircount += delta->dircount;
+        totals.linkcount += delta->linkcount;
+        totals.childcount += delta->childcount;
+        totals.hiddencount += delta->hiddencount;
+        totals.dirsize += delta->dirsize;
+    }
+    else
+    {
+        totals.filecount -= delta->filecount;
+        totals.dircount -= delta->dircount;
+        totals.linkcount -= delta->linkcount;
+        totals.childcount -= delta->childcount;
+        totals.hiddencount -= delta->hiddencount;
+        totals.dirsize -= delta->dirsize;
+    }
+}
+
+/* Add or subtract the entry NAME of DIR, as recorded in its snapshot, with
+   the watched directories below it if it is one. */
+static void
+dirstats_apply_entry(dirmap_entry_t *dir, const snapshot_entry_t *entry,
+                     const char *name, bool add)
+{
+    dirstats_t delta = { 0 };
+    dirmap_entry_t *child;
+
+    dirstats_count_entry(&delta, dirstats_is_hidden(dir), name, entry->type,
+                         entry->size);
+
+    if (entry->type == DT_DIR
+        && (child = dirmap_find_child(&follow_watcher.dirmap, dir, name))
+               != NULL)
+        dirstats_count_tree(&delta, child);
+
+    dirstats_apply(&delta, add);
+}
+
+/* Read the status of the entry NAME of DIR into ST. */
+static bool
+dirstats_lstat(dirmap_entry_t *dir, const char *name, struct stat *st)
+{
+    const char *dirpath = watcher_path(&follow_watcher, dir);
+    char *path = xmalloc(strlen(dirpath) + strlen(name) + 2);
+
+    sprintf(path, "%s/%s", dirpath, name);
+
+    bool ok = lstat(path, st) == 0;
+
+    free(path);
+
+    return ok;
+}
+
+/* Whether DIR is in a subtree moved away and not yet paired with its new
+   name. Its events are ignored: it was subtracted already, and is counted
+   again as a whole if it comes back. */
+static bool
+dirstats_is_moving(dirmap_entry_t *dir)
+{
+    for (; dir != NULL; dir = dir->parent)
+        for (size_t i = 0; i < follow_watcher.movecount; i++)
+            if (follow_watcher.moves[i].entry == dir)
+                return true;
+
+    return false;
+}
+
+/* The watcher found NAME in a new directory. It is counted once the crawl
+   is done, from the snapshot. */
+static void
+dirstats_on_synthesized(watcher_t *watcher, uint32_t mask, int wd,
+                        const char *dirpath, const char *name)
+{
+    if (!rescanning && (mask & IN_CREATE))
+        dirstats_pending_add(&created, wd, name);
+}
+
+/* Count the entries found in new directories. */
+static void
+dirstats_count_created()
+{
+    for (size_t i = 0; i < created.count; i++)
+    {
+        dirmap_entry_t *dir
+            = dirmap_find_by_wd(&follow_watcher.dirmap, created.items[i].wd);
+        snapshot_entry_t *entry;
+
+        if (dir != NULL && dir->data != NULL
+            && (entry = snapshot_find(dir->data, created.items[i].name))
+                   != NULL)
+        {
+            dirstats_t delta = { 0 };
+
+            dirstats_count_entry(&delta, dirstats_is_hidden(dir),
+                                 created.items[i].name, entry->type,
+                                 entry->size);
+            dirstats_apply(&delta, true);
+        }
+
+        free(created.items[i].name);
+    }
+
+    created.count = 0;
+}
+
+/* Read the size of the files modified since the last call again, and
+   apply the difference. */
+static void
+dirstats_update_modified()
+{
+    for (size_t i = 0; i < modified.count; i++)
+    {
+        dirmap_entry_t *dir
+            = dirmap_find_by_wd(&follow_watcher.dirmap, modified.items[i].wd);
+        const char *name = modified.items[i].name;
+        snapshot_entry_t *entry;
+        struct stat st;
+
+        if (dir != NULL && dir->data != NULL
+            && (entry = snapshot_find(dir->data, name)) != NULL
+            && entry->type == DT_REG && dirstats_lstat(dir, name, &st)
+            && S_ISREG(st.st_mode))
+        {
+            dirstats_apply_entry(dir, entry, name, false);
+            entry->size = st.st_size;
+            dirstats_apply_entry(dir, entry, name, true);
+        }
+
+        free(modified.items[i].name);
+    }
+
+    modified.count = 0;
+}
+
+/* Apply EVENT to the totals, and to the tree of watches. */
+static void
+dirstats_on_event(const struct inotify_event *event)
+{
+    dirmap_entry_t *dir
+        = event->wd > 0 ? dirmap_find_by_wd(&follow_watcher.dirmap, event->wd)
+                        : NULL;
+
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        LOG_DEBUG_1(config.verbosity, "%s\n",
+                    "Event queue overflowed, counting everything again");
+
+        rescanning = true;
+        watcher_handle_event(&follow_watcher, event);
+        rescanning = false;
+
+        dirmap_entry_t *root
+            = dirmap_find_by_wd(&follow_watcher.dirmap, root_wd);
+
+        totals = (dirstats_t){ 0 };
+
+        if (root != NULL)
+            dirstats_count_tree(&totals, root);
+
+        return;
+    }
+
+    if (event->len == 0 || dir == NULL || dir->data == NULL
+        || dirstats_is_moving(dir))
+    {
+        watcher_handle_event(&follow_watcher, event);
+        return;
+    }
+
+    if (event->mask & IN_MODIFY)
+    {
+        dirstats_pending_add(&modified, event->wd, event->name);
+        watcher_handle_event(&follow_watcher, event);
+        return;
+    }
+
+    /* What was counted for the name is subtracted, whether it was removed,
+       moved away, or replaced by the entry created or moved over it. */
+    snapshot_entry_t *entry = snapshot_find(dir->data, event->name);
+
+    if (entry != NULL)
+        dirstats_apply_entry(dir, entry, event->name, false);
+
+    /* A directory renamed inside the tree keeps its watches and snapshots,
+       and is counted again as a whole. */
+    bool renamed = false;
+
+    if ((event->mask & (IN_MOVED_TO | IN_ISDIR)) == (IN_MOVED_TO | IN_ISDIR))
+        for (size_t i = 0; i < follow_watcher.movecount; i++)
+            if (follow_watcher.moves[i].cookie == event->cookie)
+                renamed = true;
+
+    watcher_handle_event(&follow_watcher, event);
+
+    if (!(event->mask & (IN_CREATE | IN_MOVED_TO))
+        || (entry = snapshot_find(dir->data, event->name)) == NULL)
+        return;
+
+    /* The watcher records new entries as directories or regular files,
+       without reading them. Only the new file is read. */
+    struct stat st;
+
+    if (!(event->mask & IN_ISDIR) && dirstats_lstat(dir, event->name, &st))
+    {
+        entry->type = IFTODT(st.st_mode);
+        entry->size = st.st_size;
+    }
+    else
+        entry->size = 0;
+
+    if (renamed)
+        dirstats_apply_entry(dir, entry, event->name, true);
+    else
+    {
+        dirstats_t delta = { 0 };
+
+        dirstats_count_entry(&delta, dirstats_is_hidden(dir), event->name,
+                             entry->type, entry->size);
+        dirstats_apply(&delta, true);
+    }
+
+    /* The entries of a new directory were found by the crawl. */
+    dirstats_count_created();
+}
+
+/* Read the events queued on the inotify file descriptor. */
+static void
+dirstats_read_events()
+{
+    static char *buf = NULL;
+    static size_t bufsize = 0;
+    int queued = 0;
+
+    if (ioctl(follow_watcher.fd, FIONREAD, &queued) == -1)
+        print_error(true, true, "cannot read events");
+
+    if ((size_t) queued < sizeof(struct inotify_event) + NAME_MAX + 1)
+        queued = sizeof(struct inotify_event) + NAME_MAX + 1;
+
+    if ((size_t) queued > bufsize)
+    {
+        bufsize = queued;
+        buf = xrealloc(buf, bufsize);
+    }
+
+    ssize_t length = read(follow_watcher.fd, buf, bufsize);
+
+    if (length == -1)
+    {
+        if (errno == EINTR || errno == EAGAIN)
+            return;
+
+        print_error(true, true, "cannot read events");
+    }
+
+    for (ssize_t i = 0; i < length;)
+    {
+        struct inotify_event *event = (struct inotify_event *) &buf[i];
+
+        dirstats_on_event(event);
+        i += sizeof(struct inotify_event) + event->len;
+    }
+}
+
+/* Returns the current time in milliseconds on the monotonic clock. */
+static uint64_t
+dirstats_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+print_follow_totals()
+{
+    time_t now = time(NULL);
+    char date[32];
+
+    dirstats_update_modified();
+    strftime(date, sizeof date, "%Y-%m-%d %H:%M:%S", localtime(&now));
+    printf("%s  ", date);
+    print_dirstats(&totals);
+    fflush(stdout);
+}
+
+/* Hidden directories are only watched with -a, as they are only read
+   with it. */
+static bool
+dirstats_follow_filter(watcher_t *watcher, dirmap_entry_t *parent,
+                       const char *name)
+{
+    return name[0] != '.' || config.count_hidden_files;
+}
+
+/* Watch DIRPATH, count its entries once, then print the totals every
+   interval, keeping them up to date from the events meanwhile. Without
+   events, nothing is read between two intervals. */
+static void
+dirstats_follow(char *dirpath)
+{
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVE;
+
+    if (config.filesize)
+        mask |= IN_MODIFY;
+
+    if (!watcher_init(&follow_watcher, mask, config.recursive))
+        print_error(true, true, "cannot initialize inotify");
+
+    follow_watcher.verbosity = config.verbosity;
+    follow_watcher.snapshots = true;
+    follow_watcher.snapshot_stats = config.filesize;
+    follow_watcher.filter = &dirstats_follow_filter;
+    follow_watcher.on_synthesized = &dirstats_on_synthesized;
+
+    dirmap_entry_t *root
+        = watcher_add_root(&follow_watcher, dirpath, mask, false);
+
+    if (root == NULL)
+        print_error(true, true, "cannot watch `%s'", dirpath);
+
+    root_wd = root->wd;
+
+    dirstats_count_tree(&totals, root);
+    print_follow_totals();
+
+    struct pollfd fds[1] = {
+        { .fd = follow_watcher.fd, .events = POLLIN },
+    };
+    uint64_t next_report = dirstats_now() + config.interval * 1000;
+
+    while (true)
+    {
+        uint64_t now = dirstats_now();
+
+        if (now >= next_report)
+        {
+            print_follow_totals();
+            next_report = now + config.interval * 1000;
+        }
+
+        int timeout = next_report - now;
+        int tick = watcher_tick(&follow_watcher, now);
+
+        if (tick >= 0 && tick < timeout)
+            timeout = tick;
+
+        int ready = poll(fds, 1, timeout);
+
+        if (ready == -1 && errno != EINTR)
+            print_error(true, true, "poll failed");
+
+        if (ready > 0)
+            dirstats_read_events();
+    }
+}
+
+/* Get the totals of DIRPATH from the index of dirutilsd. Returns false if
+   the daemon is not running or does not index DIRPATH. */
+static bool
+dirstats_query_daemon(const char *dirpath, dirstats_t *stats)
+{
+    char flags[4];
+    size_t len = 0;
+
+    if (config.recursive)
+        flags[len++] = 'r';
+
+    if (config.count_hidden_files)
+        flags[len++] = 'a';
+
+    if (config.filesize)
+        flags[len++] = 's';
+
+    flags[len] = '\0';
+
+    FILE *fp = dirindex_query(config.daemon_socket, "STATS", flags, NULL,
+                              dirpath);
+
+    if (fp == NULL)
+    {
+        LOG_DEBUG_1(config.verbosity,
+                    "%s: not indexed by dirutilsd, reading it\n", dirpath);
+        return false;
+    }
+
+    bool ok = fscanf(fp, "%zu %zu %zu %zu %zu %zu", &stats->filecount,
+                     &stats->dircount, &stats->linkcount, &stats->childcount,
+                     &stats->hiddencount, &stats->dirsize)
+              == 6;
+
+    fclose(fp);
+
+    if (!ok)
+        memset(stats, 0, sizeof *stats);
+
+    return ok;
+}
+
 int
 main(int argc, char **argv)
 {
     set_program_name(argv[0]);
 
     config.verbosity = 0;
+    config.interval = DIRSTATS_INTERVAL;
+
+    double rate = 0, latency_threshold = 0;
 
     while (true)
     {
         int option_index;
-        int c = getopt_long(argc, argv, "hraVsv", long_options, &option_index);
+        int c
+            = getopt_long(argc, argv, "hraVsvif", long_options, &option_index);
 
         if (c == -1)
             break;
@@ -405,6 +1123,60 @@ main(int argc, char **argv)
                 config.filesize = true;
                 break;
 
+            case 'i':
+                config.inode_order = true;
+                break;
+
+            case 'f':
+                config.follow = true;
+                break;
+
+            case OPT_INTERVAL:
+            {
+                char *end;
+
+                errno = 0;
+                config.interval = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.interval == 0 || config.interval > INT_MAX / 1000)
+                    print_error(false, true, "invalid interval: %s", optarg);
+            }
+            break;
+
+            case OPT_DAEMON:
+                free(config.daemon_socket);
+                config.daemon_socket = optarg != NULL ? strdup(optarg)
+                                                      : dirindex_socket_path();
+                break;
+
+            case OPT_IONICE:
+            {
+                ioprio_class_t class;
+                int level;
+
+                if (!throttle_parse_ioprio(optarg, &class, &level))
+                    print_error(false, true, "invalid I/O priority: %s",
+                                optarg);
+
+                if (!throttle_set_ioprio(class, level))
+                    print_error(true, true, "cannot set I/O priority");
+            }
+            break;
+
+            case OPT_RATE:
+                if (!throttle_parse_value(optarg, &rate))
+                    print_error(false, true, "invalid rate: %s", optarg);
+
+                break;
+
+            case OPT_ADAPTIVE:
+                if (!throttle_parse_value(optarg, &latency_threshold))
+                    print_error(false, true, "invalid latency threshold: %s",
+                                optarg);
+
+                break;
+
             case 'V':
                 config.verbosity
                     = (verbosity_t) (optarg == NULL ? 1 : atoi(optarg));
@@ -419,6 +1191,21 @@ main(int argc, char **argv)
                        config.verbosity);
                 break;
 
+            case OPT_COLD:
+            {
+                char *end;
+
+                config.cold_days = strtol(optarg, &end, 10);
+
+                if (*end != '\0' || config.cold_days < 1)
+                    print_error(false, true, "invalid number of days: %s",
+                                optarg);
+
+                config.recursive = true;
+                config.filesize = true;
+            }
+            break;
+
             case '?':
                 printf("Run `%s --help' for more detailed information.\n",
                        PROGRAM_NAME);
@@ -429,7 +1216,12 @@ main(int argc, char **argv)
         }
     }
 
-    dirstats_t stats = { 0, 0, 0, 0, 0, 0 };
+    throttle_init(&throttle, rate, latency_threshold / 1000);
+
+    if (config.cold_days > 0)
+        config.cold_cutoff = time(NULL) - config.cold_days * 24 * 60 * 60;
+
+    dirstats_t stats = { 0 };
 
     char *dirpath = ".";
     bool allocated = false;
@@ -442,6 +1234,25 @@ main(int argc, char **argv)
         break;
     }
 
+    if (config.follow)
+    {
+        if (config.cold_days > 0)
+            print_error(false, true, "--follow cannot be used with --cold");
+
+        dirstats_follow(dirpath);
+    }
+
+    if (config.daemon_socket != NULL && config.cold_days == 0
+        && dirstats_query_daemon(dirpath, &stats))
+    {
+        if (allocated)
+            free(dirpath);
+
+        free(config.daemon_socket);
+        print_dirstats(&stats);
+        return 0;
+    }
+
     LOG_DEBUG_1(config.verbosity, "reading directory: %s\n", dirpath);
 
     if (!get_dirstats(dirpath, &stats, &config, &error_path))
@@ -467,5 +1278,8 @@ main(int argc, char **argv)
 
     print_dirstats(&stats);
 
+    if (config.cold_days > 0)
+        print_cold_subtrees();
+
     return 0;
 }
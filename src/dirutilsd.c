@@ -0,0 +1,740 @@
+/*
+    dirutilsd.c -- keep an index of directories and answer queries about them.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fnmatch.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirindex.h"
+#include "dirmap.h"
+#include "outbuf.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "watcher.h"
+
+/* Events that change the index: the watcher marks the entries they name
+   as changed, and their status is read again when a query needs it. */
+#define DIRUTILSD_EVENTS                                                      \
+    (IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY | IN_ATTRIB)
+
+/* How long a client may take to send its request, in seconds. */
+#define DIRUTILSD_TIMEOUT 5
+
+/* Capacity of the buffer of an answer. */
+#define DIRUTILSD_OUTBUF_CAPACITY (64 * 1024)
+
+typedef struct
+{
+    char *socket_path;     /* Socket to listen on. */
+    int jobs;              /* Threads to crawl the roots with. */
+    verbosity_t verbosity; /* Verbosity level. */
+} config_t;
+
+/* Counts of a STATS query, as dirstats computes them. */
+typedef struct
+{
+    size_t filecount;
+    size_t dircount;
+    size_t linkcount;
+    size_t childcount;
+    size_t hiddencount;
+    size_t dirsize;
+} dirutilsd_stats_t;
+
+/* Flags of a STATS query. */
+typedef struct
+{
+    bool recursive;
+    bool all;
+    bool size;
+} dirutilsd_stats_flags_t;
+
+static config_t config;
+
+/* The indexed directories: the watcher keeps a snapshot of every one of
+   them, kept up to date from the events. */
+static watcher_t watcher;
+
+/* Watches of the roots, to find the directory of a query. */
+static int *root_wds = NULL;
+static size_t rootcount = 0;
+
+static int listen_fd = -1;
+static int signal_fd = -1;
+
+enum
+{
+    OPT_SOCKET = CHAR_MAX + 1
+};
+
+static struct option const long_options[] = {
+    {"help",     no_argument,       NULL, 'h'       },
+    { "jobs",    required_argument, NULL, 'j'       },
+    { "socket",  required_argument, NULL, OPT_SOCKET},
+    { "verbose", optional_argument, NULL, 'V'       },
+    { "version", no_argument,       NULL, 'v'       },
+    { NULL,      0,                 NULL, 0         }
+};
+
+/* Stop listening, and remove the socket. */
+static void
+dirutilsd_cleanup()
+{
+    if (listen_fd != -1)
+    {
+        close(listen_fd);
+        unlink(config.socket_path);
+    }
+
+    if (signal_fd != -1)
+        close(signal_fd);
+
+    listen_fd = signal_fd = -1;
+
+    watcher_free(&watcher);
+    free(root_wds);
+    root_wds = NULL;
+}
+
+/* Receive the signals that stop the daemon through a signalfd, so that it
+   removes its socket, and ignore the ones of clients that hang up. */
+static void
+dirutilsd_set_signal_handlers()
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        print_error(true, true, "failed to block signals");
+
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    if (signal_fd == -1)
+        print_error(true, true, "failed to create signalfd");
+
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/* Apply the events queued on the inotify file descriptor to the index,
+   until there are none left. */
+static void
+dirutilsd_read_events()
+{
+    static char *buf = NULL;
+    static size_t bufsize = 0;
+    int queued;
+
+    while (ioctl(watcher.fd, FIONREAD, &queued) == 0 && queued > 0)
+    {
+        if ((size_t) queued > bufsize)
+        {
+            bufsize = queued;
+            buf = xrealloc(buf, bufsize);
+        }
+
+        ssize_t length = read(watcher.fd, buf, bufsize);
+
+        if (length == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            print_error(true, true, "cannot read events");
+        }
+
+        for (ssize_t i = 0; i < length;)
+        {
+            struct inotify_event *event = (struct inotify_event *) &buf[i];
+
+            watcher_handle_event(&watcher, event);
+            i += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+/* Returns the indexed directory at the absolute PATH, or NULL. */
+static dirmap_entry_t *
+dirutilsd_find(char *path)
+{
+    for (size_t i = 0; i < rootcount; i++)
+    {
+        dirmap_entry_t *dir = dirmap_find_by_wd(&watcher.dirmap, root_wds[i]);
+
+        if (dir == NULL || dir->parent != NULL)
+            continue;
+
+        size_t len = strlen(dir->name);
+
+        if (strncmp(path, dir->name, len) != 0
+            || (path[len] != '\0' && path[len] != '/' && len > 1))
+            continue;
+
+        char *saveptr;
+
+        for (char *name = strtok_r(path + len, "/", &saveptr);
+             name != NULL && dir != NULL;
+             name = strtok_r(NULL, "/", &saveptr))
+            dir = dirmap_find_child(&watcher.dirmap, dir, name);
+
+        return dir;
+    }
+
+    return NULL;
+}
+
+/* Read the status of ENTRY, named NAME in DIR, again if it changed since
+   it was last read. */
+static void
+dirutilsd_refresh(dirmap_entry_t *dir, snapshot_entry_t *entry,
+                  const char *name)
+{
+    if (entry->mtime != SNAPSHOT_UNKNOWN)
+        return;
+
+    const char *dirpath = watcher_path(&watcher, dir);
+    char *path = xmalloc(strlen(dirpath) + strlen(name) + 2);
+    struct stat st;
+
+    sprintf(path, "%s/%s", dirpath, name);
+
+    if (lstat(path, &st) == 0)
+    {
+        entry->ino = st.st_ino;
+        entry->type = IFTODT(st.st_mode);
+        entry->mtime
+            = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+        entry->size = st.st_size;
+    }
+
+    free(path);
+}
+
+/* Write the entries of DIR matching PATTERN, or all of them if it is NULL,
+   with the path PREFIX of LEN bytes before their names. Every directory
+   below is listed as well if RECURSIVE is true. */
+static void
+dirutilsd_list(outbuf_t *out, dirmap_entry_t *dir, char **prefix,
+               size_t *capacity, size_t len, bool recursive,
+               const char *pattern)
+{
+    snapshot_t *snapshot = dir->data;
+
+    if (snapshot == NULL)
+        return;
+
+    for (uint32_t i = 0; i < snapshot->count; i++)
+    {
+        const char *name = snapshot_name(snapshot, &snapshot->entries[i]);
+        size_t namelen = strlen(name);
+        bool isdir = snapshot->entries[i].type == DT_DIR;
+
+        if (len + namelen + 2 > *capacity)
+        {
+            *capacity = (len + namelen + 2) * 2;
+            *prefix = xrealloc(*prefix, *capacity);
+        }
+
+        memcpy(*prefix + len, name, namelen);
+
+        if (pattern == NULL || fnmatch(pattern, name, 0) == 0)
+        {
+            outbuf_write(out, *prefix, len + namelen);
+            outbuf_write(out, isdir ? "/\n" : "\n", isdir ? 2 : 1);
+        }
+
+        dirmap_entry_t *child;
+
+        if (recursive && isdir
+            && (child = dirmap_find_child(&watcher.dirmap, dir, name))
+                   != NULL)
+        {
+            (*prefix)[len + namelen] = '/';
+            dirutilsd_list(out, child, prefix, capacity, len + namelen + 1,
+                           recursive, pattern);
+        }
+    }
+}
+
+/* Count the entries of DIR, and those of the directories below it that
+   dirstats would descend into with FLAGS. IN_HIDDEN is true below a
+   hidden directory, where every entry counts as hidden. */
+static void
+dirutilsd_count(dirutilsd_stats_t *stats, dirmap_entry_t *dir,
+                const dirutilsd_stats_flags_t *flags, bool in_hidden)
+{
+    snapshot_t *snapshot = dir->data;
+
+    if (snapshot == NULL)
+        return;
+
+    for (uint32_t i = 0; i < snapshot->count; i++)
+    {
+        snapshot_entry_t *entry = &snapshot->entries[i];
+        const char *name = snapshot_name(snapshot, entry);
+        bool hidden = in_hidden || name[0] == '.';
+
+        dirutilsd_refresh(dir, entry, name);
+
+        if (entry->type == DT_REG && flags->size && (!hidden || flags->all))
+            stats->dirsize += entry->size;
+
+        if (hidden)
+        {
+            stats->hiddencount++;
+
+            if (!flags->all)
+                continue;
+        }
+
+        if (entry->type == DT_REG)
+            stats->filecount++;
+        else if (entry->type == DT_DIR)
+            stats->dircount++;
+        else if (entry->type == DT_LNK)
+            stats->linkcount++;
+
+        stats->childcount++;
+
+        dirmap_entry_t *child;
+
+        if (flags->recursive && entry->type == DT_DIR
+            && (child = dirmap_find_child(&watcher.dirmap, dir, name))
+                   != NULL)
+            dirutilsd_count(stats, child, flags, hidden);
+    }
+}
+
+/* Answer the request LINE on OUT. */
+static void
+dirutilsd_answer(outbuf_t *out, char *line)
+{
+    char *fields[4];
+    size_t count = 0;
+    char *saveptr;
+
+    for (char *field = strtok_r(line, "\t", &saveptr);
+         field != NULL && count < 4; field = strtok_r(NULL, "\t", &saveptr))
+        fields[count++] = field;
+
+    bool find = count == 4 && STREQ(fields[0], "FIND");
+
+    if (count != (find ? 4 : 3) || fields[count - 1][0] != '/')
+    {
+        outbuf_write(out, "ERR invalid request\n", 20);
+        return;
+    }
+
+    LOG_DEBUG_1(config.verbosity, "Query: %s %s\n", fields[0],
+                fields[count - 1]);
+
+    /* The answer reflects every event queued before the query. */
+    dirutilsd_read_events();
+
+    const char *flags = fields[1];
+    dirmap_entry_t *dir = dirutilsd_find(fields[count - 1]);
+
+    if (dir == NULL)
+    {
+        outbuf_write(out, "ERR not indexed\n", 16);
+        return;
+    }
+
+    if (find || STREQ(fields[0], "LIST"))
+    {
+        size_t capacity = PATH_MAX;
+        char *prefix = xmalloc(capacity);
+
+        outbuf_write(out, "OK\n", 3);
+        dirutilsd_list(out, dir, &prefix, &capacity, 0,
+                       strchr(flags, 'r') != NULL, find ? fields[2] : NULL);
+        free(prefix);
+    }
+    else if (STREQ(fields[0], "STATS"))
+    {
+        dirutilsd_stats_flags_t stats_flags = {
+            .recursive = strchr(flags, 'r') != NULL,
+            .all = strchr(flags, 'a') != NULL,
+            .size = strchr(flags, 's') != NULL,
+        };
+        dirutilsd_stats_t stats = { 0 };
+        char buf[160];
+
+        dirutilsd_count(&stats, dir, &stats_flags, false);
+
+        int len = snprintf(buf, sizeof buf, "OK\n%zu %zu %zu %zu %zu %zu\n",
+                           stats.filecount, stats.dircount, stats.linkcount,
+                           stats.childcount, stats.hiddencount,
+                           stats.dirsize);
+
+        outbuf_write(out, buf, len);
+    }
+    else
+        outbuf_write(out, "ERR unknown command\n", 20);
+}
+
+/* Accept a client, and answer its request. */
+static void
+dirutilsd_serve()
+{
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+
+    if (fd == -1)
+        return;
+
+    /* A client that does not send its request, or does not read the
+       answer, only holds the daemon for so long. */
+    struct timeval timeout = { .tv_sec = DIRUTILSD_TIMEOUT };
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+
+    char line[DIRINDEX_MAX_REQUEST];
+    size_t len = 0;
+    char *end = NULL;
+
+    while (len < sizeof line - 1 && end == NULL)
+    {
+        ssize_t n = read(fd, line + len, sizeof line - 1 - len);
+
+        if (n <= 0)
+            break;
+
+        line[len + n] = '\0';
+        end = strchr(line + len, '\n');
+        len += n;
+    }
+
+    if (end != NULL)
+    {
+        outbuf_t out;
+
+        *end = '\0';
+        outbuf_init(&out, fd, DIRUTILSD_OUTBUF_CAPACITY);
+        dirutilsd_answer(&out, line);
+
+        if (!outbuf_flush(&out))
+            LOG_DEBUG_1(config.verbosity, "%s\n", "Client left early");
+
+        outbuf_free(&out);
+    }
+
+    close(fd);
+}
+
+/* Set ADDR to the socket of the configuration, and exit if another daemon
+   listens on it. */
+static void
+dirutilsd_check_socket(struct sockaddr_un *addr)
+{
+    if (strlen(config.socket_path) >= sizeof addr->sun_path)
+        print_error(false, true, "socket path too long: %s",
+                    config.socket_path);
+
+    strcpy(addr->sun_path, config.socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd == -1)
+        print_error(true, true, "cannot create socket");
+
+    if (connect(fd, (struct sockaddr *) addr, sizeof *addr) == 0)
+        print_error(false, true, "%s: another daemon is listening",
+                    config.socket_path);
+
+    close(fd);
+}
+
+/* Listen on the socket of the configuration, unless another daemon does
+   already. */
+static void
+dirutilsd_listen()
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    dirutilsd_check_socket(&addr);
+
+    /* A socket left by a daemon that died is replaced. */
+    unlink(config.socket_path);
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    /* Only the user can query the index. */
+    mode_t mask = umask(077);
+
+    if (listen_fd == -1
+        || bind(listen_fd, (struct sockaddr *) &addr, sizeof addr) == -1)
+    {
+        umask(mask);
+        close(listen_fd);
+        listen_fd = -1;
+        print_error(true, true, "%s: cannot bind", config.socket_path);
+    }
+
+    umask(mask);
+
+    if (listen(listen_fd, SOMAXCONN) == -1)
+        print_error(true, true, "%s: cannot listen", config.socket_path);
+}
+
+/* Index DIRPATH and everything below it. */
+static void
+dirutilsd_add_root(const char *dirpath)
+{
+    char *real = realpath(dirpath, NULL);
+
+    if (real == NULL)
+        print_error(true, true, "%s: cannot resolve", dirpath);
+
+    for (size_t i = 0; i < rootcount; i++)
+    {
+        dirmap_entry_t *root
+            = dirmap_find_by_wd(&watcher.dirmap, root_wds[i]);
+
+        if (root != NULL && STREQ(root->name, real))
+        {
+            free(real);
+            return;
+        }
+    }
+
+    LOG_DEBUG_1(config.verbosity, "Indexing %s\n", real);
+
+    dirmap_entry_t *root
+        = watcher_add_root(&watcher, real, DIRUTILSD_EVENTS, false);
+
+    if (root == NULL)
+        print_error(true, true, "%s: cannot index", real);
+
+    root_wds = xrealloc(root_wds, sizeof(int) * (rootcount + 1));
+    root_wds[rootcount++] = root->wd;
+    free(real);
+}
+
+/* Apply the events to the index and answer queries until a signal stops
+   the daemon. */
+static void
+dirutilsd_run()
+{
+    struct pollfd fds[3] = {
+        { .fd = watcher.fd,  .events = POLLIN },
+        { .fd = listen_fd,   .events = POLLIN },
+        { .fd = signal_fd,   .events = POLLIN },
+    };
+
+    while (true)
+    {
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        uint64_t now = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        int timeout = watcher_tick(&watcher, now);
+
+        if (poll(fds, 3, timeout) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            print_error(true, true, "poll failed");
+        }
+
+        if (fds[2].revents & POLLIN)
+        {
+            struct signalfd_siginfo info;
+
+            if (read(signal_fd, &info, sizeof info) == sizeof info)
+                return;
+        }
+
+        if (fds[0].revents & POLLIN)
+            dirutilsd_read_events();
+
+        if (fds[1].revents & POLLIN)
+            dirutilsd_serve();
+    }
+}
+
+static void
+usage(bool _exit)
+{
+    printf("Usage: %s [OPTION]... DIRECTORY...\n\
+Keeps an index of every DIRECTORY and everything below it in memory, up to\n\
+date from inotify events, and answers the listing, find and statistics\n\
+queries of `dirscan --daemon' and `dirstats --daemon' from it.\n\
+\n\
+Options:\n\
+  -h, --help              Show this help and exit.\n\
+  -j, --jobs=N            Crawl the directories on N threads to build the\n\
+                           index (default: one per CPU).\n\
+      --socket=PATH       Listen on the Unix socket at PATH (default:\n\
+                           $XDG_RUNTIME_DIR/%s, or\n\
+                           /tmp/dirutilsd-UID.sock without it).\n\
+  -V, --verbose=[LEVEL]   Enable verbose mode. LEVEL 1-3 are valid.\n\
+                           If no LEVEL is specified, LEVEL 1 gets enabled.\n\
+  -v, --version           Show the version information of this program.\n\
+\n\
+This program is a part of dirutils v%s.\n\
+Report bugs to: <%s>.\n\
+Dirutils home page: <%s>.\n\
+",
+           PROGRAM_NAME, DIRINDEX_SOCKET_NAME, VERSION, PACKAGE_BUGREPORT,
+           PACKAGE_URL);
+
+    if (_exit)
+        exit(EXIT_SUCCESS);
+}
+
+static void
+version(bool _exit)
+{
+    printf("%s (dirutils) version %s\n\
+Copyright (C) 2023 OSN Inc.\n\
+This program is licensed under GNU GPL version 3 or later <https://gnu.org/licenses/gpl.html>.\n\
+This is free software: you are free to change and redistribute it.\n\
+There is NO WARRANTY, to the extent permitted by law.\n\
+\n\
+Written by Ar Rakin <rakinar2@onesoftnet.eu.org>.\n",
+           PROGRAM_NAME, VERSION);
+
+    if (_exit)
+        exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char **argv)
+{
+    set_program_name(argv[0]);
+
+    config.socket_path = NULL;
+    config.jobs = 0;
+    config.verbosity = 0;
+
+    while (true)
+    {
+        int option_index;
+        int c = getopt_long(argc, argv, "hj:vV", long_options, &option_index);
+
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'h':
+                usage(true);
+                break;
+
+            case 'v':
+                version(true);
+                break;
+
+            case 'j':
+                config.jobs = atoi(optarg);
+
+                if (config.jobs < 1)
+                    print_error(false, true, "invalid number of jobs `%s'",
+                                optarg);
+                break;
+
+            case OPT_SOCKET:
+                config.socket_path = optarg;
+                break;
+
+            case 'V':
+                config.verbosity
+                    = (verbosity_t) (optarg == NULL ? 1 : atoi(optarg));
+
+                if (config.verbosity < 0 || config.verbosity > 3)
+                    print_error(false, true,
+                                "invalid verbosity level provided");
+                break;
+
+            case '?':
+            default:
+                fprintf(stderr,
+                        "Run `%s --help' for more detailed information.\n",
+                        PROGRAM_NAME);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (optind == argc)
+        print_error(false, true,
+                    "no directory to index.\nRun `%s --help' for more "
+                    "detailed information.",
+                    PROGRAM_NAME);
+
+    if (config.socket_path == NULL)
+        config.socket_path = dirindex_socket_path();
+
+    if (config.jobs == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+        config.jobs = cpus < 1 ? 1 : cpus;
+    }
+
+    if (!watcher_init(&watcher, DIRUTILSD_EVENTS, true))
+        print_error(true, true, "cannot initialize inotify");
+
+    watcher.verbosity = config.verbosity;
+    watcher.snapshots = true;
+    watcher.snapshot_stats = true;
+    watcher.jobs = config.jobs;
+
+    /* Fail before indexing if another daemon runs, but only listen once
+       the roots are indexed: clients walk the directories meanwhile. */
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    dirutilsd_check_socket(&addr);
+    atexit(&dirutilsd_cleanup);
+
+    for (int i = optind; i < argc; i++)
+        dirutilsd_add_root(argv[i]);
+
+    dirutilsd_set_signal_handlers();
+    dirutilsd_listen();
+
+    LOG_DEBUG_1(config.verbosity, "Listening on %s\n", config.socket_path);
+
+    dirutilsd_run();
+
+    return 0;
+}
@@ -0,0 +1,438 @@
+/*
+    dirwalk.c -- walk directory trees.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* The walker keeps the path of the current entry in a single buffer that
+   grows as needed, and opens and stats entries relative to the file
+   descriptor of their parent directory, so that the kernel never has to
+   resolve the full path again. */
+
+#include "config.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dirwalk.h"
+
+/* A directory entry buffered in inode order mode. The name is an offset
+   into the name pool of the list. */
+typedef struct
+{
+    ino_t ino;
+    unsigned char type;
+    size_t name;
+} dirwalk_dirent_t;
+
+typedef struct
+{
+    dirwalk_dirent_t *entries;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_len;
+    size_t names_capacity;
+} dirwalk_dirent_list_t;
+
+static bool dirwalk_read(dirwalk_t *walk, dirwalk_entry_t *dir);
+
+static inline bool
+dirwalk_is_dot(const char *name)
+{
+    return name[0] == '.'
+           && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+static bool
+dirwalk_dirent_list_add(dirwalk_dirent_list_t *list, struct dirent *dirent)
+{
+    size_t namelen = strlen(dirent->d_name) + 1;
+
+    if (list->count == list->capacity)
+    {
+        size_t capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+        void *entries
+            = realloc(list->entries, sizeof(dirwalk_dirent_t) * capacity);
+
+        if (entries == NULL)
+            return false;
+
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    if (list->names_len + namelen > list->names_capacity)
+    {
+        size_t capacity
+            = list->names_capacity == 0 ? 4096 : list->names_capacity * 2;
+
+        while (list->names_len + namelen > capacity)
+            capacity *= 2;
+
+        char *names = realloc(list->names, capacity);
+
+        if (names == NULL)
+            return false;
+
+        list->names = names;
+        list->names_capacity = capacity;
+    }
+
+    memcpy(list->names + list->names_len, dirent->d_name, namelen);
+
+    list->entries[list->count++] = (dirwalk_dirent_t){
+        .ino = dirent->d_ino,
+        .type = dirent->d_type,
+        .name = list->names_len,
+    };
+
+    list->names_len += namelen;
+
+    return true;
+}
+
+static void
+dirwalk_dirent_list_free(dirwalk_dirent_list_t *list)
+{
+    free(list->entries);
+    free(list->names);
+}
+
+static int
+dirwalk_dirent_compare(const void *a, const void *b)
+{
+    ino_t ino_a = ((const dirwalk_dirent_t *) a)->ino;
+    ino_t ino_b = ((const dirwalk_dirent_t *) b)->ino;
+
+    return ino_a < ino_b ? -1 : ino_a > ino_b;
+}
+
+/* Append NAME to the path buffer. Returns the previous length of the path,
+   or (size_t) -1 if out of memory. */
+static size_t
+dirwalk_path_push(dirwalk_t *walk, size_t len, const char *name)
+{
+    size_t namelen = strlen(name);
+    bool slash = len > 0 && walk->path[len - 1] != '/';
+    size_t newlen = len + slash + namelen;
+
+    if (newlen + 1 > walk->pathcap)
+    {
+        size_t capacity = walk->pathcap == 0 ? 256 : walk->pathcap;
+
+        while (newlen + 1 > capacity)
+            capacity *= 2;
+
+        char *path = realloc(walk->path, capacity);
+
+        if (path == NULL)
+            return (size_t) -1;
+
+        walk->path = path;
+        walk->pathcap = capacity;
+    }
+
+    if (slash)
+        walk->path[len] = '/';
+
+    memcpy(walk->path + len + slash, name, namelen + 1);
+
+    return newlen;
+}
+
+static bool
+dirwalk_fail(dirwalk_t *walk, const dirwalk_entry_t *entry)
+{
+    if (walk->error != NULL && walk->error(walk, entry))
+        return true;
+
+    walk->stopped = true;
+    return false;
+}
+
+/* Tell the kernel that the directory will be read sequentially from the
+   start, so that the blocks holding the entries are read ahead instead of
+   one by one. Errors are ignored, since this is only a hint. */
+static void
+dirwalk_advise(int fd)
+{
+#ifdef HAVE_POSIX_FADVISE
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    (void) posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+}
+
+static int
+dirwalk_open(dirwalk_t *walk, int dirfd, const char *name, int flags)
+{
+    int fd;
+
+    if (walk->throttle != NULL)
+        throttle_begin(walk->throttle);
+
+    fd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | flags);
+
+    if (walk->throttle != NULL)
+        throttle_end(walk->throttle);
+
+    return fd;
+}
+
+/* lstat() the given entry. */
+bool
+dirwalk_stat(dirwalk_t *walk, const dirwalk_entry_t *entry, struct stat *st)
+{
+    int ret;
+
+    if (walk->throttle != NULL)
+        throttle_begin(walk->throttle);
+
+    ret = fstatat(entry->dirfd, entry->name, st, AT_SYMLINK_NOFOLLOW);
+
+    if (walk->throttle != NULL)
+        throttle_end(walk->throttle);
+
+    return ret == 0;
+}
+
+/* Returns the next entry of HANDLE, or NULL at its end or, with errno
+   set, if reading it fails. */
+static struct dirent *
+dirwalk_readdir(DIR *handle)
+{
+    errno = 0;
+    return readdir(handle);
+}
+
+/* Call the visit callback for the entry NAME of DIR and descend into it if
+   it is a directory and the callback allows it. */
+static bool
+dirwalk_visit(dirwalk_t *walk, dirwalk_entry_t *dir, const char *name,
+              unsigned char type, ino_t ino)
+{
+    size_t len = dirwalk_path_push(walk, dir->pathlen, name);
+
+    if (len == (size_t) -1)
+    {
+        errno = ENOMEM;
+        walk->stopped = true;
+        return false;
+    }
+
+    dirwalk_entry_t entry = {
+        .path = walk->path,
+        .pathlen = len,
+        .name = name,
+        .type = type,
+        .ino = ino,
+        .depth = dir->depth + 1,
+        .dirfd = dir->fd,
+        .fd = -1,
+    };
+
+    /* Not every filesystem fills in d_type. */
+    if (entry.type == DT_UNKNOWN)
+    {
+        struct stat st;
+
+        if (dirwalk_stat(walk, &entry, &st))
+            entry.type = IFTODT(st.st_mode);
+    }
+
+    dirwalk_action_t action
+        = walk->visit != NULL ? walk->visit(walk, &entry) : DIRWALK_CONTINUE;
+
+    if (action == DIRWALK_STOP)
+    {
+        walk->stopped = true;
+        return true;
+    }
+
+    if (action == DIRWALK_SKIP || entry.type != DT_DIR)
+        return true;
+
+    entry.fd = dirwalk_open(walk, dir->fd, name, O_NOFOLLOW);
+
+    if (entry.fd == -1)
+        return dirwalk_fail(walk, &entry);
+
+    bool ok = dirwalk_read(walk, &entry);
+
+    walk->path[dir->pathlen] = '\0';
+
+    return ok;
+}
+
+/* Read the directory DIR, whose fd is open, calling the pre() and post()
+   callbacks around its entries. Closes the fd. */
+static bool
+dirwalk_read(dirwalk_t *walk, dirwalk_entry_t *dir)
+{
+    if (walk->pre != NULL)
+    {
+        dirwalk_action_t action = walk->pre(walk, dir);
+
+        if (action != DIRWALK_CONTINUE)
+        {
+            walk->stopped = action == DIRWALK_STOP;
+            close(dir->fd);
+            return true;
+        }
+    }
+
+    DIR *handle = fdopendir(dir->fd);
+
+    if (handle == NULL)
+    {
+        close(dir->fd);
+        return dirwalk_fail(walk, dir);
+    }
+
+    dirwalk_advise(dir->fd);
+
+    struct dirent *dirent;
+    bool ok = true;
+    int read_error = 0; /* errno of readdir(), which ends the directory
+                           early. */
+
+    if (walk->flags & DIRWALK_INODE_ORDER)
+    {
+        /* Buffer the whole directory first and visit the entries sorted by
+           their inode numbers. On most filesystems, inode numbers follow
+           the on-disk layout of the inode tables, so the stats and the
+           descent into subdirectories sweep the disk in one direction
+           instead of seeking back and forth in readdir() order. */
+        dirwalk_dirent_list_t list = { 0 };
+
+        while (ok && (dirent = dirwalk_readdir(handle)) != NULL)
+        {
+            if (dirwalk_is_dot(dirent->d_name))
+                continue;
+
+            if (!dirwalk_dirent_list_add(&list, dirent))
+            {
+                errno = ENOMEM;
+                walk->stopped = true;
+                ok = false;
+            }
+        }
+
+        if (ok)
+            read_error = errno;
+
+        if (ok)
+            qsort(list.entries, list.count, sizeof(dirwalk_dirent_t),
+                  &dirwalk_dirent_compare);
+
+        for (size_t i = 0; ok && !walk->stopped && i < list.count; i++)
+            ok = dirwalk_visit(walk, dir, list.names + list.entries[i].name,
+                               list.entries[i].type, list.entries[i].ino);
+
+        dirwalk_dirent_list_free(&list);
+    }
+    else
+    {
+        while (ok && !walk->stopped
+               && (dirent = dirwalk_readdir(handle)) != NULL)
+        {
+            if (dirwalk_is_dot(dirent->d_name))
+                continue;
+
+            ok = dirwalk_visit(walk, dir, dirent->d_name, dirent->d_type,
+                               dirent->d_ino);
+        }
+
+        if (ok && !walk->stopped)
+            read_error = errno;
+    }
+
+    /* The path buffer may have been moved or still hold the path of the
+       last entry. */
+    walk->path[dir->pathlen] = '\0';
+    dir->path = walk->path;
+
+    /* The entries read before the error were visited, the directory is
+       only partly walked. */
+    if (ok && !walk->stopped && read_error != 0)
+    {
+        errno = read_error;
+        ok = dirwalk_fail(walk, dir);
+    }
+    else if (ok && !walk->stopped && walk->post != NULL
+             && walk->post(walk, dir) == DIRWALK_STOP)
+        walk->stopped = true;
+
+    closedir(handle);
+
+    return ok;
+}
+
+/* Walk the tree at ROOT. Returns false with errno set if the walk was
+   aborted because of an error, true otherwise, including when a callback
+   stopped it. */
+bool
+dirwalk_run(dirwalk_t *walk, const char *root)
+{
+    assert(walk);
+    assert(root);
+
+    walk->stopped = false;
+
+    size_t len = dirwalk_path_push(walk, 0, root);
+
+    if (len == (size_t) -1)
+    {
+        errno = ENOMEM;
+        return false;
+    }
+
+    dirwalk_entry_t entry = {
+        .path = walk->path,
+        .pathlen = len,
+        .name = root,
+        .type = DT_DIR,
+        .ino = 0,
+        .depth = 0,
+        .dirfd = AT_FDCWD,
+        .fd = dirwalk_open(walk, AT_FDCWD, root, 0),
+    };
+
+    if (entry.fd == -1)
+        return dirwalk_fail(walk, &entry);
+
+    struct stat st;
+
+    if (fstat(entry.fd, &st) == 0)
+        entry.ino = st.st_ino;
+
+    return dirwalk_read(walk, &entry);
+}
+
+void
+dirwalk_free(dirwalk_t *walk)
+{
+    free(walk->path);
+    walk->path = NULL;
+    walk->pathcap = 0;
+}
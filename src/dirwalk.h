@@ -0,0 +1,106 @@
+/*
+    dirwalk.h -- typedefs and prototypes for dirwalk.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DIRWALK_H__
+#define __DIRWALK_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "throttle.h"
+
+/* Visit the entries of every directory sorted by inode number. */
+#define DIRWALK_INODE_ORDER 0x01
+
+#define DIRWALK_INIT                                                          \
+    {                                                                         \
+        .flags = 0, .visit = NULL, .pre = NULL, .post = NULL, .error = NULL,  \
+        .throttle = NULL, .data = NULL, .path = NULL, .pathcap = 0,           \
+        .stopped = false                                                      \
+    }
+
+/* What the walker should do after a callback returns. */
+typedef enum
+{
+    DIRWALK_CONTINUE, /* Go on, descending into the entry if it is a
+                         directory. */
+    DIRWALK_SKIP,     /* Go on, but do not descend into the entry. */
+    DIRWALK_STOP      /* Stop the whole walk. */
+} dirwalk_action_t;
+
+/* An entry passed to the callbacks. Everything it points to is only valid
+   during the callback. */
+typedef struct
+{
+    const char *path;   /* Full path, starting with the root path. */
+    size_t pathlen;     /* Length of path. */
+    const char *name;   /* Name of the entry in its parent directory. */
+    unsigned char type; /* DT_* type of the entry, DT_UNKNOWN only if the
+                           filesystem does not fill in d_type and the
+                           entry cannot be stat()ed. */
+    ino_t ino;          /* Inode number of the entry. */
+    size_t depth;       /* 0 for the root, 1 for its entries, etc. */
+    int dirfd;          /* Parent directory, AT_FDCWD for the root. */
+    int fd;             /* The directory itself in pre() and post(), -1
+                           otherwise. */
+} dirwalk_entry_t;
+
+typedef struct dirwalk dirwalk_t;
+
+typedef dirwalk_action_t (*dirwalk_callback_t)(dirwalk_t *walk,
+                                               const dirwalk_entry_t *entry);
+
+/* Called with errno set when a directory cannot be opened or read. Return
+   true to skip the directory and go on, or false to abort the walk. */
+typedef bool (*dirwalk_error_callback_t)(dirwalk_t *walk,
+                                         const dirwalk_entry_t *entry);
+
+struct dirwalk
+{
+    int flags;                      /* DIRWALK_* flags. */
+    dirwalk_callback_t visit;       /* Called for every entry below the
+                                       root, before descending into it. */
+    dirwalk_callback_t pre;         /* Called for every directory after it
+                                       was opened, before its entries. */
+    dirwalk_callback_t post;        /* Called for every directory after all
+                                       of its entries. */
+    dirwalk_error_callback_t error; /* Called on errors. If NULL, the walk
+                                       is aborted. */
+    throttle_t *throttle;           /* Applied to every opendir and stat, if
+                                       not NULL. */
+    void *data;                     /* User data for the callbacks. */
+
+    /* Private. */
+    char *path;
+    size_t pathcap;
+    bool stopped;
+};
+
+__BEGIN_DECLS
+
+bool dirwalk_run(dirwalk_t *walk, const char *root);
+bool dirwalk_stat(dirwalk_t *walk, const dirwalk_entry_t *entry,
+                  struct stat *st);
+void dirwalk_free(dirwalk_t *walk);
+
+__END_DECLS
+
+#endif
@@ -21,402 +21,1746 @@
 #include <dirent.h>
 #include <errno.h>
 #include <getopt.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "batch.h"
+#include "coalesce.h"
 #include "dirmap.h"
+#include "eventfmt.h"
+#include "exclude.h"
+#include "fanwatch.h"
+#include "histogram.h"
+#include "outbuf.h"
+#include "reader.h"
+#include "record.h"
+#include "state.h"
+#include "topk.h"
 #include "utils.h"
+#include "watcher.h"
 
-#define INOTIFY_MAX_USER_WATCHES_FILE "/proc/sys/fs/inotify/max_user_watches"
-#define EVENT_SIZE (sizeof(struct inotify_event))
-#define EVENT_BUF_LEN ((EVENT_SIZE + 16) * 1024)
 #define IN_DEFAULT (IN_CREATE | IN_MOVE | IN_DELETE | IN_MODIFY | IN_ATTRIB)
 
 typedef uint32_t mask_t; /* inotify mask type. */
 
-/* Configuration of the program.
-   TODO: Add support of recursively watching directories. */
+/* Kernel interfaces events can be read from. */
+typedef enum
+{
+    BACKEND_INOTIFY,
+    BACKEND_FANOTIFY
+} backend_t;
+
+/* Formats of the events written to STDOUT. */
+typedef enum
+{
+    FORMAT_TEXT,
+    FORMAT_JSONL,
+    FORMAT_BINARY
+} format_t;
+
+/* A directory to watch, with the events to report in its tree. */
 typedef struct
 {
-    int fd;          /* The file descriptor provided by inotify_init(). */
-    int wd;          /* Watch descriptor for the given directory. */
-    mask_t mask;     /* Watch descriptor for the given directory. */
-    char *dirpath;   /* Path of the directory to watch. */
-    int watchcount;  /* Count of the watchers in total. */
-    int max_watches; /* Max count of the watchers in total. */
-    bool recursive;  /* Flag set by options. */
+    char *path;
+    mask_t mask;
+} root_t;
+
+/* Configuration of the program. */
+typedef struct
+{
+    mask_t mask;           /* Events to report, unless set for the root. */
+    root_t *roots;         /* Directories to watch. */
+    size_t rootcount;
+    bool recursive;        /* Flag set by options. */
     verbosity_t verbosity; /* Verbosity level set by options. */
+    backend_t backend;     /* Where the events come from. */
+    format_t format;       /* How the events are written. */
+    unsigned long coalesce; /* Window to merge events in, in milliseconds. */
+    size_t queue_size;      /* Number of events the reader can queue. */
+    size_t shards;          /* Number of inotify instances. */
+    int jobs;               /* Threads crawling the tree at startup, 0 for
+                               one per CPU. */
+    bool hidden;            /* Watch directories starting with a dot. */
+    bool snapshot_stats;    /* Record the mtime and size of every file in
+                               the snapshots. */
+    unsigned long budget;   /* Max count of the watches to use, or 0. */
+    unsigned long poll_interval; /* How often to poll the directories over
+                                    the budget, in milliseconds. */
+    char *exec;                  /* Command to run on the changed paths. */
+    unsigned long batch_window;  /* Time to collect paths for, in ms. */
+    unsigned long batch_count;   /* Max number of paths per run, or 0. */
+    int max_exec;                /* Max number of commands running. */
+    size_t top;                  /* Rank this many directories and
+                                    extensions instead of logging events. */
+    unsigned long top_interval;  /* Seconds between two rankings. */
+    char *state;                 /* File to save the watched tree to. */
+    unsigned long checkpoint;    /* Seconds between two saves of it. */
+    char *record;                /* File to record the events to. */
+    char *replay;                /* Recording to replay instead of watching
+                                    directories. */
+    bool replay_recorded;        /* Replay at the recorded speed, instead of
+                                    as fast as possible. */
+    char *metrics;               /* File to write the metrics to. */
+    unsigned long metrics_interval; /* Seconds between two writes of it. */
 } config_t;
 
-/* Event color and stringified representation. */
+/* An inotify instance with its own watches, kernel queue and reader
+   thread. */
 typedef struct
 {
-    char *eventstr; /* The stringified representation of the event. */
-    int colorcode;  /* Appropriate color code for the event. */
-} event_info_t;
+    watcher_t watcher;
+    reader_t reader;
+} shard_t;
+
+/* Label of an event, with its color. */
+typedef struct
+{
+    mask_t mask;       /* Events with this label. */
+    const char *name;  /* The label alone, for the structured formats. */
+    const char *label; /* The label, padded to the width of the column. */
+    size_t len;        /* Length of the label, with color codes. */
+} event_label_t;
+
+#define EVENT_LABEL(mask, color, name, padding)                               \
+    {                                                                         \
+        mask, name, COLOR("1;" color, name padding),                          \
+            sizeof(COLOR("1;" color, name padding)) - 1                       \
+    }
+
+/* Event labels, in order of precedence when a mask has several events. */
+static const event_label_t event_labels[] = {
+    EVENT_LABEL(IN_CREATE, "32", "CREATE", "    "),
+    EVENT_LABEL(IN_DELETE, "31", "DELETE", "    "),
+    EVENT_LABEL(IN_ACCESS, "34", "READ", "      "),
+    EVENT_LABEL(IN_MODIFY, "33", "MODIFIED", "  "),
+    EVENT_LABEL(IN_ATTRIB, "33", "ATTRCHANGE", ""),
+    EVENT_LABEL(IN_OPEN, "34", "OPENED", "    "),
+    EVENT_LABEL(IN_CLOSE, "34", "CLOSED", "    "),
+    EVENT_LABEL(IN_MOVED_TO, "33", "MOVEDTO", "   "),
+    EVENT_LABEL(IN_MOVED_FROM, "33", "MOVEDFROM", " "),
+    EVENT_LABEL(IN_MOVE_SELF, "33", "MOVEDSELF", " "),
+    EVENT_LABEL(IN_DELETE_SELF, "31", "DELSELF", "   "),
+};
 
 /* The main configuration variable for the whole program. */
 static config_t config;
 
-/* Directory list map. */
-static dirmap_t dirmap = DIRMAP_INIT;
+/* The inotify instances and their watched directories. With several
+   shards, the first one watches the root directory, and every directory
+   directly below it is watched by one of the shards along with its
+   subtree. */
+static shard_t *shards = NULL;
+static size_t shard_count = 0;
+
+/* The fanotify instance, when using the fanotify backend. */
+static fanwatch_t fanwatch = { .fd = -1, .mount_fd = -1 };
+
+/* Paths waiting to be passed to the command of --exec. */
+static batch_t batch = { .command = NULL };
+
+/* The directories and extensions with the most events since the last
+   ranking, with --top. Each one keeps TOP_CANDIDATES times as many
+   candidates as it ranks, so that the last ranks are rarely missed. */
+#define TOP_CANDIDATES 4
+#define TOP_INTERVAL 10
+
+static topk_t top_dirs;
+static topk_t top_exts;
+static uint64_t top_started;
+
+/* How often the watched tree is saved with --state, in seconds. */
+#define CHECKPOINT_INTERVAL 60
+
+/* Whether the watched tree is complete, and may be saved. */
+static bool state_ready = false;
+
+/* The events and watches being recorded with --record. */
+static recorder_t recorder = { .fd = -1 };
+
+/* How often the metrics are written with --metrics, in seconds. */
+#define METRICS_INTERVAL 10
+
+/* Most events handled in one pass over the queues of the readers, before
+   the loop goes back to the timers and signals. */
+#define DRAIN_MAX 4096
+
+/* The events read and the time at the previous write of the metrics, to
+   compute the rate of events since. */
+typedef struct
+{
+    uint64_t time;
+    uint64_t events;
+} metrics_mark_t;
+
+static metrics_mark_t metrics_file_mark;
+static metrics_mark_t metrics_signal_mark;
+
+/* Nanoseconds from the read() of each event to the write() of the output
+   that follows its handling, with --metrics. The read times of the events
+   handled since the last write are kept until then: at most one pass over
+   the queues of the readers. */
+static histogram_t latency;
+static uint64_t unwritten[DRAIN_MAX];
+static size_t unwritten_count = 0;
+
+/* Directories not to watch in recursive mode. */
+static exclude_t exclude;
+
+/* Events waiting to be merged, when coalescing. */
+static coalesce_t coalesce;
+
+/* When replaying, the recorded time of the record being replayed, in
+   nanoseconds: events are merged and timestamped in recorded time, so the
+   output is the same as live whatever the replay speed. */
+static uint64_t replay_time = 0;
+
+/* The event loop: an epoll instance waiting on the event source, a timer
+   for timed work and the signals that stop the program. */
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static int signal_fd = -1;
+
+/* Formatted events waiting to be written to STDOUT. */
+static outbuf_t output = { .fd = -1 };
+
+
+enum
+{
+    OPT_BACKEND = CHAR_MAX + 1,
+    OPT_BATCH,
+    OPT_BUDGET,
+    OPT_CHECKPOINT,
+    OPT_COALESCE,
+    OPT_EXCLUDE,
+    OPT_EXEC,
+    OPT_EXCLUDE_FROM,
+    OPT_FORMAT,
+    OPT_HIDDEN,
+    OPT_INTERVAL,
+    OPT_MAX_EXEC,
+    OPT_METRICS,
+    OPT_METRICS_INTERVAL,
+    OPT_POLL_INTERVAL,
+    OPT_QUEUE_SIZE,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_REPLAY_SPEED,
+    OPT_ROOT,
+    OPT_SHARDS,
+    OPT_SNAPSHOT_STATS,
+    OPT_STATE,
+    OPT_TOP
+};
 
 /* Command-line options. */
 static struct option const long_options[] = {
-    {"events",     required_argument, NULL, 'e'},
-    { "help",      no_argument,       NULL, 'h'},
-    { "recursive", no_argument,       NULL, 'r'},
-    { "verbose",   optional_argument, NULL, 'V'},
-    { "version",   no_argument,       NULL, 'v'}
+    {"backend",           required_argument, NULL, OPT_BACKEND          },
+    { "batch",            required_argument, NULL, OPT_BATCH            },
+    { "budget",           required_argument, NULL, OPT_BUDGET           },
+    { "checkpoint",       required_argument, NULL, OPT_CHECKPOINT       },
+    { "coalesce",         required_argument, NULL, OPT_COALESCE         },
+    { "events",           required_argument, NULL, 'e'                  },
+    { "exclude",          required_argument, NULL, OPT_EXCLUDE          },
+    { "exclude-from",     required_argument, NULL, OPT_EXCLUDE_FROM     },
+    { "exec",             required_argument, NULL, OPT_EXEC             },
+    { "format",           required_argument, NULL, OPT_FORMAT           },
+    { "help",             no_argument,       NULL, 'h'                  },
+    { "hidden",           no_argument,       NULL, OPT_HIDDEN           },
+    { "interval",         required_argument, NULL, OPT_INTERVAL         },
+    { "jobs",             required_argument, NULL, 'j'                  },
+    { "max-exec",         required_argument, NULL, OPT_MAX_EXEC         },
+    { "metrics",          required_argument, NULL, OPT_METRICS          },
+    { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+    { "poll-interval",    required_argument, NULL, OPT_POLL_INTERVAL    },
+    { "queue-size",       required_argument, NULL, OPT_QUEUE_SIZE       },
+    { "record",           required_argument, NULL, OPT_RECORD           },
+    { "recursive",        no_argument,       NULL, 'r'                  },
+    { "replay",           required_argument, NULL, OPT_REPLAY           },
+    { "replay-speed",     required_argument, NULL, OPT_REPLAY_SPEED     },
+    { "root",             required_argument, NULL, OPT_ROOT             },
+    { "shards",           required_argument, NULL, OPT_SHARDS           },
+    { "snapshot-stats",   no_argument,       NULL, OPT_SNAPSHOT_STATS   },
+    { "state",            required_argument, NULL, OPT_STATE            },
+    { "top",              required_argument, NULL, OPT_TOP              },
+    { "verbose",    optional_argument, NULL, 'V'           },
+    { "version",    no_argument,       NULL, 'v'           },
+    { NULL,         0,                 NULL, 0             }
 };
 
+static bool dirwatch_log_event(eventfmt_event_t *event);
+static void dirwatch_save_state();
+static uint64_t dirwatch_now();
+static void dirwatch_top_report(uint64_t now);
+
 /* Close the file and watch descriptors. */
 static void
 dirwatch_cleanup()
 {
-    if (config.wd)
-        inotify_rm_watch(config.fd, config.wd);
+    uint64_t dropped = 0;
+
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        reader_t *reader = &shards[i].reader;
+
+        if (reader->slots == NULL)
+            continue;
+
+        dropped += atomic_load(&reader->dropped);
+
+        LOG_DEBUG_1(config.verbosity,
+                    "Shard %zu: events read: %lu, most queued: %zu of %zu\n",
+                    i, (unsigned long) atomic_load(&reader->received),
+                    atomic_load(&reader->highwater), reader->capacity);
+
+        reader_stop(reader);
+    }
+
+    if (dropped > 0)
+        print_error(false, false,
+                    "%lu events were dropped because the queue was full; "
+                    "try a larger --queue-size",
+                    (unsigned long) dropped);
+
+    if (state_ready)
+        dirwatch_save_state();
+
+    if (recorder.fd != -1 && !recorder_close(&recorder))
+        print_error(true, false, "%s: cannot write the recording",
+                    config.record);
+
+    if (config.coalesce > 0)
+    {
+        coalesce_flush(&coalesce);
+        coalesce_free(&coalesce);
+    }
+
+    /* The events since the last ranking are ranked as well. */
+    if (config.top > 0 && top_dirs.sketch != NULL)
+    {
+        dirwatch_top_report(dirwatch_now());
+        topk_free(&top_dirs);
+        topk_free(&top_exts);
+    }
+
+    if (output.data != NULL)
+    {
+        outbuf_flush(&output);
+        outbuf_free(&output);
+    }
+
+    /* The last paths are passed to the command as well. */
+    if (batch.command != NULL)
+    {
+        batch_finish(&batch);
+        batch_free(&batch);
+    }
+
+    for (size_t i = 0; i < shard_count; i++)
+        watcher_free(&shards[i].watcher);
+
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+
+    fanwatch_free(&fanwatch);
+    exclude_free(&exclude);
+
+    if (epoll_fd != -1)
+        close(epoll_fd);
+
+    if (timer_fd != -1)
+        close(timer_fd);
+
+    if (signal_fd != -1)
+        close(signal_fd);
+
+    epoll_fd = timer_fd = signal_fd = -1;
+}
+
+/* Block the signals that stop the program, and receive them through a
+   signalfd in the event loop instead, so that it can shut down cleanly. */
+static void
+dirwatch_set_signal_handlers()
+{
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    /* Commands run by --exec are reaped in the event loop. */
+    sigaddset(&mask, SIGCHLD);
+
+    /* The metrics are written to the standard error on request. */
+    sigaddset(&mask, SIGUSR1);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        print_error(true, true, "failed to block signals");
+
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC);
+
+    if (signal_fd == -1)
+        print_error(true, true, "failed to create signalfd");
+}
+
+/* Returns the current time in nanoseconds on the monotonic clock, which
+   is also the clock of the timestamps of the reader thread. */
+static uint64_t
+dirwatch_now_ns()
+{
+    struct timespec ts;
 
-    dirmap_free(&dirmap);
-    close(config.fd);
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-/* In case if we receive a SIGINT signal, then print the text into STDOUT and
-   exit. */
+/* Returns the current time in milliseconds on the monotonic clock. */
+static uint64_t
+dirwatch_now()
+{
+    return dirwatch_now_ns() / 1000000;
+}
+
+/* Returns the time of the events handled now, in nanoseconds: the current
+   time, or the recorded one when replaying. */
+static uint64_t
+dirwatch_event_now_ns()
+{
+    return replay_time != 0 ? replay_time : dirwatch_now_ns();
+}
+
+/* Report an event read at TIME, or queue it to be merged with the events
+   that follow for the same file when coalescing. */
 static void
-sigint_handle()
+dirwatch_report(int wd, mask_t mask, uint32_t cookie, uint64_t time,
+                const char *name, const char *dir)
 {
-    puts("SIGINT received. Exiting.");
-    dirwatch_cleanup();
-    exit(EXIT_SUCCESS);
+    if (config.coalesce > 0)
+    {
+        coalesce_add(&coalesce, time / 1000000, wd, dir, name, mask);
+        return;
+    }
+
+    eventfmt_event_t event = {
+        .time = time,
+        .wd = wd,
+        .mask = mask,
+        .cookie = cookie,
+        .count = 1,
+        .dir = dir,
+        .name = name,
+    };
+
+    if (!dirwatch_log_event(&event))
+        print_error(true, true, "unknown event in mask");
 }
 
-/* Sets the signal handler functions. */
+/* Report a merged event when its window ends. Merged events have no
+   cookie, and are timestamped when they are written. */
 static void
-dirwatch_set_signal_handlers()
+dirwatch_on_coalesced(coalesce_t *coalesce, int wd, const char *dir,
+                      const char *name, mask_t mask, size_t count)
+{
+    eventfmt_event_t event = {
+        .time = dirwatch_event_now_ns(),
+        .wd = wd,
+        .mask = mask,
+        .cookie = 0,
+        .count = count,
+        .dir = dir,
+        .name = name,
+    };
+
+    if (!dirwatch_log_event(&event))
+        print_error(true, true, "unknown event in mask");
+}
+
+/* Returns the events to report in the directory at DIRPATH, whose watch
+   in WATCHER is WD, or -1 if it is polled: those of its root. */
+static mask_t
+dirwatch_root_mask(watcher_t *watcher, int wd, const char *dirpath)
+{
+    if (wd > 0)
+    {
+        dirmap_entry_t *entry = dirmap_find_by_wd(&watcher->dirmap, wd);
+
+        if (entry != NULL)
+            return entry->root->mask;
+    }
+
+    for (size_t i = 0; i < config.rootcount; i++)
+    {
+        const char *root = config.roots[i].path;
+        size_t len = strlen(root);
+
+        while (len > 1 && root[len - 1] == '/')
+            len--;
+
+        if (strncmp(dirpath, root, len) == 0
+            && (dirpath[len] == '\0' || dirpath[len] == '/'
+                || root[len - 1] == '/'))
+            return config.roots[i].mask;
+    }
+
+    return config.mask;
+}
+
+/* Report the events synthesized by the watcher for the contents of new
+   directories, and record them. */
+static void
+dirwatch_on_synthesized(watcher_t *watcher, mask_t mask, int wd,
+                        const char *dirpath, const char *name)
+{
+    /* The watcher is the first member of its shard. */
+    if (recorder.fd != -1)
+        recorder_synthesized(&recorder, (shard_t *) watcher - shards,
+                             dirwatch_now_ns(), mask, wd, dirpath, name);
+
+    if (mask & dirwatch_root_mask(watcher, wd, dirpath))
+        dirwatch_report(wd, mask, 0, dirwatch_event_now_ns(), name, dirpath);
+}
+
+/* Report an event read by the fanotify backend. */
+static void
+dirwatch_on_fanotify_event(fanwatch_t *fanwatch, mask_t mask,
+                           const char *dirpath, const char *name)
+{
+    /* There is no tree of snapshots to rescan with fanotify, so the lost
+       events can only be reported. */
+    if (mask & IN_Q_OVERFLOW)
+    {
+        print_error(false, false,
+                    "event queue overflowed, some events were lost");
+        return;
+    }
+
+    dirwatch_report(-1, mask, 0, dirwatch_now_ns(), name, dirpath);
+}
+
+/* Initializes the fanotify backend. One mark covers the whole filesystem,
+   so no directories need to be crawled. */
+static void
+dirwatch_init_fanotify()
+{
+    if (!fanwatch_init(&fanwatch, config.roots[0].path, config.roots[0].mask,
+                       config.recursive))
+        print_error(true, true, "%s: cannot watch directory with fanotify",
+                    config.roots[0].path);
+
+    LOG_DEBUG_1(config.verbosity, "Watching filesystem of: %s\n",
+                config.roots[0].path);
+}
+
+/* Returns the shard watching the top-level directory at PATH, other than
+   the first one, or NULL if there is none. */
+static shard_t *
+dirwatch_find_shard(const char *path, dirmap_entry_t **entry)
+{
+    for (size_t i = 1; i < shard_count; i++)
+    {
+        *entry = dirmap_find_child(&shards[i].watcher.dirmap, NULL, path);
+
+        if (*entry != NULL)
+            return &shards[i];
+    }
+
+    return NULL;
+}
+
+/* Build the path of the directory NAME directly below the root at
+   ROOT. */
+static char *
+dirwatch_top_level_path(const char *root, const char *name)
+{
+    size_t len = strlen(root);
+    char *path = xmalloc(len + strlen(name) + 2);
+
+    strcpy(path, root);
+
+    if (len == 0 || path[len - 1] != '/')
+        strcat(path, "/");
+
+    strcat(path, name);
+
+    return path;
+}
+
+/* The first shard watches the directories directly below the roots that
+   no other shard took. */
+static bool
+dirwatch_shard_filter(watcher_t *watcher, dirmap_entry_t *parent,
+                      const char *name)
+{
+    if (parent->parent != NULL)
+        return true;
+
+    char *path = dirwatch_top_level_path(parent->name, name);
+    dirmap_entry_t *entry;
+    bool mine = dirwatch_find_shard(path, &entry) == NULL;
+
+    free(path);
+
+    return mine;
+}
+
+/* Returns the shard with the fewest watches. */
+static shard_t *
+dirwatch_least_loaded_shard()
+{
+    shard_t *shard = &shards[0];
+
+    for (size_t i = 1; i < shard_count; i++)
+        if (shards[i].watcher.watchcount < shard->watcher.watchcount)
+            shard = &shards[i];
+
+    return shard;
+}
+
+/* Watch the directory at PATH, directly below a root watching MASK, in
+   SHARD. */
+static void
+dirwatch_shard_add(shard_t *shard, const char *path, mask_t mask,
+                   bool synthesize)
+{
+    if (shard == &shards[0])
+        return;
+
+    LOG_DEBUG_2(config.verbosity, "Watching %s in shard %zu\n", path,
+                (size_t) (shard - shards));
+
+    if (watcher_add_root(&shard->watcher, path, mask, synthesize) == NULL
+        && errno != ENOENT && errno != ENOTDIR)
+        print_error(true, false, "%s: cannot watch directory", path);
+}
+
+/* Spread the directories directly below ROOT over the shards, round robin
+   from NEXT. The first shard gets the root itself and its share of them. */
+static size_t
+dirwatch_init_shards(const root_t *root, size_t next)
+{
+    DIR *dir = opendir(root->path);
+    struct dirent *dirent;
+
+    if (dir == NULL)
+        print_error(true, true, "%s: cannot watch directory", root->path);
+
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (dirent->d_type != DT_DIR || STREQ(dirent->d_name, ".")
+            || STREQ(dirent->d_name, ".."))
+            continue;
+
+        char *path = dirwatch_top_level_path(root->path, dirent->d_name);
+
+        if (exclude_match(&exclude, path))
+        {
+            free(path);
+            continue;
+        }
+
+        dirwatch_shard_add(&shards[next], path, root->mask, false);
+        next = (next + 1) % shard_count;
+        free(path);
+    }
+
+    closedir(dir);
+
+    return next;
+}
+
+/* Returns whether EVENT is the IN_MOVED_TO of a directory the first shard
+   already watches under its old name, which it renames itself. */
+static bool
+dirwatch_is_renamed(const struct inotify_event *event)
+{
+    watcher_t *watcher = &shards[0].watcher;
+
+    if (!(event->mask & IN_MOVED_TO))
+        return false;
+
+    for (size_t i = 0; i < watcher->movecount; i++)
+        if (watcher->moves[i].cookie == event->cookie)
+            return true;
+
+    return false;
+}
+
+/* Keep the shards in sync with the directories directly below ROOT, which
+   are reported by the first shard. New ones go to the shard with the
+   fewest watches, and ones that left are dropped from their shard. */
+static void
+dirwatch_on_top_level_event(dirmap_entry_t *root,
+                            const struct inotify_event *event)
+{
+    char *path = dirwatch_top_level_path(root->name, event->name);
+    dirmap_entry_t *entry;
+    shard_t *shard = dirwatch_find_shard(path, &entry);
+
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        if (shard != NULL)
+            watcher_remove(&shard->watcher, entry);
+    }
+    else if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && shard == NULL
+             && !exclude_match(&exclude, path) && !dirwatch_is_renamed(event))
+        dirwatch_shard_add(dirwatch_least_loaded_shard(), path, root->mask,
+                           event->mask & IN_CREATE);
+
+    free(path);
+}
+
+/* Returns the watchers of the shards, to be freed by the caller. */
+static watcher_t **
+dirwatch_watchers()
+{
+    watcher_t **watchers = xmalloc(sizeof(watcher_t *) * shard_count);
+
+    for (size_t i = 0; i < shard_count; i++)
+        watchers[i] = &shards[i].watcher;
+
+    return watchers;
+}
+
+/* Save the watched tree to the file of --state. */
+static void
+dirwatch_save_state()
+{
+    watcher_t **watchers = dirwatch_watchers();
+    uint64_t start = dirwatch_now();
+
+    if (!state_save(config.state, watchers, shard_count))
+        print_error(true, false, "%s: cannot save the watched tree",
+                    config.state);
+    else
+        LOG_DEBUG_1(config.verbosity, "Saved the watched tree in %.3f s\n",
+                    (dirwatch_now() - start) / 1000.0);
+
+    free(watchers);
+}
+
+/* Report what changed in the watched tree since it was last saved to the
+   file of --state, before any live event. */
+static void
+dirwatch_resume_state()
+{
+    state_t state;
+
+    if (!state_load(&state, config.state))
+    {
+        if (errno != ENOENT)
+            print_error(true, false, "%s: cannot read the saved tree",
+                        config.state);
+    }
+    else
+    {
+        watcher_t **watchers = dirwatch_watchers();
+
+        LOG_DEBUG_1(config.verbosity, "Comparing with %zu saved directories\n",
+                    state.count);
+        state_diff(&state, watchers, shard_count);
+        state_free(&state);
+        free(watchers);
+    }
+
+    state_ready = true;
+}
+
+/* Record a directory watched by WATCHER. */
+static void
+dirwatch_on_watch(watcher_t *watcher, dirmap_entry_t *entry)
+{
+    recorder_watch(&recorder, (shard_t *) watcher - shards, dirwatch_now_ns(),
+                   entry);
+}
+
+/* Record ENTRY and the directories below it, parents first. */
+static void
+dirwatch_record_tree(size_t shard, dirmap_entry_t *entry, uint64_t time)
+{
+    recorder_watch(&recorder, shard, time, entry);
+
+    for (dirmap_entry_t *child = entry->children; child != NULL;
+         child = child->next)
+        dirwatch_record_tree(shard, child, time);
+}
+
+/* Start recording to the file of --record: the watches set up so far, then
+   every event and new watch. */
+static void
+dirwatch_start_recording()
+{
+    uint64_t time = dirwatch_now_ns();
+
+    if (!recorder_open(&recorder, config.record, shard_count,
+                       config.recursive))
+        print_error(true, true, "%s: cannot record events", config.record);
+
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        dirmap_t *map = &shards[i].watcher.dirmap;
+
+        for (size_t j = 0; j < map->capacity; j++)
+            if (map->by_wd[j] != NULL && map->by_wd[j]->parent == NULL)
+                dirwatch_record_tree(i, map->by_wd[j], time);
+
+        shards[i].watcher.on_watch = &dirwatch_on_watch;
+    }
+}
+
+/* Initializes the inotify backend: the shards and their watches. */
+static void
+dirwatch_init_inotify()
+{
+    shard_count = config.recursive ? config.shards : 1;
+    shards = xmalloc(sizeof(shard_t) * shard_count);
+
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        watcher_t *watcher = &shards[i].watcher;
+
+        shards[i].reader.slots = NULL;
+
+        if (!watcher_init(watcher, config.mask, config.recursive))
+            print_error(true, true, "cannot initialize inotify");
+
+        watcher->verbosity = config.verbosity;
+        watcher->on_synthesized = &dirwatch_on_synthesized;
+
+        /* Snapshots let the watcher find what changed when events are lost.
+           Reading them costs a readdir() per directory, and stat'ing every
+           file to find the modified ones as well is only done on request. */
+        watcher->snapshots = true;
+        watcher->snapshot_stats = config.snapshot_stats;
+        watcher->jobs = config.jobs;
+        watcher->exclude = &exclude;
+
+        /* The budget is shared evenly by the shards. */
+        if (config.budget > 0)
+            watcher->budget = config.budget / shard_count > 0
+                                  ? config.budget / shard_count
+                                  : 1;
+
+        /* inotify events are read on a separate thread per shard, which
+           signals an eventfd when it has queued some. It starts before the
+           watches are set up, so the events that arrive meanwhile are
+           queued until the event loop runs. */
+        if (!reader_start(&shards[i].reader, watcher->fd, config.queue_size))
+            print_error(true, true, "cannot start the reader thread");
+    }
+
+    uint64_t start = dirwatch_now();
+
+    if (shard_count > 1)
+    {
+        size_t next = 0;
+
+        shards[0].watcher.filter = &dirwatch_shard_filter;
+
+        for (size_t i = 0; i < config.rootcount; i++)
+            next = dirwatch_init_shards(&config.roots[i], next);
+    }
+
+    for (size_t i = 0; i < config.rootcount; i++)
+    {
+        const root_t *root = &config.roots[i];
+
+        LOG_DEBUG_2(config.verbosity, "Attempting to watch directory: %s\n",
+                    root->path);
+
+        /* Watch for changes in this directory, and all directories below it
+           in recursive mode. Only notify for the events of the root. */
+        if (watcher_add_root(&shards[0].watcher, root->path, root->mask, false)
+            == NULL)
+            print_error(true, true,
+                        config.recursive
+                            ? "%s: cannot recursively watch directory"
+                            : "%s: cannot watch directory",
+                        root->path);
+
+        LOG_DEBUG_1(config.verbosity, "Watching directory: %s\n", root->path);
+    }
+
+    uint64_t elapsed = dirwatch_now() - start;
+    unsigned long watches = 0, queued = 0;
+
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        watches += shards[i].watcher.watchcount;
+        queued += atomic_load(&shards[i].reader.received);
+    }
+
+    LOG_DEBUG_1(config.verbosity,
+                "Set up %lu watches in %.3f s (%.0f per second), "
+                "%lu events queued meanwhile\n",
+                watches, elapsed / 1000.0,
+                watches * 1000.0 / (elapsed > 0 ? elapsed : 1), queued);
+
+    if (config.state != NULL)
+        dirwatch_resume_state();
+
+    if (config.record != NULL)
+        dirwatch_start_recording();
+}
+
+/* Initializes where the events go: the output and the optional stages
+   before it. */
+static void
+dirwatch_init_output()
+{
+    outbuf_init(&output, STDOUT_FILENO, OUTBUF_CAPACITY);
+    atexit(&dirwatch_cleanup);
+    histogram_init(&latency);
+
+    if (config.coalesce > 0)
+        coalesce_init(&coalesce, config.coalesce, &dirwatch_on_coalesced);
+
+    if (config.top > 0)
+    {
+        topk_init(&top_dirs, config.top * TOP_CANDIDATES);
+        topk_init(&top_exts, config.top * TOP_CANDIDATES);
+        top_started = dirwatch_now();
+    }
+
+    if (config.exec != NULL)
+    {
+        batch_init(&batch, config.exec, config.batch_window,
+                   config.batch_count, config.max_exec);
+        batch.verbosity = config.verbosity;
+    }
+}
+
+/* Initializes the program and its resources. */
+static void
+dirwatch_init()
+{
+    dirwatch_set_signal_handlers();
+
+    for (size_t i = 0; i < config.rootcount; i++)
+        exclude_add_base(&exclude, config.roots[i].path);
+
+    dirwatch_init_output();
+
+    if (config.backend == BACKEND_FANOTIFY)
+    {
+        dirwatch_init_fanotify();
+        return;
+    }
+
+    if (config.jobs == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        config.jobs = cpus < 1 ? 1 : cpus;
+    }
+
+    dirwatch_init_inotify();
+}
+
+/* Returns the label of the event in MASK, or NULL if there is none. */
+static const event_label_t *
+dirwatch_event_label(mask_t mask)
+{
+    for (size_t i = 0; i < sizeof event_labels / sizeof event_labels[0]; i++)
+        if (mask & event_labels[i].mask)
+            return &event_labels[i];
+
+    return NULL;
+}
+
+/* Count EVENT in the rankings of its directory and of the extension of
+   its name. Directories have no extension, and names without a dot after
+   their first character are counted under an empty one. */
+static void
+dirwatch_top_add(const eventfmt_event_t *event)
+{
+    const char *dir = event->dir != NULL ? event->dir : "";
+    uint32_t weight = event->count > 1 ? event->count : 1;
+
+    topk_add(&top_dirs, dir, strlen(dir), weight);
+
+    if (event->mask & IN_ISDIR)
+        return;
+
+    const char *dot = strrchr(event->name, '.');
+
+    if (dot == NULL || dot == event->name)
+        dot = "";
+
+    topk_add(&top_exts, dot, strlen(dot), weight);
+}
+
+/* Write the ranking of TOPK in text, with rates over SECONDS. */
+static void
+dirwatch_top_text(topk_t *topk, const char *what, double seconds)
+{
+    char buf[64];
+    size_t count = topk->size < config.top ? topk->size : config.top;
+    topk_item_t *items = topk_sort(topk);
+    int len = snprintf(buf, sizeof buf, "Top %zu %s:\n", count, what);
+
+    outbuf_write(&output, buf, len);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const char *key = items[i].key;
+
+        len = snprintf(buf, sizeof buf, "%6zu %10lu %10.1f/s  ", i + 1,
+                       (unsigned long) items[i].count,
+                       items[i].count / seconds);
+        outbuf_write(&output, buf, len);
+
+        if (topk == &top_exts && *key == '\0')
+            key = "(none)";
+
+        outbuf_write(&output, key, strlen(key));
+        outbuf_write(&output, "\n", 1);
+    }
+}
+
+/* Write the ranking of TOPK as a JSON array of objects. */
+static void
+dirwatch_top_jsonl(topk_t *topk, const char *key_name)
 {
-    struct sigaction action;
+    size_t count = topk->size < config.top ? topk->size : config.top;
+    topk_item_t *items = topk_sort(topk);
 
-    action.sa_handler = sigint_handle;
-    action.sa_flags = 0;
+    outbuf_write(&output, "[", 1);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        char buf[48];
+        int len;
+
+        if (i > 0)
+            outbuf_write(&output, ",", 1);
+
+        outbuf_write(&output, "{\"", 2);
+        outbuf_write(&output, key_name, strlen(key_name));
+        outbuf_write(&output, "\":\"", 3);
+        eventfmt_json_string(&output, items[i].key);
+        len = snprintf(buf, sizeof buf, "\",\"count\":%lu}",
+                       (unsigned long) items[i].count);
+        outbuf_write(&output, buf, len);
+    }
 
-    if (sigaction(SIGINT, &action, NULL) == -1)
-        print_error(true, true, "failed to set SIGINT handler");
+    outbuf_write(&output, "]", 1);
 }
 
+/* Write the rankings of the events since the last one, and start counting
+   again. Counts are estimates which may be slightly too high, never too
+   low. */
+static void
+dirwatch_top_report(uint64_t now)
+{
+    double seconds = (now - top_started) / 1000.0;
+    uint64_t total = top_dirs.total;
+
+    if (seconds <= 0)
+        seconds = 0.001;
+
+    if (config.format == FORMAT_JSONL)
+    {
+        char buf[96];
+        int len = snprintf(buf, sizeof buf,
+                           "{\"seconds\":%.3f,\"events\":%lu,"
+                           "\"directories\":",
+                           seconds, (unsigned long) total);
+
+        outbuf_write(&output, buf, len);
+        dirwatch_top_jsonl(&top_dirs, "dir");
+        outbuf_write(&output, ",\"extensions\":", 14);
+        dirwatch_top_jsonl(&top_exts, "extension");
+        outbuf_write(&output, "}\n", 2);
+    }
+    else
+    {
+        char buf[96];
+        int len = snprintf(buf, sizeof buf,
+                           "%lu events in %.1f s (%.1f/s)\n",
+                           (unsigned long) total, seconds, total / seconds);
+
+        outbuf_write(&output, buf, len);
+        dirwatch_top_text(&top_dirs, "directories", seconds);
+        dirwatch_top_text(&top_exts, "extensions", seconds);
+        outbuf_write(&output, "\n", 1);
+    }
+
+    topk_reset(&top_dirs);
+    topk_reset(&top_exts);
+    top_started = now;
+}
+
+/* Log the given event into the output buffer, in the format chosen by the
+   user. The buffer is written to STDOUT once per batch of events. */
+static bool
+dirwatch_log_event(eventfmt_event_t *event)
+{
+    assert(event->name);
+
+    const event_label_t *label = dirwatch_event_label(event->mask);
+
+    if (label == NULL)
+        return false;
+
+    event->label = label->name;
+
+    if (batch.command != NULL)
+        batch_add(&batch, dirwatch_now(), event->dir, event->name);
+
+    if (config.top > 0)
+    {
+        dirwatch_top_add(event);
+        return true;
+    }
+
+    switch (config.format)
+    {
+        case FORMAT_JSONL:
+            eventfmt_jsonl(&output, event);
+            return true;
+
+        case FORMAT_BINARY:
+            eventfmt_binary(&output, event);
+            return true;
+
+        default:
+            break;
+    }
+
+    mask_t mask = event->mask;
+    const char *name = event->name;
+    const char *context_dir = event->dir;
+    size_t count = event->count;
+    size_t namelen = strlen(name);
+    size_t max_dirpath_len = fanwatch.max_dirpath_len;
+
+    for (size_t i = 0; i < shard_count; i++)
+        if (shards[i].watcher.dirmap.max_dirpath_len > max_dirpath_len)
+            max_dirpath_len = shards[i].watcher.dirmap.max_dirpath_len;
+
+    outbuf_write(&output, label->label, label->len);
+    outbuf_write(&output, " ", 1);
+    outbuf_write(&output, name, namelen);
+    outbuf_write(&output, mask & IN_ISDIR ? "/" : " ", 1);
+
+    if (namelen < max_dirpath_len + 3)
+        outbuf_fill(&output, ' ', max_dirpath_len + 3 - namelen);
+
+    if (context_dir != NULL)
+    {
+        outbuf_write(&output, context_dir, strlen(context_dir));
+        outbuf_write(&output, "/", 1);
+    }
+
+    if (count > 1)
+    {
+        char buf[32];
+        int len = snprintf(buf, sizeof buf, "  (%zu events)", count);
+
+        outbuf_write(&output, buf, len);
+    }
+
+    outbuf_write(&output, "\n", 1);
+
+    return true;
+}
+
+/* Handle a change event read by SHARD at TIME. */
+static void
+dirwatch_on_event(shard_t *shard, struct inotify_event *event, uint64_t time)
+{
+    watcher_t *watcher = &shard->watcher;
+
+    if (recorder.fd != -1)
+        recorder_event(&recorder, shard - shards, time, event);
+
+    if (event->mask & IN_Q_OVERFLOW)
+        LOG_DEBUG_1(config.verbosity, "%s\n",
+                    "Event queue overflowed, rescanning watched directories");
+
+    dirmap_entry_t *dir = event->wd > 0
+                              ? dirmap_find_by_wd(&watcher->dirmap, event->wd)
+                              : NULL;
+
+    /* Each root reports its own events. */
+    if (event->len && (event->mask & (dir != NULL ? dir->root->mask
+                                                  : config.mask)))
+        dirwatch_report(event->wd, event->mask, event->cookie, time,
+                        event->name,
+                        dir == NULL ? "[Nothing]" : watcher_path(watcher, dir));
+
+    /* When replaying, the recording adds the watches of the shards. */
+    if (shard_count > 1 && shard == &shards[0] && event->len > 0
+        && (event->mask & IN_ISDIR) && dir != NULL && dir->parent == NULL
+        && !watcher->offline)
+        dirwatch_on_top_level_event(dir, event);
+
+    watcher_handle_event(watcher, event);
+}
+
+/* Returns how long to wait for events, in milliseconds, before coalesced
+   events are due to be reported, or -1 to wait forever. */
 static int
-dirwatch_get_max_watches()
+dirwatch_coalesce_timeout(uint64_t now)
 {
-    FILE *fp = fopen(INOTIFY_MAX_USER_WATCHES_FILE, "r");
+    if (config.coalesce == 0)
+        return -1;
+
+    coalesce_expire(&coalesce, now);
+    return coalesce_timeout(&coalesce, now);
+}
+
+/* Arm the timer to expire in TIMEOUT milliseconds, or disarm it if TIMEOUT
+   is negative. */
+static void
+dirwatch_arm_timer(int timeout)
+{
+    struct itimerspec spec = { 0 };
+
+    if (timeout >= 0)
+    {
+        spec.it_value.tv_sec = timeout / 1000;
+        spec.it_value.tv_nsec = (long) (timeout % 1000) * 1000000;
+
+        /* A zero value would disarm the timer. */
+        if (timeout == 0)
+            spec.it_value.tv_nsec = 1;
+    }
+
+    if (timerfd_settime(timer_fd, 0, &spec, NULL) == -1)
+        print_error(true, true, "failed to arm timer");
+}
+
+/* Keep the read TIME of an event handled, until the output is written. */
+static void
+dirwatch_metrics_handled(uint64_t time)
+{
+    if (config.metrics != NULL && unwritten_count < DRAIN_MAX)
+        unwritten[unwritten_count++] = time;
+}
+
+/* Count how long the events handled since the last write of the output
+   waited for it, once it is written. */
+static void
+dirwatch_metrics_written()
+{
+    if (unwritten_count == 0)
+        return;
+
+    uint64_t now = dirwatch_now_ns();
+
+    for (size_t i = 0; i < unwritten_count; i++)
+        histogram_record(&latency, now - unwritten[i]);
+
+    unwritten_count = 0;
+}
+
+/* Write the metrics to FP, in the text format of Prometheus. The rate of
+   events is the one since MARK, which is then moved to now. */
+static void
+dirwatch_write_metrics(FILE *fp, metrics_mark_t *mark)
+{
+    static histogram_t read_sizes;
+    static const double quantiles[] = { 50, 90, 99, 99.9 };
+    uint64_t events = 0, dropped = 0, overflows = 0;
+    size_t queued = 0, highwater = 0, pending_max = 0;
+    long pending = 0, watches = 0;
+
+    histogram_init(&read_sizes);
+
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        reader_t *reader = &shards[i].reader;
+        int bytes = 0;
+
+        events += atomic_load(&reader->received);
+        dropped += atomic_load(&reader->dropped);
+        overflows += atomic_load(&reader->overflows);
+        queued += atomic_load(&reader->tail) - atomic_load(&reader->head);
+        highwater += atomic_load(&reader->highwater);
+        pending_max += atomic_load(&reader->pending_max);
+        histogram_merge(&read_sizes, &reader->read_sizes);
+        watches += shards[i].watcher.watchcount;
+
+        if (ioctl(shards[i].watcher.fd, FIONREAD, &bytes) == 0)
+            pending += bytes;
+    }
+
+    uint64_t now = dirwatch_now_ns();
+    double seconds = (now - mark->time) / 1e9;
+    uint64_t reads = atomic_load(&read_sizes.count);
+
+    fprintf(fp, "dirwatch_events_total %lu\n", (unsigned long) events);
+    fprintf(fp, "dirwatch_events_per_second %.1f\n",
+            seconds > 0 ? (events - mark->events) / seconds : 0.0);
+    fprintf(fp, "dirwatch_reads_total %lu\n", (unsigned long) reads);
+    fprintf(fp, "dirwatch_read_bytes_mean %.0f\n",
+            reads > 0 ? (double) atomic_load(&read_sizes.sum) / reads : 0.0);
+
+    for (size_t i = 0; i < sizeof quantiles / sizeof quantiles[0]; i++)
+        fprintf(fp, "dirwatch_read_bytes{quantile=\"%g\"} %lu\n",
+                quantiles[i] / 100,
+                (unsigned long) histogram_percentile(&read_sizes,
+                                                     quantiles[i]));
+
+    fprintf(fp, "dirwatch_read_bytes_max %lu\n",
+            (unsigned long) atomic_load(&read_sizes.max));
+    fprintf(fp, "dirwatch_kernel_queue_bytes %ld\n", pending);
+    fprintf(fp, "dirwatch_kernel_queue_bytes_max %zu\n", pending_max);
+    fprintf(fp, "dirwatch_kernel_overflows_total %lu\n",
+            (unsigned long) overflows);
+    fprintf(fp, "dirwatch_queue_events %zu\n", queued);
+    fprintf(fp, "dirwatch_queue_events_max %zu\n", highwater);
+    fprintf(fp, "dirwatch_queue_dropped_total %lu\n", (unsigned long) dropped);
+    fprintf(fp, "dirwatch_watches %ld\n", watches);
+    fprintf(fp, "dirwatch_watches_max %d\n",
+            shard_count > 0 ? shards[0].watcher.max_watches : 0);
+
+    uint64_t count = atomic_load(&latency.count);
+
+    for (size_t i = 0; i < sizeof quantiles / sizeof quantiles[0]; i++)
+        fprintf(fp, "dirwatch_latency_seconds{quantile=\"%g\"} %.6f\n",
+                quantiles[i] / 100,
+                histogram_percentile(&latency, quantiles[i]) / 1e9);
+
+    fprintf(fp, "dirwatch_latency_seconds_max %.6f\n",
+            atomic_load(&latency.max) / 1e9);
+    fprintf(fp, "dirwatch_latency_seconds_sum %.6f\n",
+            atomic_load(&latency.sum) / 1e9);
+    fprintf(fp, "dirwatch_latency_seconds_count %lu\n", (unsigned long) count);
+
+    mark->time = now;
+    mark->events = events;
+}
+
+/* Write the metrics to the file of --metrics. It is replaced at once, so
+   that it is never read half written. */
+static void
+dirwatch_save_metrics()
+{
+    char *tmppath = xmalloc(strlen(config.metrics) + 5);
+
+    sprintf(tmppath, "%s.tmp", config.metrics);
+
+    FILE *fp = fopen(tmppath, "we");
 
     if (fp == NULL)
-        return -1;
+    {
+        print_error(true, false, "%s: cannot write metrics", tmppath);
+        free(tmppath);
+        return;
+    }
 
-    int max_watches;
+    dirwatch_write_metrics(fp, &metrics_file_mark);
 
-    (void) fscanf(fp, "%d", &max_watches);
-    fclose(fp);
+    if (fclose(fp) != 0 || rename(tmppath, config.metrics) == -1)
+    {
+        print_error(true, false, "%s: cannot write metrics", config.metrics);
+        unlink(tmppath);
+    }
 
-    return max_watches;
+    free(tmppath);
 }
 
+/* Handle the events queued by the reader threads, up to DRAIN_MAX of them.
+   The queues of the shards are merged in the order the events were read.
+   Returns true if events are left for another pass. */
 static bool
-dirwatch_add_watches_recursive(char *dirpath)
+dirwatch_drain_inotify()
 {
-    assert(dirpath);
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        uint64_t batches;
+
+        if (read(shards[i].reader.notify_fd, &batches, sizeof batches) == -1
+            && errno != EAGAIN)
+            print_error(true, true, "read from eventfd failed");
+    }
+
+    bool left = false;
+
+    for (size_t handled = 0; !left; handled++)
+    {
+        shard_t *next = NULL;
+        reader_event_t *first = NULL;
+
+        for (size_t i = 0; i < shard_count; i++)
+        {
+            reader_event_t *event = reader_peek(&shards[i].reader);
+
+            if (event != NULL && (first == NULL || event->time < first->time))
+            {
+                next = &shards[i];
+                first = event;
+            }
+        }
+
+        if (next == NULL)
+            break;
+
+        if (handled == DRAIN_MAX)
+        {
+            left = true;
+            break;
+        }
+
+        dirwatch_on_event(next, &first->event, first->time);
+        dirwatch_metrics_handled(first->time);
+        reader_pop(&next->reader);
+    }
+
+    /* A reader that failed has stopped, and would never report another
+       event. Its last events were handled above. */
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        int error = atomic_load_explicit(&shards[i].reader.error,
+                                         memory_order_acquire);
+
+        if (error != 0)
+        {
+            errno = error;
+            print_error(true, true, "cannot read inotify events");
+        }
+    }
+
+    return left;
+}
+
+/* Read all the events queued on the fanotify file descriptor. */
+static void
+dirwatch_drain_fanotify()
+{
+    if (!fanwatch_process(&fanwatch, &dirwatch_on_fanotify_event))
+        print_error(true, true, "read from fanotify file descriptor failed");
+}
+
+/* Handle a signal received through the signalfd. Returns false if the
+   program should stop. */
+static bool
+dirwatch_on_signal()
+{
+    struct signalfd_siginfo info;
+
+    if (read(signal_fd, &info, sizeof info) != sizeof info)
+        return true;
+
+    switch (info.ssi_signo)
+    {
+        case SIGINT:
+            outbuf_flush(&output);
+
+            if (config.format == FORMAT_TEXT)
+                puts("SIGINT received. Exiting.");
+
+            return false;
+
+        case SIGTERM:
+            return false;
+
+        case SIGCHLD:
+            if (batch.command != NULL)
+                batch_reap(&batch);
+
+            return true;
+
+        case SIGUSR1:
+            dirwatch_write_metrics(stderr, &metrics_signal_mark);
+            return true;
+
+        default:
+            return true;
+    }
+}
+
+/* Add FD to the epoll instance. */
+static void
+dirwatch_epoll_add(int fd)
+{
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1)
+        print_error(true, true, "epoll_ctl failed");
+}
+
+/* Run the event loop until a signal stops it. The loop waits on the event
+   source, the signalfd and a timer, which is armed before every wait for
+   the next timed work: expiring coalesced events and pending moves. */
+static void
+dirwatch_watch()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+
+    if (epoll_fd == -1 || timer_fd == -1)
+        print_error(true, true, "cannot set up the event loop");
+
+    if (config.backend == BACKEND_FANOTIFY)
+        dirwatch_epoll_add(fanwatch.fd);
 
-    DIR *dir = opendir(dirpath);
+    for (size_t i = 0; i < shard_count; i++)
+        dirwatch_epoll_add(shards[i].reader.notify_fd);
 
-    if (dir == NULL)
-        return false;
+    dirwatch_epoll_add(timer_fd);
+    dirwatch_epoll_add(signal_fd);
 
-    struct dirent *entry;
+    uint64_t start = dirwatch_now();
+    uint64_t next_poll = start + config.poll_interval;
+    uint64_t next_report = top_started + config.top_interval * 1000;
+    uint64_t next_checkpoint = start + config.checkpoint * 1000;
+    uint64_t next_metrics = start + config.metrics_interval * 1000;
+    bool running = true;
+    bool backlog = false; /* Events are waiting in the queues of the
+                             readers. */
 
-    while ((entry = readdir(dir)) != NULL)
+    metrics_file_mark.time = metrics_signal_mark.time = dirwatch_now_ns();
+
+    while (running)
     {
-        if (config.watchcount >= config.max_watches)
-        {
-            closedir(dir);
-            errno = ENOBUFS; /* Set error in case if the max limit was
-                                reached. */
-            return false;
-        }
+        uint64_t now = dirwatch_now();
+        int timeout = dirwatch_coalesce_timeout(now);
 
-        if (STREQ(entry->d_name, ".") || STREQ(entry->d_name, ".."))
-            continue;
+        if (batch.command != NULL)
+        {
+            int batch_timeout_ms = batch_timeout(&batch, now);
 
-        if (entry->d_name[0] == '.')
-            continue;
+            if (batch_timeout_ms >= 0
+                && (timeout < 0 || batch_timeout_ms < timeout))
+                timeout = batch_timeout_ms;
+        }
 
-        if (entry->d_type == DT_DIR)
+        /* The watched tree is saved at a fixed interval. */
+        if (state_ready)
         {
-            size_t len = strlen(dirpath) + strlen(entry->d_name) + 1;
-            char *newpath = malloc(len);
-
-            if (newpath == NULL)
+            if (now >= next_checkpoint)
             {
-                closedir(dir);
-                return false;
+                dirwatch_save_state();
+                next_checkpoint = now + config.checkpoint * 1000;
             }
 
-            strcpy(newpath, dirpath);
-            strcat(newpath, "/");
-            strcat(newpath, entry->d_name);
-
-            LOG_DEBUG_2(config.verbosity,
-                        "Attempting to watch directory: %s\n", newpath);
-
-            int wd = inotify_add_watch(config.fd, newpath, config.mask);
+            if (timeout < 0 || next_checkpoint - now < (uint64_t) timeout)
+                timeout = next_checkpoint - now;
+        }
 
-            if (wd == -1)
+        /* The metrics are written at a fixed interval. */
+        if (config.metrics != NULL)
+        {
+            if (now >= next_metrics)
             {
-                LOG_DEBUG_1(config.verbosity,
-                            "Failed to watch directory: %s\n", newpath);
-                free(newpath);
-                closedir(dir);
-                return false;
+                dirwatch_save_metrics();
+                next_metrics = now + config.metrics_interval * 1000;
             }
 
-            if (!dirmap_add(&dirmap, newpath, wd))
+            if (timeout < 0 || next_metrics - now < (uint64_t) timeout)
+                timeout = next_metrics - now;
+        }
+
+        /* Directories over the budget are polled instead of watched. */
+        if (config.budget > 0)
+        {
+            if (now >= next_poll)
             {
-                LOG_DEBUG_1(config.verbosity,
-                            "Failed to add watched directory to map: %s\n",
-                            newpath);
-                free(newpath);
-                closedir(dir);
-                return false;
+                for (size_t i = 0; i < shard_count; i++)
+                    watcher_poll(&shards[i].watcher);
+
+                next_poll = now + config.poll_interval;
             }
 
-            LOG_DEBUG_1(config.verbosity, "Watching directory: %s\n", newpath);
+            if (timeout < 0 || next_poll - now < (uint64_t) timeout)
+                timeout = next_poll - now;
+        }
 
-            if (!dirwatch_add_watches_recursive(newpath))
+        /* The rankings are written at a fixed interval. */
+        if (config.top > 0)
+        {
+            if (now >= next_report)
             {
-                LOG_DEBUG_1(config.verbosity, "Recursive watch failed: %s\n",
-                            newpath);
-                free(newpath);
-                closedir(dir);
-                return false;
+                dirwatch_top_report(now);
+                next_report = now + config.top_interval * 1000;
             }
 
-            free(newpath);
-            config.watchcount++;
+            if (timeout < 0 || next_report - now < (uint64_t) timeout)
+                timeout = next_report - now;
         }
-    }
-
-    closedir(dir);
-    return true;
-}
 
-/* Initializes the program and its resources. */
-static void
-dirwatch_init(char *dirpath)
-{
-    dirwatch_set_signal_handlers();
+        for (size_t i = 0; i < shard_count; i++)
+        {
+            int tick = watcher_tick(&shards[i].watcher, now);
 
-    config.watchcount = 0;
-    config.dirpath = dirpath;
+            if (tick >= 0 && (timeout < 0 || tick < timeout))
+                timeout = tick;
+        }
 
-    int max = dirwatch_get_max_watches();
+        /* Events left by the last pass are handled once the timers and
+           signals due meanwhile were. */
+        if (backlog)
+            timeout = 0;
 
-    if (max == -1)
-        print_error(true, true, "failed to get max watch count");
+        if (!outbuf_flush(&output))
+            print_error(true, true, "write to standard output failed");
 
-    config.max_watches = max;
-    config.fd = inotify_init();
+        dirwatch_metrics_written();
+        dirwatch_arm_timer(timeout);
 
-    if (config.fd == -1)
-        print_error(true, true, "cannot initialize inotify");
+        struct epoll_event events[4];
+        int count = epoll_wait(epoll_fd, events, 4, -1);
 
-    LOG_DEBUG_2(config.verbosity, "Attempting to watch directory: %s\n",
-                config.dirpath);
+        if (count == -1)
+        {
+            if (errno == EINTR)
+                continue;
 
-    /* Watch for changes in this directory. Only notify for the given events
-        in the mask parameter. */
-    config.wd = inotify_add_watch(config.fd, config.dirpath, config.mask);
+            print_error(true, true, "epoll_wait failed");
+        }
 
-    if (config.wd == -1)
-        print_error(true, true, "%s: cannot watch directory", config.dirpath);
+        for (int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
 
-    LOG_DEBUG_1(config.verbosity, "Watching directory: %s\n", config.dirpath);
+            if (fd == signal_fd)
+                running = dirwatch_on_signal() && running;
+            else if (fd == timer_fd)
+            {
+                uint64_t expirations;
 
-    if (config.recursive)
-    {
-        if (!dirmap_add(&dirmap, config.dirpath, config.wd))
-            print_error(true, true, "%s: cannot add watched directory to map",
-                        config.dirpath);
+                while (read(timer_fd, &expirations, sizeof expirations) > 0)
+                    ;
+            }
+            else if (config.backend == BACKEND_FANOTIFY)
+                dirwatch_drain_fanotify();
+            else
+                backlog = true;
+        }
 
-        if (!dirwatch_add_watches_recursive(config.dirpath))
-            print_error(true, true, "%s: cannot recursively watch directory",
-                        config.dirpath);
+        /* The queues of all the shards are drained together, once. */
+        if (backlog)
+            backlog = dirwatch_drain_inotify();
     }
-
-    atexit(&dirwatch_cleanup);
 }
 
-/* Cleans up the dynamically allocated string returned by
-   dirwatch_event_info(). */
-static bool
-dirwatch_free_event_info(event_info_t *info)
+/* Feed the events of the recording of --replay through the same path as
+   live ones, and report how fast they went. The tree of watches is
+   rebuilt from the recording, and the filesystem is not read. */
+static void
+dirwatch_replay()
 {
-    if (info->eventstr != NULL)
-        free(info->eventstr);
-}
+    replay_t replay;
 
-/* Determine the event string representation for outputting into STDOUT.
-   The string is dynamically allocated using strdup(), so it should be
-   freed when done working with it. */
-static bool
-dirwatch_event_info(event_info_t *info, mask_t mask)
-{
-    char *string = NULL;
-    size_t len = 10;
+    if (!replay_open(&replay, config.replay))
+        print_error(true, true, "%s: cannot read recording", config.replay);
 
-    if (mask & IN_CREATE)
-    {
-        string = "CREATE    ";
-        info->colorcode = 32;
-    }
-    else if (mask & IN_DELETE)
-    {
-        string = "DELETE    ";
-        info->colorcode = 31;
-    }
-    else if (mask & IN_ACCESS)
-    {
-        string = "READ      ";
-        info->colorcode = 34;
-    }
-    else if (mask & IN_MODIFY)
-    {
-        string = "MODIFIED  ";
-        info->colorcode = 33;
-    }
-    else if (mask & IN_ATTRIB)
-    {
-        string = "ATTRCHANGE";
-        info->colorcode = 33;
-    }
-    else if (mask & IN_OPEN)
-    {
-        string = "OPENED    ";
-        info->colorcode = 34;
-    }
-    else if (mask & IN_CLOSE)
-    {
-        string = "CLOSED    ";
-        info->colorcode = 34;
-    }
-    else if (mask & IN_MOVED_TO)
-    {
-        string = "MOVEDTO   ";
-        info->colorcode = 33;
-    }
-    else if (mask & IN_MOVED_FROM)
-    {
-        string = "MOVEDFROM ";
-        info->colorcode = 33;
-    }
-    else if (mask & IN_MOVE_SELF)
-    {
-        string = "MOVEDSELF ";
-        info->colorcode = 33;
-    }
-    else if (mask & IN_MOVE)
-    {
-        string = "MOVED     ";
-        info->colorcode = 33;
-    }
-    else if (mask & IN_DELETE_SELF)
-    {
-        string = "DELSELF   ";
-        info->colorcode = 31;
-    }
-    else if (mask & IN_CLOSE_WRITE)
-    {
-        string = "CWRITE    ";
-        info->colorcode = 32;
-    }
-    else if (mask & IN_CLOSE_NOWRITE)
-    {
-        string = "NCWRITE   ";
-        info->colorcode = 31;
-    }
-    else
-        return false;
+    dirwatch_init_output();
 
-    assert(strlen(string) == len);
-    info->eventstr = strdup(string);
+    config.recursive = replay.header->recursive;
+    shard_count = replay.header->shards;
+    shards = xmalloc(sizeof(shard_t) * shard_count);
 
-    return true;
-}
+    for (size_t i = 0; i < shard_count; i++)
+    {
+        shards[i].reader.slots = NULL;
 
-/* Log the given event into STDOUT. */
-static bool
-dirwatch_log_event(mask_t mask, char *name, char *context_dir)
-{
-    assert(name);
+        if (!watcher_init(&shards[i].watcher, config.mask, config.recursive))
+            print_error(true, true, "cannot initialize inotify");
 
-    event_info_t info = { 0 };
+        shards[i].watcher.verbosity = config.verbosity;
+        shards[i].watcher.offline = true;
+    }
 
-    if (!dirwatch_event_info(&info, mask))
-        return false;
+    const record_t *record;
+    uint64_t start = dirwatch_now_ns();
+    uint64_t first = 0;
+    unsigned long events = 0;
 
-    fprintf(stdout, COLOR("1;%d", "%s") " %s%s", info.colorcode, info.eventstr,
-            name, mask & IN_ISDIR ? "/" : " ");
+    while ((record = replay_next(&replay)) != NULL)
+    {
+        shard_t *shard = &shards[record->shard];
 
-    int spaces = (dirmap.max_dirpath_len - strlen(name)) + 3;
+        if (first == 0)
+            first = record->time;
 
-    for (int i = 0; i < spaces; i++)
-        putchar(' ');
+        replay_time = record->time;
 
-    fprintf(stdout, "%s%s\n", context_dir != NULL ? context_dir : "",
-            context_dir != NULL ? "/" : "");
+        /* At the recorded speed, wait until the record is due. */
+        if (config.replay_recorded && record->time > first)
+        {
+            uint64_t due = start + (record->time - first);
+            struct timespec ts = {
+                .tv_sec = due / 1000000000,
+                .tv_nsec = due % 1000000000,
+            };
+
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+                   == EINTR)
+                ;
+        }
 
-    dirwatch_free_event_info(&info);
+        if (record->type == RECORD_WATCH)
+        {
+            const record_watch_t *watch = (const void *) (record + 1);
+            const char *name = (const char *) (watch + 1);
 
-    return true;
-}
+            if (watcher_add_recorded(&shard->watcher, watch->parent_wd, name,
+                                     watch->wd, watch->mask)
+                == NULL)
+                print_error(true, false, "%s: cannot add recorded watch",
+                            name);
 
-/* Handle a change event in the given directory. */
-static void
-dirwatch_on_event(struct inotify_event *event)
-{
-    if (event->len)
-    {
-        dirmap_entry_t *entry = dirmap_find_by_wd(&dirmap, event->wd);
+            continue;
+        }
 
-        if (!dirwatch_log_event(event->mask, event->name,
-                                entry == NULL ? "[Nothing]" : entry->dirpath))
-            print_error(true, true, "unknown event in mask");
-    }
-}
+        if (record->type == RECORD_SYNTHESIZED)
+        {
+            const record_synthesized_t *synthesized
+                = (const void *) (record + 1);
+            const char *dirpath = (const char *) (synthesized + 1);
 
-/* Run an infinite loop to watch for the events in the given directory. */
-static void
-dirwatch_watch()
-{
-    while (true)
-    {
-        char buffer[EVENT_BUF_LEN];
-        int length = read(config.fd, buffer, EVENT_BUF_LEN);
+            dirwatch_on_synthesized(&shard->watcher, synthesized->mask,
+                                    synthesized->wd, dirpath,
+                                    dirpath + synthesized->dirlen + 1);
+            continue;
+        }
 
-        if (length == -1)
-            print_error(true, true,
-                        "read from inotify file descriptor failed");
+        if (record->type != RECORD_EVENT)
+            continue;
 
-        for (int i = 0; i < length;)
+        /* Moves are paired in recorded time, as they were live. */
+        for (size_t i = 0; i < shard_count; i++)
         {
-            struct inotify_event *event = (struct inotify_event *) &buffer[i];
-            dirwatch_on_event(event);
-            i += EVENT_SIZE + event->len;
+            shards[i].watcher.now = record->time / 1000000;
+            watcher_tick(&shards[i].watcher, shards[i].watcher.now);
         }
+
+        dirwatch_coalesce_timeout(record->time / 1000000);
+        dirwatch_on_event(shard, (struct inotify_event *) (record + 1),
+                          record->time);
+        events++;
     }
+
+    if (errno == EINVAL)
+        print_error(false, false, "%s: recording is truncated", config.replay);
+
+    replay_close(&replay);
+
+    if (config.coalesce > 0)
+        coalesce_flush(&coalesce);
+
+    if (!outbuf_flush(&output))
+        print_error(true, true, "write to standard output failed");
+
+    double elapsed = (dirwatch_now_ns() - start) / 1e9;
+
+    fprintf(stderr, "Replayed %lu events in %.3f s (%.0f events per second)\n",
+            events, elapsed, events / (elapsed > 0 ? elapsed : 1e-9));
 }
 
 /* Prints the usage of the program. If _exit is true, then it calls
@@ -424,11 +1768,27 @@ dirwatch_watch()
 static void
 usage(bool _exit)
 {
-    fprintf(stdout, "Usage: %s [OPTIONS]... [DIRECTORY]\n\
-Watches for changes in DIRECTORY. If no DIRECTORY is specified, it will watch \
-the current directory.\n\
+    fprintf(stdout, "Usage: %s [OPTIONS]... [DIRECTORY]...\n\
+Watches for changes in each DIRECTORY, on a single inotify instance. If no \
+DIRECTORY is specified, it will watch the current directory.\n\
 \n\
 Options:\n\
+      --backend=BACKEND        Read events from BACKEND, which is `inotify'\n\
+                                (default) or `fanotify'. The fanotify backend\n\
+                                watches the whole filesystem with a single mark,\n\
+                                so it has no watch limit and no setup cost, but\n\
+                                needs root privileges.\n\
+      --batch=MS[,COUNT]       With --exec, collect paths for MS milliseconds\n\
+                                after the first one (default: 100), or until\n\
+                                there are COUNT of them, before running COMMAND.\n\
+      --budget=N               With -r, use at most N watches. Past N, a new\n\
+                                directory takes the watches of the least recently\n\
+                                active subtree, which is polled from then on.\n\
+      --checkpoint=SECS        With --state, save the watched tree every SECS\n\
+                                seconds (default: 60).\n\
+      --coalesce=MS            Merge repeated events for the same file within\n\
+                                MS milliseconds into one, and report how many\n\
+                                were merged.\n\
   -e, --events=[EVENTS]...     Specify which events dirwatch should log.\n\
                                 Valid events are (Event name - long specifier, short specifier):\n\n\
                                 ALL EVENTS - all, 1\n\
@@ -447,9 +1807,80 @@ Options:\n\
                                 DELSELF    - delself, s\n\
                                 MVSELF     - mvself, e\n\n\
                                 Multiple events can be seperated by commas (,).\n\
+      --exclude=PATTERN        With -r, do not watch directories matching\n\
+                                PATTERN. Patterns with a slash are matched\n\
+                                against the path relative to DIRECTORY, and the\n\
+                                others against the name of the directory.\n\
+      --exclude-from=FILE      Read exclusion patterns from FILE, one per line.\n\
+      --exec=COMMAND           Run COMMAND with `/bin/sh -c' on batches of the\n\
+                                paths of the events, passed on its standard input\n\
+                                separated by NUL characters. Paths are passed\n\
+                                once per batch.\n\
+      --format=FORMAT          Write the events as FORMAT: `text' (default),\n\
+                                `jsonl' for a JSON object per line, or `binary'\n\
+                                for records with a fixed header. Both carry the\n\
+                                full path, raw mask, cookie, wd and a monotonic\n\
+                                timestamp in nanoseconds. In jsonl, the bytes of\n\
+                                paths that are not valid UTF-8 are escaped, and\n\
+                                also given in hexadecimal in `path_hex'.\n\
   -h, --help                   Show this help and exit.\n\
+      --hidden                 With -r, also watch directories whose name\n\
+                                starts with a dot, which are excluded by default.\n\
+      --interval=SECS          With --top, write the rankings every SECS seconds\n\
+                                (default: 10).\n\
+  -j, --jobs=N                 With -r, crawl the tree on N threads to set up\n\
+                                the watches (default: one per CPU). Events that\n\
+                                arrive meanwhile are queued and reported after.\n\
+      --max-exec=K             Run at most K commands at once (default: 1).\n\
+                                Paths of the events that arrive meanwhile are\n\
+                                collected for the next run.\n\
+      --metrics=FILE           Write internal metrics to FILE every interval:\n\
+                                events read per second, bytes per read, bytes\n\
+                                waiting in the kernel queue, overflows, watches\n\
+                                used, and the latency from read to write. They\n\
+                                are also written to the standard error on\n\
+                                SIGUSR1, with the latency only measured with\n\
+                                --metrics.\n\
+      --metrics-interval=SECS  With --metrics, write them every SECS seconds\n\
+                                (default: 10).\n\
+      --poll-interval=MS       Poll the directories over the budget every MS\n\
+                                milliseconds (default: 2000).\n\
+      --queue-size=N           Queue up to N events read from the kernel while\n\
+                                they wait to be written (default: 16384).\n\
+      --record=FILE            Record the inotify events to FILE, with the time\n\
+                                they were read and the watches they refer to,\n\
+                                for --replay.\n\
   -r, --recursive              Set watchers recursively to all directories and subdirectories under\n\
                                 the given DIRECTORY.\n\
+      --replay=FILE            Instead of watching directories, feed the events\n\
+                                recorded in FILE through the same steps as live\n\
+                                ones, and report how many were handled per\n\
+                                second on the standard error.\n\
+      --replay-speed=SPEED     Replay at SPEED: `max' (default) for as fast as\n\
+                                possible, or `recorded' for the pace they were\n\
+                                recorded at.\n\
+      --root=EVENTS:DIR        Watch DIR as well, for EVENTS instead of the\n\
+                                events of -e, in the same syntax.\n\
+      --shards=N               With -r, spread the watches over N inotify\n\
+                                instances, by directory directly below DIRECTORY.\n\
+                                Each one has its own kernel queue and reader\n\
+                                thread, and their events are merged in order.\n\
+      --snapshot-stats         Also record the modification time and size of\n\
+                                every file, so that files modified while events\n\
+                                were lost, or before startup with --state, are\n\
+                                reported as MODIFY. Every file is stat'ed when\n\
+                                its directory is watched, which makes the setup\n\
+                                of large trees slower.\n\
+      --state=FILE             Save the watched tree to FILE on exit and at every\n\
+                                checkpoint. On startup, report what changed\n\
+                                since FILE was saved before any live event.\n\
+                                Directories are matched by path, so the same\n\
+                                DIRECTORY arguments must be given.\n\
+      --top=N                  Instead of logging the events, write the N\n\
+                                directories and the N file extensions with the\n\
+                                most events every interval, with their rates.\n\
+                                Counts are estimated in fixed memory, however\n\
+                                many paths change, and may be slightly high.\n\
   -v, --version                Show the version of this program.\n\
   -V, --verbose=[LEVEL]        Enable verbose mode. LEVEL 1-3 are valid.\n\
                                 If no LEVEL is specified, LEVEL 1 gets enabled.\n\
@@ -533,6 +1964,54 @@ dirwatch_parse_event_mask(char *input)
     return mask;
 }
 
+/* Add the directory at PATH to the roots, reporting the events in MASK. */
+static void
+dirwatch_add_root(char *path, mask_t mask)
+{
+    config.roots
+        = xrealloc(config.roots, sizeof(root_t) * (config.rootcount + 1));
+    config.roots[config.rootcount++] = (root_t){
+        .path = path,
+        .mask = mask,
+    };
+}
+
+/* Exit if a root is inside another one, or is the same directory, since a
+   directory can only be in one tree. */
+static void
+dirwatch_check_roots()
+{
+    char **real = xmalloc(sizeof(char *) * config.rootcount);
+
+    for (size_t i = 0; i < config.rootcount; i++)
+    {
+        real[i] = realpath(config.roots[i].path, NULL);
+
+        if (real[i] == NULL)
+            print_error(true, true, "%s: cannot watch directory",
+                        config.roots[i].path);
+    }
+
+    for (size_t i = 0; i < config.rootcount; i++)
+    {
+        for (size_t j = 0; j < config.rootcount; j++)
+        {
+            size_t len = strlen(real[i]);
+
+            if (i != j && strncmp(real[i], real[j], len) == 0
+                && (real[j][len] == '\0' || real[j][len] == '/'
+                    || real[i][len - 1] == '/'))
+                print_error(false, true, "%s: inside the watched directory %s",
+                            config.roots[j].path, config.roots[i].path);
+        }
+    }
+
+    for (size_t i = 0; i < config.rootcount; i++)
+        free(real[i]);
+
+    free(real);
+}
+
 /* Start of the program and argument parsing. */
 int
 main(int argc, char **argv)
@@ -541,11 +2020,36 @@ main(int argc, char **argv)
 
     config.mask = IN_DEFAULT; /* Default mask. */
     config.recursive = false;
+    config.backend = BACKEND_INOTIFY;
+    config.format = FORMAT_TEXT;
+    config.exec = NULL;
+    config.batch_window = BATCH_WINDOW;
+    config.batch_count = 0;
+    config.max_exec = 1;
+    config.queue_size = READER_CAPACITY;
+    config.shards = 1;
+    config.jobs = 0;
+    config.hidden = false;
+    config.snapshot_stats = false;
+    config.budget = 0;
+    config.poll_interval = WATCHER_POLL_INTERVAL;
+    config.top = 0;
+    config.top_interval = TOP_INTERVAL;
+    config.roots = NULL;
+    config.rootcount = 0;
+    config.state = NULL;
+    config.checkpoint = CHECKPOINT_INTERVAL;
+    config.record = NULL;
+    config.replay = NULL;
+    config.replay_recorded = false;
+    config.metrics = NULL;
+    config.metrics_interval = METRICS_INTERVAL;
+    exclude_init(&exclude);
 
     while (true)
     {
         int option_index;
-        int c = getopt_long(argc, argv, "hve:Vr", long_options, &option_index);
+        int c = getopt_long(argc, argv, "hve:j:Vr", long_options, &option_index);
 
         if (c == -1)
             break;
@@ -590,6 +2094,267 @@ main(int argc, char **argv)
                 config.recursive = true;
                 break;
 
+            case OPT_BACKEND:
+                if (STREQ(optarg, "inotify"))
+                    config.backend = BACKEND_INOTIFY;
+                else if (STREQ(optarg, "fanotify"))
+                    config.backend = BACKEND_FANOTIFY;
+                else
+                    print_error(false, true,
+                                "invalid backend `%s'.\nRun `%s --help' "
+                                "for more detailed information.",
+                                optarg, PROGRAM_NAME);
+                break;
+
+            case 'j':
+                config.jobs = atoi(optarg);
+
+                if (config.jobs < 1)
+                    print_error(false, true,
+                                "invalid number of jobs `%s'", optarg);
+                break;
+
+            case OPT_EXEC:
+                config.exec = optarg;
+                break;
+
+            case OPT_BATCH:
+            {
+                char *end;
+
+                errno = 0;
+                config.batch_window = strtoul(optarg, &end, 10);
+
+                if (errno == 0 && *end == ',' && end > optarg)
+                {
+                    char *count = end + 1;
+
+                    config.batch_count = strtoul(count, &end, 10);
+
+                    if (end == count || config.batch_count == 0)
+                        errno = EINVAL;
+                }
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.batch_window > INT_MAX)
+                    print_error(false, true, "invalid batch `%s'", optarg);
+            }
+            break;
+
+            case OPT_MAX_EXEC:
+                config.max_exec = atoi(optarg);
+
+                if (config.max_exec < 1)
+                    print_error(false, true,
+                                "invalid number of commands `%s'", optarg);
+                break;
+
+            case OPT_FORMAT:
+                if (STREQ(optarg, "text"))
+                    config.format = FORMAT_TEXT;
+                else if (STREQ(optarg, "jsonl"))
+                    config.format = FORMAT_JSONL;
+                else if (STREQ(optarg, "binary"))
+                    config.format = FORMAT_BINARY;
+                else
+                    print_error(false, true,
+                                "invalid format `%s'.\nRun `%s --help' "
+                                "for more detailed information.",
+                                optarg, PROGRAM_NAME);
+                break;
+
+            case OPT_EXCLUDE:
+                exclude_add(&exclude, optarg);
+                break;
+
+            case OPT_EXCLUDE_FROM:
+                if (!exclude_add_file(&exclude, optarg))
+                    print_error(true, true, "%s: cannot read patterns", optarg);
+                break;
+
+            case OPT_HIDDEN:
+                config.hidden = true;
+                break;
+
+            case OPT_SNAPSHOT_STATS:
+                config.snapshot_stats = true;
+                break;
+
+            case OPT_BUDGET:
+            {
+                char *end;
+
+                errno = 0;
+                config.budget = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.budget == 0 || config.budget > INT_MAX)
+                    print_error(false, true, "invalid watch budget `%s'",
+                                optarg);
+            }
+            break;
+
+            case OPT_POLL_INTERVAL:
+            {
+                char *end;
+
+                errno = 0;
+                config.poll_interval = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.poll_interval == 0
+                    || config.poll_interval > INT_MAX)
+                    print_error(false, true, "invalid poll interval `%s'",
+                                optarg);
+            }
+            break;
+
+            case OPT_ROOT:
+            {
+                char *dir = strchr(optarg, ':');
+                mask_t mask = 0;
+
+                if (dir != NULL)
+                {
+                    *dir++ = '\0';
+                    mask = dirwatch_parse_event_mask(optarg);
+                }
+
+                if (mask == 0 || *dir == '\0')
+                    print_error(false, true,
+                                "invalid root `%s'; expected EVENTS:DIRECTORY",
+                                optarg);
+
+                dirwatch_add_root(dir, mask);
+            }
+            break;
+
+            case OPT_RECORD:
+                config.record = optarg;
+                break;
+
+            case OPT_REPLAY:
+                config.replay = optarg;
+                break;
+
+            case OPT_REPLAY_SPEED:
+                if (STREQ(optarg, "max"))
+                    config.replay_recorded = false;
+                else if (STREQ(optarg, "recorded"))
+                    config.replay_recorded = true;
+                else
+                    print_error(false, true, "invalid replay speed `%s'",
+                                optarg);
+                break;
+
+            case OPT_STATE:
+                config.state = optarg;
+                break;
+
+            case OPT_CHECKPOINT:
+            {
+                char *end;
+
+                errno = 0;
+                config.checkpoint = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.checkpoint == 0
+                    || config.checkpoint > INT_MAX / 1000)
+                    print_error(false, true, "invalid checkpoint interval `%s'",
+                                optarg);
+            }
+            break;
+
+            case OPT_METRICS:
+                config.metrics = optarg;
+                break;
+
+            case OPT_METRICS_INTERVAL:
+            {
+                char *end;
+
+                errno = 0;
+                config.metrics_interval = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.metrics_interval == 0
+                    || config.metrics_interval > INT_MAX / 1000)
+                    print_error(false, true, "invalid metrics interval `%s'",
+                                optarg);
+            }
+            break;
+
+            case OPT_TOP:
+            {
+                char *end;
+
+                errno = 0;
+                config.top = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.top == 0 || config.top > 10000)
+                    print_error(false, true, "invalid rank count `%s'",
+                                optarg);
+            }
+            break;
+
+            case OPT_INTERVAL:
+            {
+                char *end;
+
+                errno = 0;
+                config.top_interval = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.top_interval == 0
+                    || config.top_interval > INT_MAX / 1000)
+                    print_error(false, true, "invalid interval `%s'", optarg);
+            }
+            break;
+
+            case OPT_SHARDS:
+            {
+                char *end;
+
+                errno = 0;
+                config.shards = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.shards == 0 || config.shards > 64)
+                    print_error(false, true,
+                                "invalid number of shards `%s'", optarg);
+            }
+            break;
+
+            case OPT_QUEUE_SIZE:
+            {
+                char *end;
+
+                errno = 0;
+                config.queue_size = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.queue_size == 0)
+                    print_error(false, true, "invalid queue size `%s'",
+                                optarg);
+            }
+            break;
+
+            case OPT_COALESCE:
+            {
+                char *end;
+
+                errno = 0;
+                config.coalesce = strtoul(optarg, &end, 10);
+
+                if (errno != 0 || *end != '\0' || end == optarg
+                    || config.coalesce == 0)
+                    print_error(false, true,
+                                "invalid coalescing window `%s'", optarg);
+            }
+            break;
+
             case '?':
                 fprintf(stderr,
                         "Run `%s --help' for more detailed information.\n",
@@ -602,15 +2367,47 @@ main(int argc, char **argv)
         }
     }
 
-    char *dirpath = ".";
-
     for (int i = optind; i < argc; i++)
+        dirwatch_add_root(argv[i], config.mask);
+
+    if (config.rootcount == 0 && config.replay == NULL)
+        dirwatch_add_root(".", config.mask);
+
+    if (config.state != NULL && config.backend == BACKEND_FANOTIFY)
+        print_error(false, true,
+                    "--state needs the tree of watches of the inotify backend");
+
+    if (config.rootcount > 1 && config.backend == BACKEND_FANOTIFY)
+        print_error(false, true,
+                    "the fanotify backend watches a single directory");
+
+    dirwatch_check_roots();
+
+    if (!config.hidden)
+        exclude_add(&exclude, ".*");
+
+    if (config.top > 0 && config.format == FORMAT_BINARY)
+        print_error(false, true, "--top cannot be used with --format=binary");
+
+    if (config.replay != NULL)
     {
-        dirpath = argv[i];
-        break;
+        if (config.record != NULL || config.state != NULL
+            || config.exec != NULL || config.metrics != NULL)
+            print_error(false, true,
+                        "--replay cannot be used with --record, --state, "
+                        "--exec or --metrics");
+
+        dirwatch_replay();
+        return 0;
     }
 
-    dirwatch_init(dirpath);
+    if (config.record != NULL && config.backend == BACKEND_FANOTIFY)
+        print_error(false, true, "--record needs the inotify backend");
+
+    if (config.metrics != NULL && config.backend == BACKEND_FANOTIFY)
+        print_error(false, true, "--metrics needs the inotify backend");
+
+    dirwatch_init();
     dirwatch_watch();
 
     return 0;
@@ -0,0 +1,557 @@
+/*
+    dupfind.c -- find files with identical contents.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Duplicates are found in three stages, each of which only looks at the
+   files that are still in a group of two or more after the previous one:
+
+   1. Files are grouped by size. Files with a unique size are never opened.
+   2. Files are grouped by a hash of their first and last DUPFIND_EDGE_SIZE
+      bytes, which tells most same-sized files apart with two small reads.
+   3. Files are grouped by a hash of their full contents.
+   4. The files of every group are compared byte for byte, so that a hash
+      collision never makes distinct files look identical.
+
+   Hard links to the same file are not duplicates of each other: only the
+   first of their paths is considered. The hashing and comparison stages
+   run on a pool of worker threads. */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dupfind.h"
+#include "hash.h"
+#include "utils.h"
+
+#define DUPFIND_EDGE_SIZE 4096
+#define DUPFIND_READ_SIZE (1024 * 1024)
+
+typedef enum
+{
+    DUPFIND_STAGE_EDGES,
+    DUPFIND_STAGE_FULL,
+    DUPFIND_STAGE_COMPARE
+} dupfind_stage_t;
+
+/* Work shared by the threads of one stage. The hashing stages take the
+   files one by one, the comparison stage takes whole groups, the files of
+   group I being INDICES[STARTS[I]] to INDICES[STARTS[I + 1] - 1]. */
+typedef struct
+{
+    dupfind_t *dupfind;
+    size_t *indices;
+    size_t *starts;
+    size_t count;
+    size_t next;
+    dupfind_stage_t stage;
+} dupfind_work_t;
+
+void
+dupfind_init(dupfind_t *dupfind)
+{
+    dupfind->files = NULL;
+    dupfind->count = 0;
+    dupfind->capacity = 0;
+}
+
+void
+dupfind_add(dupfind_t *dupfind, const char *path, off_t size, dev_t dev,
+            ino_t ino)
+{
+    assert(path);
+
+    if (dupfind->count == dupfind->capacity)
+    {
+        dupfind->capacity = dupfind->capacity == 0 ? 256 : dupfind->capacity * 2;
+        dupfind->files = xrealloc(dupfind->files,
+                                  sizeof(dupfind_file_t) * dupfind->capacity);
+    }
+
+    dupfind->files[dupfind->count++] = (dupfind_file_t){
+        .path = strdup(path),
+        .size = size,
+        .dev = dev,
+        .ino = ino,
+        .hash = 0,
+        .group = 0,
+        .failed = false,
+    };
+}
+
+void
+dupfind_free(dupfind_t *dupfind)
+{
+    for (size_t i = 0; i < dupfind->count; i++)
+        free(dupfind->files[i].path);
+
+    free(dupfind->files);
+    dupfind->files = NULL;
+    dupfind->count = dupfind->capacity = 0;
+}
+
+static int
+dupfind_open(const char *path)
+{
+    int fd = open(path, O_RDONLY | O_NOATIME);
+
+    /* O_NOATIME is only permitted to the owner of the file. */
+    if (fd == -1 && errno == EPERM)
+        fd = open(path, O_RDONLY);
+
+    return fd;
+}
+
+static bool
+dupfind_pread_full(int fd, unsigned char *buf, size_t len, off_t offset)
+{
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, buf, len, offset);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            return false;
+
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+
+    return true;
+}
+
+/* Hash FILE according to STAGE, using BUF of DUPFIND_READ_SIZE bytes. */
+static void
+dupfind_hash_file(dupfind_file_t *file, dupfind_stage_t stage,
+                  unsigned char *buf)
+{
+    int fd = dupfind_open(file->path);
+    hash64_state_t state;
+    bool ok = true;
+
+    if (fd == -1)
+    {
+        print_error(true, false, "cannot open `%s'", file->path);
+        file->failed = true;
+        return;
+    }
+
+    hash64_init(&state, 0);
+
+    if (stage == DUPFIND_STAGE_EDGES)
+    {
+        size_t len
+            = file->size < DUPFIND_EDGE_SIZE ? file->size : DUPFIND_EDGE_SIZE;
+
+        ok = dupfind_pread_full(fd, buf, len, 0);
+
+        if (ok)
+            hash64_update(&state, buf, len);
+
+        if (ok && file->size > DUPFIND_EDGE_SIZE)
+        {
+            ok = dupfind_pread_full(fd, buf, len, file->size - len);
+
+            if (ok)
+                hash64_update(&state, buf, len);
+        }
+    }
+    else
+    {
+#ifdef HAVE_POSIX_FADVISE
+        (void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+        for (off_t offset = 0; ok && offset < file->size;)
+        {
+            size_t len = file->size - offset < DUPFIND_READ_SIZE
+                             ? file->size - offset
+                             : DUPFIND_READ_SIZE;
+
+            ok = dupfind_pread_full(fd, buf, len, offset);
+
+            if (ok)
+                hash64_update(&state, buf, len);
+
+            offset += len;
+        }
+
+#ifdef HAVE_POSIX_FADVISE
+        /* We will not read the file again, do not push others out of the
+           page cache. */
+        (void) posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    }
+
+    close(fd);
+
+    if (!ok)
+    {
+        print_error(false, false, "cannot read `%s'", file->path);
+        file->failed = true;
+        return;
+    }
+
+    file->hash = hash64_digest(&state);
+}
+
+/* Whether the files A and B, of the same size, have identical contents,
+   using BUF of DUPFIND_READ_SIZE bytes. */
+static bool
+dupfind_identical(dupfind_file_t *a, dupfind_file_t *b, unsigned char *buf)
+{
+    int fd_a = dupfind_open(a->path);
+    int fd_b = fd_a == -1 ? -1 : dupfind_open(b->path);
+    size_t half = DUPFIND_READ_SIZE / 2;
+    bool same = true;
+
+    if (fd_a == -1 || fd_b == -1)
+    {
+        print_error(true, false, "cannot open `%s'",
+                    fd_a == -1 ? a->path : b->path);
+        (fd_a == -1 ? a : b)->failed = true;
+
+        if (fd_a != -1)
+            close(fd_a);
+
+        return false;
+    }
+
+#ifdef HAVE_POSIX_FADVISE
+    (void) posix_fadvise(fd_a, 0, 0, POSIX_FADV_SEQUENTIAL);
+    (void) posix_fadvise(fd_b, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    for (off_t offset = 0; same && offset < a->size;)
+    {
+        size_t left = (size_t) (a->size - offset);
+        size_t len = left < half ? left : half;
+
+        if (!dupfind_pread_full(fd_a, buf, len, offset))
+        {
+            print_error(false, false, "cannot read `%s'", a->path);
+            a->failed = true;
+            same = false;
+        }
+        else if (!dupfind_pread_full(fd_b, buf + half, len, offset))
+        {
+            print_error(false, false, "cannot read `%s'", b->path);
+            b->failed = true;
+            same = false;
+        }
+        else
+            same = memcmp(buf, buf + half, len) == 0;
+
+        offset += len;
+    }
+
+    close(fd_a);
+    close(fd_b);
+
+    return same;
+}
+
+/* Split the files at INDICES, which all have the same size and hash, into
+   groups of files that are identical byte for byte. The group of a file is
+   the index of the first file of its group plus one. */
+static void
+dupfind_compare_group(dupfind_t *dupfind, const size_t *indices,
+                      size_t count, unsigned char *buf)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        dupfind_file_t *first = &dupfind->files[indices[i]];
+
+        if (first->group != 0 || first->failed)
+            continue;
+
+        first->group = indices[i] + 1;
+
+        /* Files are almost always identical to the first file of their
+           hash group, so each of them is usually read once more. */
+        for (size_t j = i + 1; j < count && !first->failed; j++)
+        {
+            dupfind_file_t *file = &dupfind->files[indices[j]];
+
+            if (file->group == 0 && !file->failed
+                && dupfind_identical(first, file, buf))
+                file->group = first->group;
+        }
+    }
+}
+
+static void *
+dupfind_worker(void *arg)
+{
+    dupfind_work_t *work = arg;
+    unsigned char *buf = xmalloc(DUPFIND_READ_SIZE);
+
+    while (true)
+    {
+        size_t i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED);
+
+        if (i >= work->count)
+            break;
+
+        if (work->stage == DUPFIND_STAGE_COMPARE)
+            dupfind_compare_group(work->dupfind,
+                                  &work->indices[work->starts[i]],
+                                  work->starts[i + 1] - work->starts[i], buf);
+        else
+            dupfind_hash_file(&work->dupfind->files[work->indices[i]],
+                              work->stage, buf);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* Run STAGE on COUNT work items, files or groups, on JOBS threads. */
+static void
+dupfind_run_stage(dupfind_t *dupfind, size_t *indices, size_t *starts,
+                  size_t count, dupfind_stage_t stage, int jobs)
+{
+    dupfind_work_t work = {
+        .dupfind = dupfind,
+        .indices = indices,
+        .starts = starts,
+        .count = count,
+        .next = 0,
+        .stage = stage,
+    };
+
+    if (jobs < 0 || (size_t) jobs > count)
+        jobs = count;
+
+    if (jobs <= 1)
+    {
+        dupfind_worker(&work);
+        return;
+    }
+
+    pthread_t *threads = xmalloc(sizeof(pthread_t) * jobs);
+    int started = 0;
+
+    for (; started < jobs; started++)
+    {
+        if (pthread_create(&threads[started], NULL, &dupfind_worker, &work)
+            != 0)
+            break;
+    }
+
+    /* If no thread could be started, do the work on this one. */
+    if (started == 0)
+        dupfind_worker(&work);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+static dupfind_file_t *dupfind_sort_files;
+
+static int
+dupfind_compare(const void *a, const void *b)
+{
+    const dupfind_file_t *fa = &dupfind_sort_files[*(const size_t *) a];
+    const dupfind_file_t *fb = &dupfind_sort_files[*(const size_t *) b];
+
+    if (fa->size != fb->size)
+        return fa->size < fb->size ? -1 : 1;
+
+    if (fa->hash != fb->hash)
+        return fa->hash < fb->hash ? -1 : 1;
+
+    if (fa->group != fb->group)
+        return fa->group < fb->group ? -1 : 1;
+
+    return strcmp(fa->path, fb->path);
+}
+
+static int
+dupfind_compare_inode(const void *a, const void *b)
+{
+    const dupfind_file_t *fa = &dupfind_sort_files[*(const size_t *) a];
+    const dupfind_file_t *fb = &dupfind_sort_files[*(const size_t *) b];
+
+    if (fa->dev != fb->dev)
+        return fa->dev < fb->dev ? -1 : 1;
+
+    if (fa->ino != fb->ino)
+        return fa->ino < fb->ino ? -1 : 1;
+
+    return strcmp(fa->path, fb->path);
+}
+
+static bool
+dupfind_same_group(dupfind_t *dupfind, size_t a, size_t b)
+{
+    return dupfind->files[a].size == dupfind->files[b].size
+           && dupfind->files[a].hash == dupfind->files[b].hash
+           && dupfind->files[a].group == dupfind->files[b].group;
+}
+
+/* Keep only the first path of every file among INDICES, and return the
+   number of indices kept. */
+static size_t
+dupfind_drop_links(dupfind_t *dupfind, size_t *indices, size_t count)
+{
+    size_t kept = 0;
+
+    dupfind_sort_files = dupfind->files;
+    qsort(indices, count, sizeof(size_t), &dupfind_compare_inode);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        dupfind_file_t *file = &dupfind->files[indices[i]];
+
+        if (kept > 0 && dupfind->files[indices[kept - 1]].dev == file->dev
+            && dupfind->files[indices[kept - 1]].ino == file->ino)
+            continue;
+
+        indices[kept++] = indices[i];
+    }
+
+    return kept;
+}
+
+/* Sort INDICES by size, hash and group, drop files that failed or are alone in
+   their group, and return the number of indices kept. */
+static size_t
+dupfind_filter(dupfind_t *dupfind, size_t *indices, size_t count)
+{
+    size_t kept = 0;
+
+    dupfind_sort_files = dupfind->files;
+    qsort(indices, count, sizeof(size_t), &dupfind_compare);
+
+    for (size_t i = 0; i < count;)
+    {
+        size_t j = i;
+        size_t group = 0;
+
+        while (j < count && dupfind_same_group(dupfind, indices[i], indices[j]))
+        {
+            if (!dupfind->files[indices[j]].failed)
+                group++;
+
+            j++;
+        }
+
+        if (group > 1)
+        {
+            for (; i < j; i++)
+                if (!dupfind->files[indices[i]].failed)
+                    indices[kept++] = indices[i];
+        }
+
+        i = j;
+    }
+
+    return kept;
+}
+
+/* Find the duplicates among the added files and print each group of
+   identical files to OUTPUT, one path per line, with the groups separated
+   by empty lines. Returns the number of groups found. */
+size_t
+dupfind_run(dupfind_t *dupfind, int jobs, FILE *output)
+{
+    size_t *indices = xmalloc(sizeof(size_t) * (dupfind->count + 1));
+    size_t count = dupfind->count;
+    size_t groups = 0;
+
+    for (size_t i = 0; i < count; i++)
+        indices[i] = i;
+
+    count = dupfind_drop_links(dupfind, indices, count);
+    count = dupfind_filter(dupfind, indices, count);
+
+    if (count > 0)
+    {
+        dupfind_run_stage(dupfind, indices, NULL, count, DUPFIND_STAGE_EDGES,
+                          jobs);
+        count = dupfind_filter(dupfind, indices, count);
+    }
+
+    if (count > 0)
+    {
+        /* For files of up to two edge blocks, the edge hash already
+           covers the whole contents, so there is nothing left to read. */
+        size_t large = 0;
+        size_t *large_indices = xmalloc(sizeof(size_t) * count);
+
+        for (size_t i = 0; i < count; i++)
+            if (dupfind->files[indices[i]].size > 2 * DUPFIND_EDGE_SIZE)
+                large_indices[large++] = indices[i];
+
+        dupfind_run_stage(dupfind, large_indices, NULL, large,
+                          DUPFIND_STAGE_FULL, jobs);
+        free(large_indices);
+
+        count = dupfind_filter(dupfind, indices, count);
+    }
+
+    if (count > 0)
+    {
+        size_t *starts = xmalloc(sizeof(size_t) * (count + 1));
+        size_t ngroups = 0;
+
+        for (size_t i = 0; i < count; i++)
+            if (i == 0
+                || !dupfind_same_group(dupfind, indices[i - 1], indices[i]))
+                starts[ngroups++] = i;
+
+        starts[ngroups] = count;
+
+        dupfind_run_stage(dupfind, indices, starts, ngroups,
+                          DUPFIND_STAGE_COMPARE, jobs);
+        free(starts);
+
+        count = dupfind_filter(dupfind, indices, count);
+    }
+
+    for (size_t i = 0; i < count; i++)
+    {
+        if (i > 0 && !dupfind_same_group(dupfind, indices[i - 1], indices[i]))
+            fputc('\n', output);
+
+        if (i == 0 || !dupfind_same_group(dupfind, indices[i - 1], indices[i]))
+            groups++;
+
+        fprintf(output, "%s\n", dupfind->files[indices[i]].path);
+    }
+
+    free(indices);
+
+    return groups;
+}
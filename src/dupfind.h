@@ -0,0 +1,64 @@
+/*
+    dupfind.h -- typedefs and prototypes for dupfind.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __DUPFIND_H__
+#define __DUPFIND_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define DUPFIND_INIT                                                          \
+    {                                                                         \
+        .files = NULL, .count = 0, .capacity = 0                              \
+    }
+
+/* A regular file that is a candidate for being a duplicate. */
+typedef struct
+{
+    char *path;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    uint64_t hash; /* Hash of the last stage the file went through. */
+    size_t group;  /* Files found identical byte for byte share the same
+                      non-zero group, 0 before the final comparison. */
+    bool failed;   /* Set if the file could not be read. */
+} dupfind_file_t;
+
+typedef struct
+{
+    dupfind_file_t *files;
+    size_t count;
+    size_t capacity;
+} dupfind_t;
+
+__BEGIN_DECLS
+
+void dupfind_init(dupfind_t *dupfind);
+void dupfind_add(dupfind_t *dupfind, const char *path, off_t size,
+                 dev_t dev, ino_t ino);
+size_t dupfind_run(dupfind_t *dupfind, int jobs, FILE *output);
+void dupfind_free(dupfind_t *dupfind);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,214 @@
+/*
+    eventfmt.c -- write events as JSON lines or binary records.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+
+#include "eventfmt.h"
+#include "outbuf.h"
+
+/* Whether the separator between DIR and the name must be written. */
+static bool
+eventfmt_needs_slash(const char *dir, size_t dirlen, const char *name)
+{
+    return name[0] != '\0' && (dirlen == 0 || dir[dirlen - 1] != '/');
+}
+
+/* Returns the length of the UTF-8 sequence at S, or 0 if it is not valid:
+   truncated, overlong, a surrogate or beyond U+10FFFF. */
+static size_t
+eventfmt_utf8_len(const unsigned char *s)
+{
+    unsigned char min = 0x80, max = 0xbf;
+    size_t len;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf)
+        len = 2;
+    else if (s[0] >= 0xe0 && s[0] <= 0xef)
+    {
+        len = 3;
+        min = s[0] == 0xe0 ? 0xa0 : 0x80;
+        max = s[0] == 0xed ? 0x9f : 0xbf;
+    }
+    else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+    {
+        len = 4;
+        min = s[0] == 0xf0 ? 0x90 : 0x80;
+        max = s[0] == 0xf4 ? 0x8f : 0xbf;
+    }
+    else
+        return 0;
+
+    if (s[1] < min || s[1] > max)
+        return 0;
+
+    for (size_t i = 2; i < len; i++)
+        if (s[i] < 0x80 || s[i] > 0xbf)
+            return 0;
+
+    return len;
+}
+
+/* Write S as the contents of a JSON string. Runs of characters that need
+   no escaping are copied as they are. Bytes that are not part of valid
+   UTF-8 are written as \u00XX, so that the output is always valid JSON.
+   Returns true if there were any. */
+bool
+eventfmt_json_string(outbuf_t *outbuf, const char *s)
+{
+    const char *run = s;
+    bool invalid = false;
+
+    for (; *s != '\0'; s++)
+    {
+        unsigned char c = *s;
+        char escape[8];
+        int len;
+
+        if (c >= 0x80)
+        {
+            size_t seqlen = eventfmt_utf8_len((const unsigned char *) s);
+
+            if (seqlen > 0)
+            {
+                s += seqlen - 1;
+                continue;
+            }
+
+            len = snprintf(escape, sizeof escape, "\\u%04x", c);
+            invalid = true;
+        }
+        else if (c == '"' || c == '\\')
+            len = snprintf(escape, sizeof escape, "\\%c", c);
+        else if (c == '\n')
+            len = snprintf(escape, sizeof escape, "\\n");
+        else if (c == '\t')
+            len = snprintf(escape, sizeof escape, "\\t");
+        else if (c < 0x20 || c == 0x7f)
+            len = snprintf(escape, sizeof escape, "\\u%04x", c);
+        else
+            continue;
+
+        outbuf_write(outbuf, run, s - run);
+        outbuf_write(outbuf, escape, len);
+        run = s + 1;
+    }
+
+    outbuf_write(outbuf, run, s - run);
+
+    return invalid;
+}
+
+/* Write the bytes of S as pairs of hexadecimal digits. */
+static void
+eventfmt_hex(outbuf_t *outbuf, const char *s)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    for (; *s != '\0'; s++)
+    {
+        char pair[2] = { digits[(unsigned char) *s >> 4],
+                         digits[(unsigned char) *s & 0xf] };
+
+        outbuf_write(outbuf, pair, 2);
+    }
+}
+
+/* Write EVENT as a JSON object on its own line. Paths that are not valid
+   UTF-8, which Linux allows, have their invalid bytes written as \u00XX
+   in "path", and the exact bytes in "path_hex". */
+void
+eventfmt_jsonl(outbuf_t *outbuf, const eventfmt_event_t *event)
+{
+    assert(event);
+
+    char buf[160];
+    size_t dirlen = strlen(event->dir);
+    int len = snprintf(buf, sizeof buf,
+                       "{\"time\":%" PRIu64 ",\"wd\":%d,\"mask\":%" PRIu32
+                       ",\"cookie\":%" PRIu32 ",\"count\":%zu,\"event\":\"",
+                       event->time, event->wd, event->mask, event->cookie,
+                       event->count);
+
+    outbuf_write(outbuf, buf, len);
+    eventfmt_json_string(outbuf, event->label);
+    outbuf_write(outbuf, "\",\"path\":\"", 10);
+
+    bool slash = eventfmt_needs_slash(event->dir, dirlen, event->name);
+    bool invalid = eventfmt_json_string(outbuf, event->dir);
+
+    if (slash)
+        outbuf_write(outbuf, "/", 1);
+
+    invalid |= eventfmt_json_string(outbuf, event->name);
+
+    if (invalid)
+    {
+        outbuf_write(outbuf, "\",\"path_hex\":\"", 14);
+        eventfmt_hex(outbuf, event->dir);
+
+        if (slash)
+            outbuf_write(outbuf, "2f", 2);
+
+        eventfmt_hex(outbuf, event->name);
+    }
+
+    if (event->mask & IN_ISDIR)
+        outbuf_write(outbuf, "\",\"dir\":true}\n", 14);
+    else
+        outbuf_write(outbuf, "\",\"dir\":false}\n", 15);
+}
+
+/* Write EVENT as a binary record: an eventfmt_record_t header followed by
+   the path. */
+void
+eventfmt_binary(outbuf_t *outbuf, const eventfmt_event_t *event)
+{
+    assert(event);
+
+    static const char padding[8] = { 0 };
+    size_t dirlen = strlen(event->dir);
+    size_t namelen = strlen(event->name);
+    bool slash = eventfmt_needs_slash(event->dir, dirlen, event->name);
+    size_t pathlen = dirlen + slash + namelen;
+    size_t size = (sizeof(eventfmt_record_t) + pathlen + 1 + 7) & ~(size_t) 7;
+
+    eventfmt_record_t record = {
+        .size = size,
+        .mask = event->mask,
+        .cookie = event->cookie,
+        .wd = event->wd,
+        .time = event->time,
+        .count = event->count,
+        .pathlen = pathlen,
+    };
+
+    outbuf_write(outbuf, &record, sizeof record);
+    outbuf_write(outbuf, event->dir, dirlen);
+
+    if (slash)
+        outbuf_write(outbuf, "/", 1);
+
+    outbuf_write(outbuf, event->name, namelen);
+    outbuf_write(outbuf, padding, size - sizeof record - pathlen);
+}
@@ -0,0 +1,64 @@
+/*
+    eventfmt.h -- typedefs and prototypes for eventfmt.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __EVENTFMT_H__
+#define __EVENTFMT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "outbuf.h"
+
+/* An event to be written in one of the structured formats. */
+typedef struct
+{
+    uint64_t time;      /* CLOCK_MONOTONIC time, in nanoseconds. */
+    int wd;             /* Watch descriptor, or -1 if there is none. */
+    uint32_t mask;      /* Raw inotify mask. */
+    uint32_t cookie;    /* Cookie pairing the two events of a rename. */
+    size_t count;       /* Number of events merged into this one. */
+    const char *dir;    /* Directory of the event. */
+    const char *name;   /* Name of the entry inside DIR. */
+    const char *label;  /* Name of the event, such as "CREATE". */
+} eventfmt_event_t;
+
+/* Header of a record in the binary format. It is followed by the full path
+   of the event, NUL-terminated and padded with NULs so that the next
+   record is 8-byte aligned. Fields are in host byte order. */
+typedef struct
+{
+    uint32_t size;    /* Size of the whole record, including this header. */
+    uint32_t mask;    /* Raw inotify mask. */
+    uint32_t cookie;  /* Cookie pairing the two events of a rename. */
+    int32_t wd;       /* Watch descriptor, or -1 if there is none. */
+    uint64_t time;    /* CLOCK_MONOTONIC time, in nanoseconds. */
+    uint32_t count;   /* Number of events merged into this one. */
+    uint32_t pathlen; /* Length of the path, without the NUL. */
+} eventfmt_record_t;
+
+__BEGIN_DECLS
+
+bool eventfmt_json_string(outbuf_t *outbuf, const char *s);
+void eventfmt_jsonl(outbuf_t *outbuf, const eventfmt_event_t *event);
+void eventfmt_binary(outbuf_t *outbuf, const eventfmt_event_t *event);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,179 @@
+/*
+    exclude.c -- patterns of directories to leave out of a walk.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "exclude.h"
+#include "utils.h"
+
+void
+exclude_init(exclude_t *exclude)
+{
+    assert(exclude);
+
+    exclude->patterns = NULL;
+    exclude->count = 0;
+    exclude->capacity = 0;
+    exclude->paths = false;
+    exclude->bases = NULL;
+    exclude->basecount = 0;
+}
+
+/* Match the paths below BASE relative to it. BASE must outlive the list. */
+void
+exclude_add_base(exclude_t *exclude, const char *base)
+{
+    assert(base);
+
+    size_t len = strlen(base);
+
+    while (len > 1 && base[len - 1] == '/')
+        len--;
+
+    exclude->bases = xrealloc(exclude->bases, sizeof(exclude_base_t)
+                                                  * (exclude->basecount + 1));
+    exclude->bases[exclude->basecount++] = (exclude_base_t){
+        .path = base,
+        .len = len,
+    };
+}
+
+void
+exclude_add(exclude_t *exclude, const char *pattern)
+{
+    assert(pattern);
+
+    /* A leading slash anchors the pattern at the base, which all paths
+       are relative to anyway. */
+    while (pattern[0] == '/')
+        pattern++;
+
+    if (pattern[0] == '\0')
+        return;
+
+    if (exclude->count == exclude->capacity)
+    {
+        exclude->capacity = exclude->capacity == 0 ? 8 : exclude->capacity * 2;
+        exclude->patterns = xrealloc(exclude->patterns,
+                                     sizeof(char *) * exclude->capacity);
+    }
+
+    char *copy = xmalloc(strlen(pattern) + 1);
+
+    strcpy(copy, pattern);
+    exclude->patterns[exclude->count++] = copy;
+
+    if (strchr(copy, '/') != NULL)
+        exclude->paths = true;
+}
+
+/* Add the patterns in FILE, one per line. Empty lines and lines starting
+   with `#' are ignored. */
+bool
+exclude_add_file(exclude_t *exclude, const char *file)
+{
+    FILE *fp = STREQ(file, "-") ? stdin : fopen(file, "r");
+
+    if (fp == NULL)
+        return false;
+
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &size, fp)) != -1)
+    {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+
+        if (len > 0 && line[0] != '#')
+            exclude_add(exclude, line);
+    }
+
+    free(line);
+
+    bool ok = !ferror(fp);
+
+    if (fp != stdin)
+        fclose(fp);
+
+    return ok;
+}
+
+/* Whether the directory at PATH is excluded. PATH may be only the name of
+   the directory if no pattern contains a slash. */
+bool
+exclude_match(const exclude_t *exclude, const char *path)
+{
+    assert(path);
+
+    const char *name = strrchr(path, '/');
+    const char *relpath = path;
+
+    name = name == NULL ? path : name + 1;
+
+    for (size_t i = 0; exclude->paths && i < exclude->basecount; i++)
+    {
+        const exclude_base_t *base = &exclude->bases[i];
+
+        if (base->len > 0 && strncmp(path, base->path, base->len) == 0
+            && (path[base->len] == '/' || base->path[base->len - 1] == '/'))
+        {
+            relpath = path + base->len;
+
+            while (*relpath == '/')
+                relpath++;
+
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < exclude->count; i++)
+    {
+        const char *pattern = exclude->patterns[i];
+
+        if (strchr(pattern, '/') == NULL ? fnmatch(pattern, name, 0) == 0
+                                         : fnmatch(pattern, relpath,
+                                                   FNM_PATHNAME)
+                                               == 0)
+            return true;
+    }
+
+    return false;
+}
+
+void
+exclude_free(exclude_t *exclude)
+{
+    for (size_t i = 0; i < exclude->count; i++)
+        free(exclude->patterns[i]);
+
+    free(exclude->patterns);
+    free(exclude->bases);
+    exclude->patterns = NULL;
+    exclude->count = 0;
+    exclude->capacity = 0;
+    exclude->bases = NULL;
+    exclude->basecount = 0;
+}
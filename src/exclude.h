@@ -0,0 +1,57 @@
+/*
+    exclude.h -- typedefs and prototypes for exclude.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __EXCLUDE_H__
+#define __EXCLUDE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A base directory that paths are matched relative to. */
+typedef struct
+{
+    const char *path;
+    size_t len; /* Length of the path without trailing slashes. */
+} exclude_base_t;
+
+/* A list of fnmatch() patterns of directories to leave out. Patterns
+   without a slash are matched against the name of a directory, and the
+   others against its path relative to the base it is below. */
+typedef struct
+{
+    char **patterns;
+    size_t count;
+    size_t capacity;
+    bool paths; /* Some patterns contain a slash. */
+    exclude_base_t *bases;
+    size_t basecount;
+} exclude_t;
+
+__BEGIN_DECLS
+
+void exclude_init(exclude_t *exclude);
+void exclude_add_base(exclude_t *exclude, const char *base);
+void exclude_add(exclude_t *exclude, const char *pattern);
+bool exclude_add_file(exclude_t *exclude, const char *file);
+bool exclude_match(const exclude_t *exclude, const char *path);
+void exclude_free(exclude_t *exclude);
+
+__END_DECLS
+
+#endif
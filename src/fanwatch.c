@@ -0,0 +1,455 @@
+/*
+    fanwatch.c -- watch whole filesystems with fanotify.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* Instead of one inotify watch per directory, a single fanotify mark with
+   FAN_MARK_FILESYSTEM covers every directory of the filesystem, so there is
+   no watch limit and no setup crawl. With FAN_REPORT_DFID_NAME, each event
+   carries the file handle of the directory it happened in and the name of
+   the entry. Handles are resolved to paths with open_by_handle_at() and
+   cached, and events outside of the watched directory are dropped.
+
+   Marking a filesystem needs CAP_SYS_ADMIN, and resolving handles needs
+   CAP_DAC_READ_SEARCH. */
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifdef HAVE_SYS_FANOTIFY_H
+#include <sys/fanotify.h>
+#endif
+
+#include "fanwatch.h"
+#include "hash.h"
+#include "utils.h"
+
+#if defined(HAVE_SYS_FANOTIFY_H) && defined(FAN_REPORT_DFID_NAME)
+
+#define FANWATCH_BUF_LEN (64 * 1024)
+
+/* The cache is dropped when this many slots were filled since it was last
+   dropped. */
+#define FANWATCH_CACHE_MAX 65536
+
+/* Events with the same bits as their inotify counterparts. */
+#define FANWATCH_EVENTS                                                       \
+    (FAN_ACCESS | FAN_MODIFY | FAN_ATTRIB | FAN_CLOSE_WRITE                   \
+     | FAN_CLOSE_NOWRITE | FAN_OPEN | FAN_MOVED_FROM | FAN_MOVED_TO           \
+     | FAN_CREATE | FAN_DELETE | FAN_DELETE_SELF | FAN_MOVE_SELF)
+
+/* Directory events that make cached paths stale. */
+#define FANWATCH_STALE_EVENTS (FAN_MOVED_FROM | FAN_MOVED_TO | FAN_DELETE)
+
+static size_t
+fanwatch_handle_size(const struct file_handle *handle)
+{
+    return sizeof(struct file_handle) + handle->handle_bytes;
+}
+
+static uint64_t
+fanwatch_handle_hash(const struct file_handle *handle)
+{
+    return hash64(handle, fanwatch_handle_size(handle), 0);
+}
+
+/* Drop every cached directory. Only the slots filled since the last clear
+   are visited. */
+static void
+fanwatch_cache_clear(fanwatch_t *fanwatch)
+{
+    for (size_t i = 0; i < fanwatch->cache_usedcount; i++)
+    {
+        fanwatch_cache_entry_t *entry
+            = &fanwatch->cache[fanwatch->cache_used[i]];
+
+        free(entry->handle);
+        free(entry->path);
+        entry->handle = NULL;
+        entry->path = NULL;
+        entry->removed = false;
+    }
+
+    fanwatch->cache_usedcount = 0;
+    fanwatch->cache_size = 0;
+}
+
+/* Drop the cached directories at PATH and below it, whose paths changed
+   when it was moved or deleted. */
+static void
+fanwatch_cache_invalidate(fanwatch_t *fanwatch, const char *path)
+{
+    size_t len = strlen(path);
+
+    for (size_t i = 0;
+         i < fanwatch->cache_usedcount && fanwatch->cache_size > 0; i++)
+    {
+        fanwatch_cache_entry_t *entry
+            = &fanwatch->cache[fanwatch->cache_used[i]];
+
+        if (entry->path == NULL || strncmp(entry->path, path, len) != 0
+            || (entry->path[len] != '\0' && entry->path[len] != '/'))
+            continue;
+
+        free(entry->handle);
+        free(entry->path);
+        entry->handle = NULL;
+        entry->path = NULL;
+        entry->removed = true;
+        fanwatch->cache_size--;
+    }
+}
+
+static fanwatch_cache_entry_t *
+fanwatch_cache_slot(fanwatch_t *fanwatch, const struct file_handle *handle,
+                    uint64_t hash)
+{
+    size_t mask = fanwatch->cache_capacity - 1;
+    size_t size = fanwatch_handle_size(handle);
+
+    for (size_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        fanwatch_cache_entry_t *entry = &fanwatch->cache[i];
+
+        if (entry->removed)
+            continue;
+
+        if (entry->path == NULL
+            || (entry->hash == hash
+                && fanwatch_handle_size(entry->handle) == size
+                && memcmp(entry->handle, handle, size) == 0))
+            return entry;
+    }
+}
+
+/* Resolve the directory HANDLE to its canonical path. Returns NULL if the
+   directory does not exist anymore. */
+static const char *
+fanwatch_resolve(fanwatch_t *fanwatch, struct file_handle *handle)
+{
+    uint64_t hash = fanwatch_handle_hash(handle);
+    fanwatch_cache_entry_t *entry = fanwatch_cache_slot(fanwatch, handle, hash);
+
+    if (entry->path != NULL)
+        return entry->path;
+
+    int fd = open_by_handle_at(fanwatch->mount_fd, handle, O_PATH);
+
+    if (fd == -1)
+        return NULL;
+
+    char procpath[64];
+    char path[PATH_MAX];
+
+    snprintf(procpath, sizeof procpath, "/proc/self/fd/%d", fd);
+
+    ssize_t len = readlink(procpath, path, sizeof path - 1);
+
+    close(fd);
+
+    if (len == -1)
+        return NULL;
+
+    path[len] = '\0';
+
+    if (fanwatch->cache_usedcount >= FANWATCH_CACHE_MAX)
+    {
+        fanwatch_cache_clear(fanwatch);
+        entry = fanwatch_cache_slot(fanwatch, handle, hash);
+    }
+
+    fanwatch->cache_used[fanwatch->cache_usedcount++]
+        = entry - fanwatch->cache;
+    entry->hash = hash;
+    entry->handle = xmalloc(fanwatch_handle_size(handle));
+    memcpy(entry->handle, handle, fanwatch_handle_size(handle));
+    entry->path = strdup(path);
+    fanwatch->cache_size++;
+
+    return entry->path;
+}
+
+/* Translate the canonical path of a directory to the path it has relative
+   to the root given by the user. Returns NULL if the directory is outside
+   of the watched tree. */
+static const char *
+fanwatch_user_path(fanwatch_t *fanwatch, const char *path)
+{
+    size_t len = fanwatch->realrootlen;
+    const char *rest;
+
+    if (strncmp(path, fanwatch->realroot, len) != 0)
+        return NULL;
+
+    rest = path + len;
+
+    if (*rest == '\0')
+        return fanwatch->root;
+
+    if (!fanwatch->recursive)
+        return NULL;
+
+    /* The root may be `/', which already ends with a slash. */
+    if (*rest != '/' && fanwatch->realroot[len - 1] != '/')
+        return NULL;
+
+    if (*rest == '/')
+        rest++;
+
+    size_t rootlen = strlen(fanwatch->root);
+    size_t needed = rootlen + strlen(rest) + 2;
+
+    if (needed > fanwatch->pathbufsize)
+    {
+        fanwatch->pathbufsize = needed * 2;
+        fanwatch->pathbuf = xrealloc(fanwatch->pathbuf, fanwatch->pathbufsize);
+    }
+
+    strcpy(fanwatch->pathbuf, fanwatch->root);
+
+    if (rootlen == 0 || fanwatch->root[rootlen - 1] != '/')
+        strcat(fanwatch->pathbuf, "/");
+
+    strcat(fanwatch->pathbuf, rest);
+
+    return fanwatch->pathbuf;
+}
+
+bool
+fanwatch_init(fanwatch_t *fanwatch, const char *root, uint32_t mask,
+              bool recursive)
+{
+    assert(fanwatch);
+    assert(root);
+
+    fanwatch->fd = -1;
+    fanwatch->mount_fd = -1;
+    fanwatch->mask = mask;
+    fanwatch->recursive = recursive;
+    fanwatch->root = strdup(root);
+    fanwatch->realroot = realpath(root, NULL);
+    fanwatch->max_dirpath_len = 0;
+    fanwatch->cache_capacity = FANWATCH_CACHE_MAX * 2;
+    fanwatch->cache = calloc(fanwatch->cache_capacity,
+                             sizeof(fanwatch_cache_entry_t));
+    fanwatch->cache_size = 0;
+    fanwatch->cache_used = malloc(sizeof(size_t) * FANWATCH_CACHE_MAX);
+    fanwatch->cache_usedcount = 0;
+    fanwatch->pathbuf = NULL;
+    fanwatch->pathbufsize = 0;
+
+    if (fanwatch->root == NULL || fanwatch->realroot == NULL
+        || fanwatch->cache == NULL || fanwatch->cache_used == NULL)
+        return false;
+
+    fanwatch->realrootlen = strlen(fanwatch->realroot);
+    fanwatch->mount_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fanwatch->mount_fd == -1)
+        return false;
+
+    fanwatch->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC
+                                     | FAN_REPORT_DFID_NAME,
+                                 O_RDONLY | O_LARGEFILE);
+
+    if (fanwatch->fd == -1)
+        return false;
+
+    uint64_t fanmask = (mask & FANWATCH_EVENTS) | FANWATCH_STALE_EVENTS
+                       | FAN_ONDIR;
+
+    return fanotify_mark(fanwatch->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                         fanmask, AT_FDCWD, root)
+           == 0;
+}
+
+/* Pass the events in BUFFER that are below the root to CALLBACK. */
+static void
+fanwatch_dispatch(fanwatch_t *fanwatch, fanwatch_callback_t callback,
+                  char *buffer, ssize_t length)
+{
+    struct fanotify_event_metadata *event
+        = (struct fanotify_event_metadata *) buffer;
+
+    for (; FAN_EVENT_OK(event, length); event = FAN_EVENT_NEXT(event, length))
+    {
+        if (event->vers != FANOTIFY_METADATA_VERSION)
+            continue;
+
+        /* The events lost may have moved directories, so no cached path
+           can be trusted anymore. FAN_Q_OVERFLOW has the same bit as
+           IN_Q_OVERFLOW. */
+        if (event->mask & FAN_Q_OVERFLOW)
+        {
+            fanwatch_cache_clear(fanwatch);
+            callback(fanwatch, FAN_Q_OVERFLOW, fanwatch->root, "");
+            continue;
+        }
+
+        struct fanotify_event_info_fid *fid
+            = (struct fanotify_event_info_fid *) (event + 1);
+
+        if ((char *) fid >= (char *) event + event->event_len
+            || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME)
+            continue;
+
+        struct file_handle *handle = (struct file_handle *) fid->handle;
+        const char *name = (const char *) handle->f_handle
+                           + handle->handle_bytes;
+        uint32_t mask = (uint32_t) event->mask;
+        const char *realpath = NULL;
+
+        /* Events on the directory itself carry `.' as the name, and are
+           not reported, like inotify events without a name. */
+        if (!STREQ(name, "."))
+        {
+            realpath = fanwatch_resolve(fanwatch, handle);
+
+            const char *path = realpath == NULL
+                                   ? NULL
+                                   : fanwatch_user_path(fanwatch, realpath);
+
+            if (path != NULL && (mask & fanwatch->mask))
+            {
+                size_t len = strlen(path);
+
+                if (len > fanwatch->max_dirpath_len)
+                    fanwatch->max_dirpath_len = len;
+
+                callback(fanwatch, mask, path, name);
+            }
+        }
+
+        /* A directory moved or deleted anywhere on the filesystem makes
+           the cached paths below it stale. Only those are dropped, unless
+           its parent cannot be resolved anymore. */
+        if ((mask & FAN_ONDIR) && (mask & FANWATCH_STALE_EVENTS)
+            && fanwatch->cache_size > 0)
+        {
+            char path[PATH_MAX + NAME_MAX + 2];
+
+            if (realpath != NULL
+                && (size_t) snprintf(path, sizeof path, "%s/%s",
+                                     STREQ(realpath, "/") ? "" : realpath,
+                                     name)
+                       < sizeof path)
+                fanwatch_cache_invalidate(fanwatch, path);
+            else
+                fanwatch_cache_clear(fanwatch);
+        }
+    }
+
+}
+
+/* Read all the queued events and pass the ones below the root to CALLBACK.
+   FIONREAD gives the number of bytes queued, which are read in chunks.
+   Returns false with errno set if reading fails. */
+bool
+fanwatch_process(fanwatch_t *fanwatch, fanwatch_callback_t callback)
+{
+    char buffer[FANWATCH_BUF_LEN]
+        __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    int queued = 0;
+
+    if (ioctl(fanwatch->fd, FIONREAD, &queued) == -1)
+        return false;
+
+    while (queued > 0)
+    {
+        ssize_t length = read(fanwatch->fd, buffer, sizeof buffer);
+
+        if (length == -1)
+            return errno == EINTR || errno == EAGAIN;
+
+        fanwatch_dispatch(fanwatch, callback, buffer, length);
+        queued -= length;
+    }
+
+    return true;
+}
+
+#else /* !HAVE_SYS_FANOTIFY_H || !FAN_REPORT_DFID_NAME */
+
+bool
+fanwatch_init(fanwatch_t *fanwatch, const char *root, uint32_t mask,
+              bool recursive)
+{
+    fanwatch->fd = -1;
+    fanwatch->mount_fd = -1;
+    fanwatch->root = NULL;
+    fanwatch->realroot = NULL;
+    fanwatch->cache = NULL;
+    fanwatch->cache_capacity = 0;
+    fanwatch->cache_used = NULL;
+    fanwatch->pathbuf = NULL;
+
+    errno = ENOSYS;
+    return false;
+}
+
+bool
+fanwatch_process(fanwatch_t *fanwatch, fanwatch_callback_t callback)
+{
+    errno = ENOSYS;
+    return false;
+}
+
+static void
+fanwatch_cache_clear(fanwatch_t *fanwatch)
+{
+}
+
+#endif
+
+void
+fanwatch_free(fanwatch_t *fanwatch)
+{
+    if (fanwatch->cache != NULL)
+    {
+        fanwatch_cache_clear(fanwatch);
+        free(fanwatch->cache);
+        fanwatch->cache = NULL;
+    }
+
+    free(fanwatch->cache_used);
+    fanwatch->cache_used = NULL;
+
+    if (fanwatch->fd != -1)
+        close(fanwatch->fd);
+
+    if (fanwatch->mount_fd != -1)
+        close(fanwatch->mount_fd);
+
+    fanwatch->fd = fanwatch->mount_fd = -1;
+
+    free(fanwatch->root);
+    free(fanwatch->realroot);
+    free(fanwatch->pathbuf);
+    fanwatch->root = fanwatch->realroot = fanwatch->pathbuf = NULL;
+}
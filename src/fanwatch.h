@@ -0,0 +1,79 @@
+/*
+    fanwatch.h -- typedefs and prototypes for fanwatch.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __FANWATCH_H__
+#define __FANWATCH_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct fanwatch fanwatch_t;
+
+/* Called for every event below the watched directory. DIRPATH is the
+   directory the event happened in, spelled with the root path the watch
+   was created with, and NAME is the name of the entry inside it. The mask
+   uses the same bits as inotify. When the kernel queue overflowed, it is
+   called once with IN_Q_OVERFLOW, the root path and an empty name. */
+typedef void (*fanwatch_callback_t)(fanwatch_t *fanwatch, uint32_t mask,
+                                    const char *dirpath, const char *name);
+
+/* A cached mapping of a directory file handle to its path. */
+typedef struct
+{
+    uint64_t hash;
+    void *handle; /* A copy of the struct file_handle. */
+    char *path;
+    bool removed; /* The slot held an entry that was invalidated. Lookups
+                     go on past it. */
+} fanwatch_cache_entry_t;
+
+/* A fanotify instance watching a whole filesystem with a single mark, and
+   reporting the events below one directory of it. */
+struct fanwatch
+{
+    int fd;             /* The file descriptor from fanotify_init(). */
+    int mount_fd;       /* Any fd on the filesystem, for handle lookups. */
+    uint32_t mask;      /* Events to report. */
+    bool recursive;     /* Report events in subdirectories as well. */
+    char *root;         /* The root path as given by the user. */
+    char *realroot;     /* The canonical root path. */
+    size_t realrootlen; /* Length of the canonical root path. */
+    size_t max_dirpath_len;
+    fanwatch_cache_entry_t *cache;
+    size_t cache_capacity;
+    size_t cache_size;  /* Count of the cached directories. */
+    size_t *cache_used; /* Slots filled since the cache was last cleared,
+                           including the invalidated ones. */
+    size_t cache_usedcount;
+    char *pathbuf;
+    size_t pathbufsize;
+    void *data; /* User data for the callback. */
+};
+
+__BEGIN_DECLS
+
+bool fanwatch_init(fanwatch_t *fanwatch, const char *root, uint32_t mask,
+                   bool recursive);
+bool fanwatch_process(fanwatch_t *fanwatch, fanwatch_callback_t callback);
+void fanwatch_free(fanwatch_t *fanwatch);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,217 @@
+/*
+    hash.c -- fast non-cryptographic 64-bit hashing.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* This is the XXH64 algorithm. The input is consumed in 32-byte stripes
+   by four independent lanes, which keeps several multiplications in flight
+   and lets the compiler vectorize the main loop. */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "hash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+read64(const unsigned char *p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+
+    return v;
+}
+
+static inline uint32_t
+read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+
+    return v;
+}
+
+static inline uint64_t
+hash64_round(uint64_t acc, uint64_t input)
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static inline uint64_t
+hash64_merge_round(uint64_t acc, uint64_t lane)
+{
+    acc ^= hash64_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+static const unsigned char *
+hash64_stripes(uint64_t lanes[4], const unsigned char *p,
+               const unsigned char *end)
+{
+    uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+
+    while (end - p >= 32)
+    {
+        v1 = hash64_round(v1, read64(p));
+        v2 = hash64_round(v2, read64(p + 8));
+        v3 = hash64_round(v3, read64(p + 16));
+        v4 = hash64_round(v4, read64(p + 24));
+        p += 32;
+    }
+
+    lanes[0] = v1;
+    lanes[1] = v2;
+    lanes[2] = v3;
+    lanes[3] = v4;
+
+    return p;
+}
+
+void
+hash64_init(hash64_state_t *state, uint64_t seed)
+{
+    assert(state);
+
+    state->lanes[0] = seed + PRIME64_1 + PRIME64_2;
+    state->lanes[1] = seed + PRIME64_2;
+    state->lanes[2] = seed;
+    state->lanes[3] = seed - PRIME64_1;
+    state->total = 0;
+    state->buflen = 0;
+    state->seed = seed;
+}
+
+void
+hash64_update(hash64_state_t *state, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+
+    state->total += len;
+
+    if (state->buflen + len < 32)
+    {
+        memcpy(state->buf + state->buflen, p, len);
+        state->buflen += len;
+        return;
+    }
+
+    if (state->buflen > 0)
+    {
+        size_t fill = 32 - state->buflen;
+
+        memcpy(state->buf + state->buflen, p, fill);
+        hash64_stripes(state->lanes, state->buf, state->buf + 32);
+        p += fill;
+        state->buflen = 0;
+    }
+
+    p = hash64_stripes(state->lanes, p, end);
+
+    if (p < end)
+    {
+        memcpy(state->buf, p, end - p);
+        state->buflen = end - p;
+    }
+}
+
+uint64_t
+hash64_digest(const hash64_state_t *state)
+{
+    const unsigned char *p = state->buf;
+    const unsigned char *end = p + state->buflen;
+    uint64_t h;
+
+    if (state->total >= 32)
+    {
+        const uint64_t *v = state->lanes;
+
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12)
+            + rotl64(v[3], 18);
+        h = hash64_merge_round(h, v[0]);
+        h = hash64_merge_round(h, v[1]);
+        h = hash64_merge_round(h, v[2]);
+        h = hash64_merge_round(h, v[3]);
+    }
+    else
+        h = state->seed + PRIME64_5;
+
+    h += state->total;
+
+    while (end - p >= 8)
+    {
+        h ^= hash64_round(0, read64(p));
+        h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+        p += 8;
+    }
+
+    if (end - p >= 4)
+    {
+        h ^= (uint64_t) read32(p) * PRIME64_1;
+        h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+
+    while (p < end)
+    {
+        h ^= *p * PRIME64_5;
+        h = rotl64(h, 11) * PRIME64_1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+uint64_t
+hash64(const void *data, size_t len, uint64_t seed)
+{
+    hash64_state_t state;
+
+    hash64_init(&state, seed);
+    hash64_update(&state, data, len);
+
+    return hash64_digest(&state);
+}
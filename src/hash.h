@@ -0,0 +1,45 @@
+/*
+    hash.h -- typedefs and prototypes for hash.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming state of hash64(). */
+typedef struct
+{
+    uint64_t lanes[4];
+    uint64_t total;
+    unsigned char buf[32];
+    size_t buflen;
+    uint64_t seed;
+} hash64_state_t;
+
+__BEGIN_DECLS
+
+void hash64_init(hash64_state_t *state, uint64_t seed);
+void hash64_update(hash64_state_t *state, const void *data, size_t len);
+uint64_t hash64_digest(const hash64_state_t *state);
+uint64_t hash64(const void *data, size_t len, uint64_t seed);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,145 @@
+/*
+    histogram.c -- log-linear histograms updated without locks.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "histogram.h"
+
+/* Returns the bucket of VALUE. */
+static size_t
+histogram_bucket(uint64_t value)
+{
+    if (value < HISTOGRAM_SUB_COUNT)
+        return value;
+
+    /* The position of the highest bit set selects the power of two, and
+       the bits below it the bucket within. */
+    unsigned int exponent = 63 - __builtin_clzll(value);
+    unsigned int shift = exponent - HISTOGRAM_SUB_BITS;
+
+    return (size_t) (shift + 1) * HISTOGRAM_SUB_COUNT
+           + ((value >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+/* Returns the largest value counted in BUCKET. */
+static uint64_t
+histogram_bucket_max(size_t bucket)
+{
+    if (bucket < HISTOGRAM_SUB_COUNT)
+        return bucket;
+
+    unsigned int shift = bucket / HISTOGRAM_SUB_COUNT - 1;
+    uint64_t low = (uint64_t) (HISTOGRAM_SUB_COUNT
+                               + bucket % HISTOGRAM_SUB_COUNT)
+                   << shift;
+
+    return low + (((uint64_t) 1 << shift) - 1);
+}
+
+void
+histogram_init(histogram_t *histogram)
+{
+    assert(histogram);
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        atomic_init(&histogram->buckets[i], 0);
+
+    atomic_init(&histogram->count, 0);
+    atomic_init(&histogram->sum, 0);
+    atomic_init(&histogram->max, 0);
+}
+
+/* Count VALUE. There must be a single thread recording values in
+   HISTOGRAM, but any thread may read it meanwhile. */
+void
+histogram_record(histogram_t *histogram, uint64_t value)
+{
+    atomic_fetch_add_explicit(&histogram->buckets[histogram_bucket(value)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed))
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+}
+
+/* Add the counts of FROM to those of INTO. */
+void
+histogram_merge(histogram_t *into, const histogram_t *from)
+{
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        atomic_fetch_add_explicit(
+            &into->buckets[i],
+            atomic_load_explicit(&from->buckets[i], memory_order_relaxed),
+            memory_order_relaxed);
+
+    atomic_fetch_add_explicit(
+        &into->count, atomic_load_explicit(&from->count, memory_order_relaxed),
+        memory_order_relaxed);
+    atomic_fetch_add_explicit(
+        &into->sum, atomic_load_explicit(&from->sum, memory_order_relaxed),
+        memory_order_relaxed);
+
+    uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+
+    if (max > atomic_load_explicit(&into->max, memory_order_relaxed))
+        atomic_store_explicit(&into->max, max, memory_order_relaxed);
+}
+
+/* Returns the value below or at which PERCENT of the values counted fall,
+   rounded up to the end of its bucket, or 0 if there are none. */
+uint64_t
+histogram_percentile(const histogram_t *histogram, double percent)
+{
+    uint64_t count = 0;
+    uint64_t total = 0;
+
+    /* The total is summed from the buckets themselves, which may be ahead
+       of the count while a value is being recorded. */
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+        total += atomic_load_explicit(&histogram->buckets[i],
+                                      memory_order_relaxed);
+
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (percent / 100.0 * total + 0.5);
+    uint64_t max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+
+    if (rank == 0)
+        rank = 1;
+
+    for (size_t i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        count += atomic_load_explicit(&histogram->buckets[i],
+                                      memory_order_relaxed);
+
+        if (count >= rank)
+        {
+            uint64_t value = histogram_bucket_max(i);
+
+            return value < max ? value : max;
+        }
+    }
+
+    return max;
+}
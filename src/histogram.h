@@ -0,0 +1,58 @@
+/*
+    histogram.h -- typedefs and prototypes for histogram.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __HISTOGRAM_H__
+#define __HISTOGRAM_H__
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Each power of two is split into this many buckets, so that values are
+   counted to within 1 / HISTOGRAM_SUB_COUNT of their magnitude. */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+/* Counts of 64-bit values in log-linear buckets, in the manner of HDR
+   histograms: values below HISTOGRAM_SUB_COUNT have a bucket each, and each
+   power of two above is split into HISTOGRAM_SUB_COUNT equal buckets. The
+   memory is fixed whatever the range of the values.
+
+   Counters are updated with relaxed atomic additions, so one thread can
+   record values while another reads them without taking a lock. */
+typedef struct
+{
+    atomic_uint_fast64_t buckets[HISTOGRAM_BUCKETS];
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+} histogram_t;
+
+__BEGIN_DECLS
+
+void histogram_init(histogram_t *histogram);
+void histogram_record(histogram_t *histogram, uint64_t value);
+void histogram_merge(histogram_t *into, const histogram_t *from);
+uint64_t histogram_percentile(const histogram_t *histogram, double percent);
+
+__END_DECLS
+
+#endif
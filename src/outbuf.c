@@ -0,0 +1,177 @@
+/*
+    outbuf.c -- buffer output in a ring and write it with writev().
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <assert.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "outbuf.h"
+#include "utils.h"
+
+void
+outbuf_init(outbuf_t *outbuf, int fd, size_t capacity)
+{
+    assert(outbuf);
+    assert(capacity > 0);
+
+    outbuf->fd = fd;
+    outbuf->data = xmalloc(capacity);
+    outbuf->capacity = capacity;
+    outbuf->head = 0;
+    outbuf->size = 0;
+    outbuf->error = 0;
+}
+
+/* Returns the free space at the tail of the ring, up to its end or up to
+   the head when the tail wrapped around, and stores its offset in TAIL. */
+static size_t
+outbuf_space(outbuf_t *outbuf, size_t *tail)
+{
+    size_t end = outbuf->head + outbuf->size;
+
+    if (end >= outbuf->capacity)
+    {
+        *tail = end - outbuf->capacity;
+        return outbuf->head - *tail;
+    }
+
+    *tail = end;
+    return outbuf->capacity - end;
+}
+
+/* Append LEN bytes of DATA, flushing when the ring is full. The bytes are
+   dropped once a write failed, and the next outbuf_flush() reports it. */
+void
+outbuf_write(outbuf_t *outbuf, const void *data, size_t len)
+{
+    const char *bytes = data;
+
+    while (len > 0 && outbuf->error == 0)
+    {
+        size_t tail;
+        size_t space = outbuf_space(outbuf, &tail);
+
+        if (space == 0)
+        {
+            if (!outbuf_flush(outbuf))
+                return;
+
+            continue;
+        }
+
+        size_t n = len < space ? len : space;
+
+        memcpy(outbuf->data + tail, bytes, n);
+        outbuf->size += n;
+        bytes += n;
+        len -= n;
+    }
+}
+
+/* Append LEN copies of the character C. */
+void
+outbuf_fill(outbuf_t *outbuf, char c, size_t len)
+{
+    while (len > 0 && outbuf->error == 0)
+    {
+        size_t tail;
+        size_t space = outbuf_space(outbuf, &tail);
+
+        if (space == 0)
+        {
+            if (!outbuf_flush(outbuf))
+                return;
+
+            continue;
+        }
+
+        size_t n = len < space ? len : space;
+
+        memset(outbuf->data + tail, c, n);
+        outbuf->size += n;
+        len -= n;
+    }
+}
+
+/* Write out the buffered bytes. The ring holds them in at most two pieces,
+   which are written with one writev() unless the kernel takes less. Returns
+   false with errno set if writing fails, in which case they are dropped,
+   and so does every flush after it, including the writes that flushed
+   when the ring was full. */
+bool
+outbuf_flush(outbuf_t *outbuf)
+{
+    if (outbuf->error != 0)
+    {
+        errno = outbuf->error;
+        return false;
+    }
+
+    while (outbuf->size > 0)
+    {
+        struct iovec iov[2];
+        int iovcnt = 1;
+        size_t first = outbuf->capacity - outbuf->head;
+
+        iov[0].iov_base = outbuf->data + outbuf->head;
+
+        if (outbuf->size <= first)
+            iov[0].iov_len = outbuf->size;
+        else
+        {
+            iov[0].iov_len = first;
+            iov[1].iov_base = outbuf->data;
+            iov[1].iov_len = outbuf->size - first;
+            iovcnt = 2;
+        }
+
+        ssize_t written = writev(outbuf->fd, iov, iovcnt);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            outbuf->error = errno;
+            outbuf->size = 0;
+            return false;
+        }
+
+        outbuf->head = (outbuf->head + written) % outbuf->capacity;
+        outbuf->size -= written;
+    }
+
+    return true;
+}
+
+void
+outbuf_free(outbuf_t *outbuf)
+{
+    free(outbuf->data);
+    outbuf->data = NULL;
+    outbuf->capacity = 0;
+    outbuf->head = 0;
+    outbuf->size = 0;
+    outbuf->error = 0;
+}
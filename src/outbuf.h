@@ -0,0 +1,54 @@
+/*
+    outbuf.h -- typedefs and prototypes for outbuf.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __OUTBUF_H__
+#define __OUTBUF_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Default capacity of an output buffer. */
+#define OUTBUF_CAPACITY (256 * 1024)
+
+/* A ring buffer of output bytes for a file descriptor. Writes only copy
+   bytes to the tail, and outbuf_flush() hands everything from the head to
+   the kernel with a single writev(), in two pieces when the bytes wrap
+   around the end of the ring. */
+typedef struct
+{
+    int fd;
+    char *data;
+    size_t capacity;
+    size_t head; /* Offset of the first byte not written yet. */
+    size_t size; /* Number of bytes not written yet. */
+    int error;   /* errno of the first failed write, or 0. */
+} outbuf_t;
+
+__BEGIN_DECLS
+
+void outbuf_init(outbuf_t *outbuf, int fd, size_t capacity);
+void outbuf_write(outbuf_t *outbuf, const void *data, size_t len);
+void outbuf_fill(outbuf_t *outbuf, char c, size_t len);
+bool outbuf_flush(outbuf_t *outbuf);
+void outbuf_free(outbuf_t *outbuf);
+
+__END_DECLS
+
+#endif
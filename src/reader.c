@@ -0,0 +1,330 @@
+/*
+    reader.c -- read inotify events on a separate thread.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "reader.h"
+#include "utils.h"
+
+#define READER_MIN_BUF_LEN ((sizeof(struct inotify_event) + NAME_MAX + 1) * 64)
+
+/* How often to retry queuing the overflow event while the ring is full, in
+   milliseconds. */
+#define READER_RETRY_TIMEOUT 10
+
+static uint64_t
+reader_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Queue an event. Returns false if the ring is full. */
+static bool
+reader_push(reader_t *reader, const struct inotify_event *event,
+            uint64_t time)
+{
+    size_t tail = atomic_load_explicit(&reader->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&reader->head, memory_order_acquire);
+    size_t queued = tail - head;
+
+    if (queued == reader->capacity)
+        return false;
+
+    reader_event_t *slot = &reader->slots[tail & (reader->capacity - 1)];
+
+    slot->time = time;
+    memcpy(&slot->event, event, sizeof(struct inotify_event) + event->len);
+
+    atomic_store_explicit(&reader->tail, tail + 1, memory_order_release);
+
+    if (queued + 1 > atomic_load_explicit(&reader->highwater,
+                                          memory_order_relaxed))
+        atomic_store_explicit(&reader->highwater, queued + 1,
+                              memory_order_relaxed);
+
+    return true;
+}
+
+/* Queue the overflow event owed to the consumer since events were dropped.
+   Returns false if the ring is still full. */
+static bool
+reader_queue_overflow(reader_t *reader, uint64_t time)
+{
+    struct inotify_event overflow
+        = { .wd = -1, .mask = IN_Q_OVERFLOW, .cookie = 0, .len = 0 };
+
+    if (!reader_push(reader, &overflow, time))
+        return false;
+
+    reader->lost = false;
+
+    uint64_t one = 1;
+
+    return write(reader->notify_fd, &one, sizeof one) == sizeof one;
+}
+
+/* Queue an event, or count it as dropped if the ring is full. */
+static void
+reader_queue(reader_t *reader, const struct inotify_event *event,
+             uint64_t time)
+{
+    if (reader->lost && !reader_queue_overflow(reader, time))
+    {
+        atomic_fetch_add_explicit(&reader->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    if (!reader_push(reader, event, time))
+    {
+        atomic_fetch_add_explicit(&reader->dropped, 1, memory_order_relaxed);
+        reader->lost = true;
+    }
+}
+
+/* Read everything queued on the inotify file descriptor. Returns false if
+   reading failed. */
+static bool
+reader_drain(reader_t *reader)
+{
+    int queued = 0;
+
+    if (ioctl(reader->fd, FIONREAD, &queued) == -1)
+        return false;
+
+    if ((size_t) queued > atomic_load_explicit(&reader->pending_max,
+                                               memory_order_relaxed))
+        atomic_store_explicit(&reader->pending_max, queued,
+                              memory_order_relaxed);
+
+    if ((size_t) queued < READER_MIN_BUF_LEN)
+        queued = READER_MIN_BUF_LEN;
+
+    if ((size_t) queued > reader->bufsize)
+    {
+        reader->bufsize = queued;
+        reader->buf = xrealloc(reader->buf, reader->bufsize);
+    }
+
+    ssize_t length = read(reader->fd, reader->buf, reader->bufsize);
+
+    if (length == -1)
+        return errno == EINTR || errno == EAGAIN;
+
+    uint64_t time = reader_now();
+    size_t count = 0;
+
+    histogram_record(&reader->read_sizes, length);
+
+    for (ssize_t i = 0; i < length;)
+    {
+        struct inotify_event *event = (struct inotify_event *) &reader->buf[i];
+
+        if (event->mask & IN_Q_OVERFLOW)
+            atomic_fetch_add_explicit(&reader->overflows, 1,
+                                      memory_order_relaxed);
+
+        reader_queue(reader, event, time);
+        i += sizeof(struct inotify_event) + event->len;
+        count++;
+    }
+
+    atomic_fetch_add_explicit(&reader->received, count, memory_order_relaxed);
+
+    uint64_t one = 1;
+
+    if (count > 0 && write(reader->notify_fd, &one, sizeof one) == -1)
+        return false;
+
+    return true;
+}
+
+/* Record that reading failed with ERROR, and wake the consumer up to see
+   it. */
+static void
+reader_fail(reader_t *reader, int error)
+{
+    uint64_t one = 1;
+
+    atomic_store_explicit(&reader->error, error != 0 ? error : EIO,
+                          memory_order_release);
+
+    if (write(reader->notify_fd, &one, sizeof one) == -1)
+        return;
+}
+
+static void *
+reader_main(void *data)
+{
+    reader_t *reader = data;
+    struct pollfd fds[2] = {
+        { .fd = reader->fd,      .events = POLLIN },
+        { .fd = reader->stop_fd, .events = POLLIN },
+    };
+
+    while (true)
+    {
+        /* After dropping events, the consumer must be told even if no more
+           events arrive, as soon as it made room in the ring. */
+        int timeout = reader->lost ? READER_RETRY_TIMEOUT : -1;
+        int ready = poll(fds, 2, timeout);
+
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+
+            reader_fail(reader, errno);
+            break;
+        }
+
+        if (fds[1].revents & POLLIN)
+            break;
+
+        if (ready == 0)
+        {
+            reader_queue_overflow(reader, reader_now());
+            continue;
+        }
+
+        if (fds[0].revents & (POLLERR | POLLNVAL))
+        {
+            reader_fail(reader, EIO);
+            break;
+        }
+
+        if ((fds[0].revents & POLLIN) && !reader_drain(reader))
+        {
+            reader_fail(reader, errno);
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+/* Start a thread reading inotify events from FD into a ring of CAPACITY
+   events, which is rounded up to a power of two. */
+bool
+reader_start(reader_t *reader, int fd, size_t capacity)
+{
+    assert(reader);
+    assert(capacity > 0);
+
+    size_t slots = 1;
+
+    while (slots < capacity)
+        slots *= 2;
+
+    reader->fd = fd;
+    reader->capacity = slots;
+    reader->slots = xmalloc(sizeof(reader_event_t) * slots);
+    reader->buf = NULL;
+    reader->bufsize = 0;
+    reader->lost = false;
+    reader->started = false;
+
+    atomic_init(&reader->head, 0);
+    atomic_init(&reader->tail, 0);
+    atomic_init(&reader->received, 0);
+    atomic_init(&reader->dropped, 0);
+    atomic_init(&reader->highwater, 0);
+    atomic_init(&reader->overflows, 0);
+    atomic_init(&reader->pending_max, 0);
+    atomic_init(&reader->error, 0);
+    histogram_init(&reader->read_sizes);
+
+    reader->notify_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    reader->stop_fd = eventfd(0, EFD_CLOEXEC);
+
+    if (reader->notify_fd == -1 || reader->stop_fd == -1)
+        return false;
+
+    if (pthread_create(&reader->thread, NULL, &reader_main, reader) != 0)
+        return false;
+
+    reader->started = true;
+    return true;
+}
+
+/* Returns the oldest queued event, or NULL if there is none. The event
+   stays valid until reader_pop(). */
+reader_event_t *
+reader_peek(reader_t *reader)
+{
+    size_t head = atomic_load_explicit(&reader->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&reader->tail, memory_order_acquire);
+
+    if (head == tail)
+        return NULL;
+
+    return &reader->slots[head & (reader->capacity - 1)];
+}
+
+/* Remove the oldest queued event. */
+void
+reader_pop(reader_t *reader)
+{
+    size_t head = atomic_load_explicit(&reader->head, memory_order_relaxed);
+
+    atomic_store_explicit(&reader->head, head + 1, memory_order_release);
+}
+
+/* Stop the thread and release the ring. Events still queued are lost. */
+void
+reader_stop(reader_t *reader)
+{
+    if (reader->started)
+    {
+        uint64_t one = 1;
+
+        if (write(reader->stop_fd, &one, sizeof one) == sizeof one)
+            pthread_join(reader->thread, NULL);
+
+        reader->started = false;
+    }
+
+    if (reader->notify_fd != -1)
+        close(reader->notify_fd);
+
+    if (reader->stop_fd != -1)
+        close(reader->stop_fd);
+
+    reader->notify_fd = reader->stop_fd = -1;
+
+    free(reader->slots);
+    free(reader->buf);
+    reader->slots = NULL;
+    reader->buf = NULL;
+}
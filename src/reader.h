@@ -0,0 +1,95 @@
+/*
+    reader.h -- typedefs and prototypes for reader.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __READER_H__
+#define __READER_H__
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+
+#include "histogram.h"
+
+/* Default number of events the queue can hold. */
+#define READER_CAPACITY 16384
+
+/* An inotify event copied out of the read buffer, with the time it was
+   read. */
+typedef struct
+{
+    uint64_t time; /* Nanoseconds on the monotonic clock. */
+    struct inotify_event event;
+    char name[NAME_MAX + 1]; /* Storage for event.name. */
+} reader_event_t;
+
+/* A thread that does nothing but drain an inotify file descriptor into a
+   single-producer single-consumer ring of events, so that the kernel queue
+   does not overflow while the consumer is busy writing output. The reader
+   writes to NOTIFY_FD, an eventfd, after each batch of events.
+
+   When the ring is full, events are dropped and counted, and a single
+   IN_Q_OVERFLOW event is queued as soon as there is room again, so the
+   consumer sees the loss the same way as a kernel queue overflow.
+   If reading fails, the thread stores the error and writes NOTIFY_FD one
+   last time before it exits. */
+typedef struct
+{
+    int fd;        /* The inotify file descriptor to read from. */
+    int notify_fd; /* Signalled after each batch of events. */
+    int stop_fd;   /* Signalled to stop the thread. */
+    pthread_t thread;
+    bool started;
+    reader_event_t *slots;
+    size_t capacity; /* Number of slots, a power of two. */
+    char *buf;       /* The read buffer, sized by FIONREAD. */
+    size_t bufsize;
+    bool lost; /* Events were dropped since the last overflow event. */
+
+    /* The consumer owns HEAD and the producer owns TAIL. They are kept on
+       separate cache lines so that the threads do not contend on them. */
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+
+    /* Statistics, updated by the reader thread. */
+    _Alignas(64) atomic_uint_fast64_t received;
+    atomic_uint_fast64_t dropped;
+    atomic_size_t highwater;        /* Largest number of events queued. */
+    atomic_uint_fast64_t overflows; /* Overflows of the kernel queue. */
+    atomic_size_t pending_max;      /* Most bytes found in the kernel queue
+                                       by FIONREAD before a read(). */
+    histogram_t read_sizes;         /* Bytes returned by each read(). */
+    atomic_int error; /* The errno of the failure that stopped the thread,
+                         or 0. */
+} reader_t;
+
+__BEGIN_DECLS
+
+bool reader_start(reader_t *reader, int fd, size_t capacity);
+reader_event_t *reader_peek(reader_t *reader);
+void reader_pop(reader_t *reader);
+void reader_stop(reader_t *reader);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,277 @@
+/*
+    record.c -- record inotify events, and read them back.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dirmap.h"
+#include "outbuf.h"
+#include "record.h"
+#include "utils.h"
+
+#define RECORD_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+/* Start a recording in the file at PATH, of the events of SHARDS inotify
+   instances. Returns false with errno set on failure. */
+bool
+recorder_open(recorder_t *recorder, const char *path, size_t shards,
+              bool recursive)
+{
+    record_file_t header = {
+        .version = RECORD_VERSION,
+        .shards = shards,
+        .recursive = recursive,
+    };
+
+    recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (recorder->fd == -1)
+        return false;
+
+    memcpy(header.magic, RECORD_MAGIC, sizeof header.magic);
+    outbuf_init(&recorder->out, recorder->fd, OUTBUF_CAPACITY);
+    outbuf_write(&recorder->out, &header, sizeof header);
+
+    return true;
+}
+
+static void
+recorder_write(recorder_t *recorder, uint16_t type, size_t shard,
+               uint64_t time, const void *data, size_t len,
+               const char *name, size_t namelen, const char *name2,
+               size_t name2len)
+{
+    static const char zeros[8];
+    size_t size = sizeof(record_t) + len + namelen + name2len;
+    record_t record = {
+        .size = RECORD_ALIGN(size),
+        .type = type,
+        .shard = shard,
+        .time = time,
+    };
+
+    outbuf_write(&recorder->out, &record, sizeof record);
+    outbuf_write(&recorder->out, data, len);
+    outbuf_write(&recorder->out, name, namelen);
+    outbuf_write(&recorder->out, name2, name2len);
+    outbuf_write(&recorder->out, zeros, record.size - size);
+}
+
+/* Record that ENTRY was watched by the inotify instance SHARD. Parents must
+   be recorded before their children. */
+void
+recorder_watch(recorder_t *recorder, size_t shard, uint64_t time,
+               const dirmap_entry_t *entry)
+{
+    record_watch_t watch = {
+        .wd = entry->wd,
+        .parent_wd = entry->parent != NULL ? entry->parent->wd : 0,
+        .mask = entry->mask,
+    };
+
+    recorder_write(recorder, RECORD_WATCH, shard, time, &watch, sizeof watch,
+                   entry->name, entry->namelen + 1, NULL, 0);
+}
+
+/* Record EVENT, read from the inotify instance SHARD at TIME. */
+void
+recorder_event(recorder_t *recorder, size_t shard, uint64_t time,
+               const struct inotify_event *event)
+{
+    recorder_write(recorder, RECORD_EVENT, shard, time, event,
+                   sizeof(struct inotify_event), event->name, event->len,
+                   NULL, 0);
+}
+
+/* Record an event synthesized by the watcher of the inotify instance SHARD
+   for NAME, in the directory at DIRPATH watched as WD. */
+void
+recorder_synthesized(recorder_t *recorder, size_t shard, uint64_t time,
+                     uint32_t mask, int wd, const char *dirpath,
+                     const char *name)
+{
+    record_synthesized_t synthesized = {
+        .wd = wd,
+        .mask = mask,
+        .dirlen = strlen(dirpath),
+        .namelen = strlen(name),
+    };
+
+    recorder_write(recorder, RECORD_SYNTHESIZED, shard, time, &synthesized,
+                   sizeof synthesized, dirpath, synthesized.dirlen + 1, name,
+                   synthesized.namelen + 1);
+}
+
+/* Write what is left of the recording, and close it. */
+bool
+recorder_close(recorder_t *recorder)
+{
+    bool ok = outbuf_flush(&recorder->out);
+
+    outbuf_free(&recorder->out);
+
+    if (close(recorder->fd) == -1)
+        ok = false;
+
+    recorder->fd = -1;
+
+    return ok;
+}
+
+/* Map the recording at PATH, to read its records with replay_next().
+   Returns false with errno set on failure, to EINVAL if the file is not a
+   recording. */
+bool
+replay_open(replay_t *replay, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    replay->map = NULL;
+
+    if (fd == -1)
+        return false;
+
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return false;
+    }
+
+    replay->size = st.st_size;
+
+    if (replay->size < sizeof(record_file_t))
+    {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    replay->map = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (replay->map == MAP_FAILED)
+    {
+        replay->map = NULL;
+        return false;
+    }
+
+    replay->header = replay->map;
+    replay->offset = sizeof(record_file_t);
+
+    if (memcmp(replay->header->magic, RECORD_MAGIC,
+               sizeof replay->header->magic)
+            != 0
+        || replay->header->version != RECORD_VERSION
+        || replay->header->shards == 0)
+    {
+        replay_close(replay);
+        errno = EINVAL;
+        return false;
+    }
+
+    /* The records are read in order, once. */
+    madvise(replay->map, replay->size, MADV_SEQUENTIAL);
+
+    return true;
+}
+
+/* Returns the next record, or NULL at the end of the recording, with errno
+   set to EINVAL if it ends with a truncated or malformed record. */
+const record_t *
+replay_next(replay_t *replay)
+{
+    size_t left = replay->size - replay->offset;
+    const record_t *record
+        = (const record_t *) ((const char *) replay->map + replay->offset);
+
+    errno = 0;
+
+    if (left == 0)
+        return NULL;
+
+    if (left < sizeof(record_t) || record->size > left
+        || record->size < sizeof(record_t) || record->size % 8 != 0
+        || record->shard >= replay->header->shards)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    size_t len = record->size - sizeof(record_t);
+
+    if (record->type == RECORD_EVENT)
+    {
+        const struct inotify_event *event = (const void *) (record + 1);
+
+        if (len < sizeof(struct inotify_event)
+            || event->len > len - sizeof(struct inotify_event))
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    else if (record->type == RECORD_WATCH)
+    {
+        if (len <= sizeof(record_watch_t)
+            || memchr((const char *) (record + 1) + sizeof(record_watch_t),
+                      '\0', len - sizeof(record_watch_t))
+                   == NULL)
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    else if (record->type == RECORD_SYNTHESIZED)
+    {
+        const record_synthesized_t *synthesized = (const void *) (record + 1);
+        const char *dirpath = (const char *) (synthesized + 1);
+
+        if (len < sizeof(record_synthesized_t)
+            || (uint64_t) synthesized->dirlen + synthesized->namelen + 2
+                   > len - sizeof(record_synthesized_t)
+            || dirpath[synthesized->dirlen] != '\0'
+            || dirpath[synthesized->dirlen + 1 + synthesized->namelen] != '\0')
+        {
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+
+    replay->offset += record->size;
+
+    return record;
+}
+
+void
+replay_close(replay_t *replay)
+{
+    if (replay->map != NULL)
+        munmap(replay->map, replay->size);
+
+    replay->map = NULL;
+}
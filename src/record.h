@@ -0,0 +1,119 @@
+/*
+    record.h -- typedefs and prototypes for record.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+
+#include "dirmap.h"
+#include "outbuf.h"
+
+#define RECORD_MAGIC "DIRREC\0\0"
+#define RECORD_VERSION 1
+
+/* Header of a recording. It is followed by records, each 8-byte aligned.
+   Fields are in host byte order. */
+typedef struct
+{
+    char magic[8];      /* RECORD_MAGIC. */
+    uint32_t version;   /* RECORD_VERSION. */
+    uint32_t shards;    /* Number of inotify instances. */
+    uint32_t recursive; /* Whether new directories were watched. */
+    uint32_t reserved;
+} record_file_t;
+
+/* Types of the records. */
+enum
+{
+    RECORD_WATCH = 1,      /* A directory was watched. */
+    RECORD_EVENT = 2,      /* An inotify event was read. */
+    RECORD_SYNTHESIZED = 3 /* An event was synthesized by the watcher. */
+};
+
+/* Header of a record. A RECORD_EVENT is followed by the inotify_event as
+   read from the kernel, name included. A RECORD_WATCH is followed by a
+   record_watch_t, and a RECORD_SYNTHESIZED by a record_synthesized_t. */
+typedef struct
+{
+    uint32_t size;  /* Size of the whole record, padding included. */
+    uint16_t type;  /* RECORD_WATCH or RECORD_EVENT. */
+    uint16_t shard; /* The inotify instance the record belongs to. */
+    uint64_t time;  /* CLOCK_MONOTONIC time, in nanoseconds. */
+} record_t;
+
+/* A directory that was watched, followed by its name, NUL-terminated. */
+typedef struct
+{
+    int32_t wd;
+    int32_t parent_wd; /* Watch of its parent, or 0 for a root, whose name
+                          is its full path. */
+    uint32_t mask;     /* Events watched for, on roots. */
+    uint32_t reserved;
+} record_watch_t;
+
+/* An event synthesized by the watcher, followed by the path of its
+   directory and its name, both NUL-terminated. */
+typedef struct
+{
+    int32_t wd; /* Watch of the directory, or -1 if it is polled. */
+    uint32_t mask;
+    uint32_t dirlen;  /* Length of the path of the directory. */
+    uint32_t namelen; /* Length of the name. */
+} record_synthesized_t;
+
+/* A recording being written. */
+typedef struct
+{
+    int fd;
+    outbuf_t out;
+} recorder_t;
+
+/* A recording being read, mapped in memory. */
+typedef struct
+{
+    void *map;
+    size_t size;
+    size_t offset; /* Of the next record. */
+    const record_file_t *header;
+} replay_t;
+
+__BEGIN_DECLS
+
+bool recorder_open(recorder_t *recorder, const char *path, size_t shards,
+                   bool recursive);
+void recorder_watch(recorder_t *recorder, size_t shard, uint64_t time,
+                    const dirmap_entry_t *entry);
+void recorder_event(recorder_t *recorder, size_t shard, uint64_t time,
+                    const struct inotify_event *event);
+void recorder_synthesized(recorder_t *recorder, size_t shard, uint64_t time,
+                          uint32_t mask, int wd, const char *dirpath,
+                          const char *name);
+bool recorder_close(recorder_t *recorder);
+
+bool replay_open(replay_t *replay, const char *path);
+const record_t *replay_next(replay_t *replay);
+void replay_close(replay_t *replay);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,413 @@
+/*
+    snapshot.c -- record and compare the entries of directories.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+#include "utils.h"
+
+/* A directory modified less than this many nanoseconds before it was read
+   may be modified again without its mtime changing, on filesystems with
+   coarse timestamps. Its mtime is then not trusted. */
+#define SNAPSHOT_RACY_NSEC 1000000000LL
+
+static int64_t
+snapshot_timespec(const struct timespec *ts)
+{
+    return (int64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+static int64_t
+snapshot_dir_mtime(const struct stat *st)
+{
+    struct timespec now;
+
+    if (st == NULL || clock_gettime(CLOCK_REALTIME, &now) == -1)
+        return SNAPSHOT_UNKNOWN;
+
+    int64_t mtime = snapshot_timespec(&st->st_mtim);
+
+    if (snapshot_timespec(&now) - mtime < SNAPSHOT_RACY_NSEC)
+        return SNAPSHOT_UNKNOWN;
+
+    return mtime;
+}
+
+/* Create an empty snapshot of a directory with the status ST, which may be
+   NULL if it is not known. */
+snapshot_t *
+snapshot_new(const struct stat *st)
+{
+    snapshot_t *snapshot = xmalloc(sizeof(snapshot_t));
+
+    snapshot->mtime = snapshot_dir_mtime(st);
+    snapshot->entries = NULL;
+    snapshot->count = 0;
+    snapshot->capacity = 0;
+    snapshot->names = NULL;
+    snapshot->names_size = 0;
+    snapshot->names_capacity = 0;
+    snapshot->names_garbage = 0;
+    snapshot->sorted = true;
+
+    return snapshot;
+}
+
+const char *
+snapshot_name(const snapshot_t *snapshot, const snapshot_entry_t *entry)
+{
+    return snapshot->names + entry->name;
+}
+
+static uint32_t
+snapshot_add_name(snapshot_t *snapshot, const char *name)
+{
+    size_t len = strlen(name) + 1;
+
+    if (snapshot->names_size + len > snapshot->names_capacity)
+    {
+        size_t capacity
+            = snapshot->names_capacity == 0 ? 64 : snapshot->names_capacity;
+
+        while (snapshot->names_size + len > capacity)
+            capacity *= 2;
+
+        snapshot->names = xrealloc(snapshot->names, capacity);
+        snapshot->names_capacity = capacity;
+    }
+
+    uint32_t offset = snapshot->names_size;
+
+    memcpy(snapshot->names + offset, name, len);
+    snapshot->names_size += len;
+
+    return offset;
+}
+
+/* Rebuild the pool of names without the names of removed entries. */
+static void
+snapshot_compact(snapshot_t *snapshot)
+{
+    char *names = xmalloc(snapshot->names_size - snapshot->names_garbage + 1);
+    uint32_t size = 0;
+
+    for (uint32_t i = 0; i < snapshot->count; i++)
+    {
+        const char *name = snapshot_name(snapshot, &snapshot->entries[i]);
+        size_t len = strlen(name) + 1;
+
+        memcpy(names + size, name, len);
+        snapshot->entries[i].name = size;
+        size += len;
+    }
+
+    free(snapshot->names);
+    snapshot->names = names;
+    snapshot->names_size = size;
+    snapshot->names_capacity = size + 1;
+    snapshot->names_garbage = 0;
+}
+
+static snapshot_entry_t *
+snapshot_reserve(snapshot_t *snapshot)
+{
+    if (snapshot->count == snapshot->capacity)
+    {
+        snapshot->capacity
+            = snapshot->capacity == 0 ? 8 : snapshot->capacity * 2;
+        snapshot->entries = xrealloc(snapshot->entries,
+                                     sizeof(snapshot_entry_t)
+                                         * snapshot->capacity);
+    }
+
+    return &snapshot->entries[snapshot->count];
+}
+
+static void
+snapshot_set_stat(snapshot_entry_t *entry, const struct stat *st)
+{
+    entry->mtime = st == NULL ? SNAPSHOT_UNKNOWN
+                              : snapshot_timespec(&st->st_mtim);
+    entry->size = st == NULL ? 0 : (uint64_t) st->st_size;
+}
+
+/* Add an entry while building a snapshot. ST may be NULL if the status of
+   the entry is not known. Call snapshot_sort() once all entries were
+   added. */
+void
+snapshot_append(snapshot_t *snapshot, const char *name, unsigned char type,
+                uint64_t ino, const struct stat *st)
+{
+    snapshot_entry_t *entry = snapshot_reserve(snapshot);
+
+    entry->ino = ino;
+    entry->type = type;
+    snapshot_set_stat(entry, st);
+    entry->name = snapshot_add_name(snapshot, name);
+    snapshot->count++;
+    snapshot->sorted = false;
+}
+
+static int
+snapshot_compare(const void *a, const void *b, void *data)
+{
+    const snapshot_t *snapshot = data;
+
+    return strcmp(snapshot_name(snapshot, a), snapshot_name(snapshot, b));
+}
+
+void
+snapshot_sort(snapshot_t *snapshot)
+{
+    if (!snapshot->sorted)
+        qsort_r(snapshot->entries, snapshot->count, sizeof(snapshot_entry_t),
+                &snapshot_compare, snapshot);
+
+    snapshot->sorted = true;
+}
+
+/* Read the directory open as FD. If STATS is true, the modification time
+   and size of every entry are recorded too. Returns NULL with errno set on
+   failure. */
+snapshot_t *
+snapshot_read(int fd, bool stats)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == -1)
+        return NULL;
+
+    int dupfd = dup(fd);
+    DIR *dir = dupfd == -1 ? NULL : fdopendir(dupfd);
+
+    if (dir == NULL)
+    {
+        if (dupfd != -1)
+            close(dupfd);
+
+        return NULL;
+    }
+
+    /* The directory stream shares its offset with FD. */
+    rewinddir(dir);
+
+    snapshot_t *snapshot = snapshot_new(&st);
+    struct dirent *dirent;
+
+    while ((dirent = readdir(dir)) != NULL)
+    {
+        if (STREQ(dirent->d_name, ".") || STREQ(dirent->d_name, ".."))
+            continue;
+
+        unsigned char type = dirent->d_type;
+        struct stat entry_st;
+        bool have_st = false;
+
+        if (stats || type == DT_UNKNOWN)
+        {
+            have_st = fstatat(fd, dirent->d_name, &entry_st,
+                              AT_SYMLINK_NOFOLLOW)
+                      == 0;
+
+            if (!have_st && errno == ENOENT)
+                continue;
+
+            if (have_st && type == DT_UNKNOWN)
+                type = IFTODT(entry_st.st_mode);
+        }
+
+        snapshot_append(snapshot, dirent->d_name, type, dirent->d_ino,
+                        stats && have_st ? &entry_st : NULL);
+    }
+
+    closedir(dir);
+    snapshot_sort(snapshot);
+
+    return snapshot;
+}
+
+/* Returns the index of the first entry not less than NAME. */
+static uint32_t
+snapshot_lower_bound(snapshot_t *snapshot, const char *name)
+{
+    uint32_t low = 0;
+    uint32_t high = snapshot->count;
+
+    assert(snapshot->sorted);
+
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+
+        if (strcmp(snapshot_name(snapshot, &snapshot->entries[mid]), name) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+snapshot_entry_t *
+snapshot_find(snapshot_t *snapshot, const char *name)
+{
+    uint32_t i = snapshot_lower_bound(snapshot, name);
+
+    if (i < snapshot->count
+        && STREQ(snapshot_name(snapshot, &snapshot->entries[i]), name))
+        return &snapshot->entries[i];
+
+    return NULL;
+}
+
+/* Record that NAME was created or changed, without reading its status. An
+   entry with an unknown status is never reported as modified by
+   snapshot_diff(). */
+void
+snapshot_insert(snapshot_t *snapshot, const char *name, unsigned char type)
+{
+    uint32_t i = snapshot_lower_bound(snapshot, name);
+    snapshot_entry_t *entry;
+
+    if (i == snapshot->count
+        || !STREQ(snapshot_name(snapshot, &snapshot->entries[i]), name))
+    {
+        snapshot_reserve(snapshot);
+        entry = &snapshot->entries[i];
+        memmove(entry + 1, entry,
+                sizeof(snapshot_entry_t) * (snapshot->count - i));
+        entry->name = snapshot_add_name(snapshot, name);
+        snapshot->count++;
+    }
+    else
+        entry = &snapshot->entries[i];
+
+    entry->ino = 0;
+    entry->type = type;
+    snapshot_set_stat(entry, NULL);
+}
+
+/* Record that NAME was removed. */
+void
+snapshot_remove(snapshot_t *snapshot, const char *name)
+{
+    snapshot_entry_t *entry = snapshot_find(snapshot, name);
+
+    if (entry == NULL)
+        return;
+
+    snapshot->names_garbage += strlen(name) + 1;
+    memmove(entry, entry + 1,
+            sizeof(snapshot_entry_t)
+                * (snapshot->count - (entry - snapshot->entries) - 1));
+    snapshot->count--;
+
+    if (snapshot->names_garbage > snapshot->names_size / 2)
+        snapshot_compact(snapshot);
+}
+
+static uint32_t
+snapshot_event_mask(uint32_t mask, const snapshot_entry_t *entry)
+{
+    return mask | (entry->type == DT_DIR ? IN_ISDIR : 0);
+}
+
+/* Call CALLBACK for every difference between the snapshots OLD and NEW of
+   a directory: IN_CREATE for new entries, IN_DELETE for removed ones, both
+   for entries replaced by another file, and IN_MODIFY for entries with a
+   different modification time, when both times are known. */
+void
+snapshot_diff(const snapshot_t *old, const snapshot_t *new,
+              snapshot_diff_callback_t callback, void *data)
+{
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    assert(old->sorted && new->sorted);
+
+    while (i < old->count || j < new->count)
+    {
+        const snapshot_entry_t *a = i < old->count ? &old->entries[i] : NULL;
+        const snapshot_entry_t *b = j < new->count ? &new->entries[j] : NULL;
+        int cmp = a == NULL   ? 1
+                  : b == NULL ? -1
+                              : strcmp(snapshot_name(old, a),
+                                       snapshot_name(new, b));
+
+        if (cmp < 0)
+        {
+            callback(snapshot_event_mask(IN_DELETE, a), snapshot_name(old, a),
+                     a->type, data);
+            i++;
+        }
+        else if (cmp > 0)
+        {
+            callback(snapshot_event_mask(IN_CREATE, b), snapshot_name(new, b),
+                     b->type, data);
+            j++;
+        }
+        else
+        {
+            const char *name = snapshot_name(new, b);
+
+            if ((a->ino != 0 && b->ino != 0 && a->ino != b->ino)
+                || (a->type == DT_DIR) != (b->type == DT_DIR))
+            {
+                callback(snapshot_event_mask(IN_DELETE, a), name, a->type,
+                         data);
+                callback(snapshot_event_mask(IN_CREATE, b), name, b->type,
+                         data);
+            }
+            else if (a->mtime != SNAPSHOT_UNKNOWN
+                     && b->mtime != SNAPSHOT_UNKNOWN && a->mtime != b->mtime)
+                callback(snapshot_event_mask(IN_MODIFY, b), name, b->type,
+                         data);
+
+            i++;
+            j++;
+        }
+    }
+}
+
+void
+snapshot_free(snapshot_t *snapshot)
+{
+    if (snapshot == NULL)
+        return;
+
+    free(snapshot->entries);
+    free(snapshot->names);
+    free(snapshot);
+}
@@ -0,0 +1,85 @@
+/*
+    snapshot.h -- typedefs and prototypes for snapshot.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* Modification time of an entry or a directory that is not known. */
+#define SNAPSHOT_UNKNOWN INT64_MIN
+
+/* An entry of a directory. Names are stored in the pool of the snapshot,
+   so that an entry takes 32 bytes. */
+typedef struct
+{
+    uint64_t ino;
+    int64_t mtime; /* Nanoseconds since the epoch, or SNAPSHOT_UNKNOWN. */
+    uint64_t size;
+    uint32_t name; /* Offset of the name in the pool. */
+    uint8_t type;  /* DT_* type. */
+} snapshot_entry_t;
+
+/* The entries of a directory at some point in time, sorted by name. The
+   modification times and sizes of entries are only recorded if stats were
+   requested when reading the directory. */
+typedef struct
+{
+    int64_t mtime; /* Of the directory, or SNAPSHOT_UNKNOWN if it changed
+                      since the snapshot was taken. */
+    snapshot_entry_t *entries;
+    uint32_t count;
+    uint32_t capacity;
+    char *names;
+    uint32_t names_size;     /* Bytes used in the pool. */
+    uint32_t names_capacity; /* Bytes allocated for the pool. */
+    uint32_t names_garbage;  /* Bytes of names of removed entries. */
+    bool sorted;
+} snapshot_t;
+
+/* Called by snapshot_diff() for every difference, with the inotify event
+   that describes it. */
+typedef void (*snapshot_diff_callback_t)(uint32_t mask, const char *name,
+                                         unsigned char type, void *data);
+
+__BEGIN_DECLS
+
+snapshot_t *snapshot_new(const struct stat *st);
+snapshot_t *snapshot_read(int fd, bool stats);
+void snapshot_append(snapshot_t *snapshot, const char *name,
+                     unsigned char type, uint64_t ino,
+                     const struct stat *st);
+void snapshot_sort(snapshot_t *snapshot);
+snapshot_entry_t *snapshot_find(snapshot_t *snapshot, const char *name);
+const char *snapshot_name(const snapshot_t *snapshot,
+                          const snapshot_entry_t *entry);
+void snapshot_insert(snapshot_t *snapshot, const char *name,
+                     unsigned char type);
+void snapshot_remove(snapshot_t *snapshot, const char *name);
+void snapshot_diff(const snapshot_t *old, const snapshot_t *new,
+                   snapshot_diff_callback_t callback, void *data);
+void snapshot_free(snapshot_t *snapshot);
+
+__END_DECLS
+
+#endif
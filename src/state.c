@@ -0,0 +1,657 @@
+/*
+    state.c -- save the watched tree, and find what changed meanwhile.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "dirmap.h"
+#include "outbuf.h"
+#include "snapshot.h"
+#include "state.h"
+#include "utils.h"
+#include "watcher.h"
+
+#define STATE_ALIGN(n) (((n) + 7) & ~(size_t) 7)
+
+/* What became of a saved directory, found while diffing. */
+enum
+{
+    STATE_UNSEEN,
+    STATE_SEEN,   /* Still in the tree. */
+    STATE_REMOVED /* Removed, along with everything in it. */
+};
+
+/* A directory to save. */
+typedef struct
+{
+    char *path;
+    snapshot_t *snapshot;
+    uint64_t ino;
+} state_item_t;
+
+/* The directory being diffed, for the callback of snapshot_diff(). */
+typedef struct
+{
+    watcher_t *watcher;
+    int wd;
+    const char *path;
+} state_diff_t;
+
+static int
+state_item_compare(const void *a, const void *b)
+{
+    return strcmp(((const state_item_t *) a)->path,
+                  ((const state_item_t *) b)->path);
+}
+
+static const char *
+state_dir_path(const state_dir_t *dir)
+{
+    return (const char *) (dir + 1);
+}
+
+/* Build a snapshot in VIEW that reads the entries of DIR in place. */
+static void
+state_dir_view(const state_dir_t *dir, snapshot_t *view)
+{
+    const char *entries = state_dir_path(dir) + STATE_ALIGN(dir->pathlen + 1);
+
+    view->mtime = dir->mtime;
+    view->entries = (snapshot_entry_t *) entries;
+    view->count = view->capacity = dir->count;
+    view->names = (char *) entries + sizeof(snapshot_entry_t) * dir->count;
+    view->names_size = view->names_capacity = dir->names_size;
+    view->names_garbage = 0;
+    view->sorted = true;
+}
+
+/* Record the inodes of the entries added from events, and with STATS, the
+   modification times and sizes of the entries changed since they were
+   read, so that the saved snapshot matches the directory at PATH. */
+static void
+state_refresh(snapshot_t *snapshot, const char *path, bool stats)
+{
+    int fd = -1;
+
+    for (uint32_t i = 0; i < snapshot->count; i++)
+    {
+        snapshot_entry_t *entry = &snapshot->entries[i];
+        struct stat st;
+
+        if (entry->ino != 0 && (!stats || entry->mtime != SNAPSHOT_UNKNOWN))
+            continue;
+
+        if (fd == -1)
+            fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd == -1)
+            return;
+
+        if (fstatat(fd, snapshot_name(snapshot, entry), &st,
+                    AT_SYMLINK_NOFOLLOW)
+            == -1)
+            continue;
+
+        entry->ino = st.st_ino;
+
+        if (stats)
+        {
+            entry->mtime = (int64_t) st.st_mtim.tv_sec * 1000000000
+                           + st.st_mtim.tv_nsec;
+            entry->size = st.st_size;
+        }
+    }
+
+    if (fd != -1)
+        close(fd);
+}
+
+/* Returns the inode of the watched directory ENTRY, from the snapshot of
+   its parent when there is one. */
+static uint64_t
+state_entry_ino(watcher_t *watcher, dirmap_entry_t *entry, const char *path)
+{
+    struct stat st;
+
+    if (entry->parent != NULL && entry->parent->data != NULL)
+    {
+        snapshot_entry_t *e = snapshot_find(entry->parent->data, entry->name);
+
+        if (e != NULL && e->ino != 0)
+            return e->ino;
+    }
+
+    return lstat(path, &st) == 0 ? st.st_ino : 0;
+}
+
+static void
+state_add_item(state_item_t **items, size_t *count, size_t *capacity,
+               const char *path, snapshot_t *snapshot, uint64_t ino)
+{
+    if (*count == *capacity)
+    {
+        *capacity = *capacity == 0 ? 256 : *capacity * 2;
+        *items = xrealloc(*items, sizeof(state_item_t) * *capacity);
+    }
+
+    state_item_t *item = &(*items)[(*count)++];
+
+    item->path = xmalloc(strlen(path) + 1);
+    strcpy(item->path, path);
+    item->snapshot = snapshot;
+    item->ino = ino;
+}
+
+/* Write the record of ITEM, and return its size. */
+static size_t
+state_write_dir(outbuf_t *out, const state_item_t *item)
+{
+    static const char zeros[8];
+    snapshot_t *snapshot = item->snapshot;
+    size_t pathlen = strlen(item->path);
+    size_t names = STATE_ALIGN(snapshot->names_size);
+    state_dir_t dir = {
+        .size = sizeof dir + STATE_ALIGN(pathlen + 1)
+                + sizeof(snapshot_entry_t) * snapshot->count + names,
+        .pathlen = pathlen,
+        .ino = item->ino,
+        .mtime = snapshot->mtime,
+        .count = snapshot->count,
+        .names_size = snapshot->names_size,
+    };
+
+    outbuf_write(out, &dir, sizeof dir);
+    outbuf_write(out, item->path, pathlen);
+    outbuf_write(out, zeros, STATE_ALIGN(pathlen + 1) - pathlen);
+
+    for (uint32_t i = 0; i < snapshot->count; i++)
+    {
+        snapshot_entry_t entry;
+
+        /* The padding is written as zeros. */
+        memset(&entry, 0, sizeof entry);
+        entry.ino = snapshot->entries[i].ino;
+        entry.mtime = snapshot->entries[i].mtime;
+        entry.size = snapshot->entries[i].size;
+        entry.name = snapshot->entries[i].name;
+        entry.type = snapshot->entries[i].type;
+        outbuf_write(out, &entry, sizeof entry);
+    }
+
+    outbuf_write(out, snapshot->names, snapshot->names_size);
+    outbuf_write(out, zeros, names - snapshot->names_size);
+
+    return dir.size;
+}
+
+/* Save the snapshots of the directories of the COUNT WATCHERS to the file
+   at PATH, which is replaced at once. Snapshots are sorted and brought up
+   to date first. Returns false with errno set on failure. */
+bool
+state_save(const char *path, watcher_t **watchers, size_t count)
+{
+    state_item_t *items = NULL;
+    size_t itemcount = 0;
+    size_t capacity = 0;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        watcher_t *watcher = watchers[i];
+        dirmap_t *map = &watcher->dirmap;
+
+        for (size_t j = 0; j < map->capacity; j++)
+        {
+            dirmap_entry_t *entry = map->by_wd[j];
+
+            if (entry == NULL || entry->data == NULL)
+                continue;
+
+            const char *dirpath = watcher_path(watcher, entry);
+
+            snapshot_sort(entry->data);
+            state_refresh(entry->data, dirpath, watcher->snapshot_stats);
+            state_add_item(&items, &itemcount, &capacity, dirpath,
+                           entry->data,
+                           state_entry_ino(watcher, entry, dirpath));
+        }
+
+        for (size_t j = 0; j < watcher->polledcount; j++)
+        {
+            watcher_polled_t *polled = &watcher->polled[j];
+            struct stat st;
+
+            if (polled->path == NULL || polled->snapshot == NULL)
+                continue;
+
+            snapshot_sort(polled->snapshot);
+            state_refresh(polled->snapshot, polled->path,
+                          watcher->snapshot_stats);
+            state_add_item(&items, &itemcount, &capacity, polled->path,
+                           polled->snapshot,
+                           lstat(polled->path, &st) == 0 ? st.st_ino : 0);
+        }
+    }
+
+    qsort(items, itemcount, sizeof(state_item_t), &state_item_compare);
+
+    char *tmppath = xmalloc(strlen(path) + 5);
+
+    sprintf(tmppath, "%s.tmp", path);
+
+    int fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd != -1;
+
+    if (ok)
+    {
+        outbuf_t out;
+        state_header_t header = {
+            .version = STATE_VERSION,
+            .entry_size = sizeof(snapshot_entry_t),
+            .count = itemcount,
+            .size = sizeof header,
+        };
+
+        memcpy(header.magic, STATE_MAGIC, sizeof header.magic);
+
+        for (size_t i = 0; i < itemcount; i++)
+        {
+            size_t pathlen = strlen(items[i].path);
+
+            header.size += sizeof(state_dir_t) + STATE_ALIGN(pathlen + 1)
+                           + sizeof(snapshot_entry_t) * items[i].snapshot->count
+                           + STATE_ALIGN(items[i].snapshot->names_size);
+        }
+
+        outbuf_init(&out, fd, OUTBUF_CAPACITY);
+        outbuf_write(&out, &header, sizeof header);
+
+        for (size_t i = 0; i < itemcount; i++)
+            state_write_dir(&out, &items[i]);
+
+        /* A write that failed midway leaves the file short. */
+        struct stat st;
+
+        ok = outbuf_flush(&out) && fstat(fd, &st) == 0
+             && (uint64_t) st.st_size == header.size && fsync(fd) == 0;
+        outbuf_free(&out);
+
+        int saved_errno = errno;
+
+        if (close(fd) == -1 && ok)
+        {
+            saved_errno = errno;
+            ok = false;
+        }
+
+        if (ok && rename(tmppath, path) == -1)
+        {
+            saved_errno = errno;
+            ok = false;
+        }
+
+        if (!ok)
+            unlink(tmppath);
+
+        errno = saved_errno;
+    }
+
+    for (size_t i = 0; i < itemcount; i++)
+        free(items[i].path);
+
+    free(items);
+    free(tmppath);
+
+    return ok;
+}
+
+static int
+state_dir_compare(const void *a, const void *b)
+{
+    return strcmp(state_dir_path(*(const state_dir_t **) a),
+                  state_dir_path(*(const state_dir_t **) b));
+}
+
+/* Map the state file at PATH, and check that it is well formed. Returns
+   false with errno set on failure, to ENOENT if there is no such file and
+   to EINVAL if it is not a valid state file. */
+bool
+state_load(state_t *state, const char *path)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    state->map = NULL;
+    state->dirs = NULL;
+    state->marks = NULL;
+    state->count = 0;
+
+    if (fd == -1)
+        return false;
+
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        return false;
+    }
+
+    state->size = st.st_size;
+
+    if (state->size < sizeof(state_header_t))
+    {
+        close(fd);
+        errno = EINVAL;
+        return false;
+    }
+
+    state->map = mmap(NULL, state->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (state->map == MAP_FAILED)
+    {
+        state->map = NULL;
+        return false;
+    }
+
+    const state_header_t *header = state->map;
+
+    if (memcmp(header->magic, STATE_MAGIC, sizeof header->magic) != 0
+        || header->version != STATE_VERSION
+        || header->entry_size != sizeof(snapshot_entry_t)
+        || header->size != state->size
+        || header->count > state->size / sizeof(state_dir_t))
+    {
+        state_free(state);
+        errno = EINVAL;
+        return false;
+    }
+
+    state->count = header->count;
+    state->dirs = xmalloc(sizeof(state_dir_t *) * (state->count + 1));
+    state->marks = xmalloc(state->count + 1);
+    memset(state->marks, STATE_UNSEEN, state->count + 1);
+
+    size_t offset = sizeof(state_header_t);
+
+    for (size_t i = 0; i < state->count; i++)
+    {
+        const state_dir_t *dir
+            = (const state_dir_t *) ((const char *) state->map + offset);
+
+        if (state->size - offset < sizeof(state_dir_t)
+            || dir->size > state->size - offset
+            || dir->size
+                   != sizeof(state_dir_t) + STATE_ALIGN(dir->pathlen + 1)
+                          + sizeof(snapshot_entry_t) * (size_t) dir->count
+                          + STATE_ALIGN(dir->names_size)
+            || state_dir_path(dir)[dir->pathlen] != '\0')
+        {
+            state_free(state);
+            errno = EINVAL;
+            return false;
+        }
+
+        /* Names must end inside the pool. */
+        snapshot_t view;
+
+        state_dir_view(dir, &view);
+
+        for (uint32_t j = 0; j < view.count; j++)
+        {
+            if (view.entries[j].name >= view.names_size
+                || memchr(view.names + view.entries[j].name, '\0',
+                          view.names_size - view.entries[j].name)
+                       == NULL)
+            {
+                state_free(state);
+                errno = EINVAL;
+                return false;
+            }
+        }
+
+        state->dirs[i] = dir;
+        offset += dir->size;
+    }
+
+    /* Saved sorted, but nothing relies on it. */
+    qsort(state->dirs, state->count, sizeof(state_dir_t *),
+          &state_dir_compare);
+
+    return true;
+}
+
+/* Returns the index of the directory at PATH, or -1 if it was not saved. */
+static ssize_t
+state_find(state_t *state, const char *path)
+{
+    size_t low = 0;
+    size_t high = state->count;
+
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(path, state_dir_path(state->dirs[mid]));
+
+        if (cmp == 0)
+            return mid;
+
+        if (cmp < 0)
+            high = mid;
+        else
+            low = mid + 1;
+    }
+
+    return -1;
+}
+
+/* Returns the index of the parent of the directory at PATH, or -1 if it
+   was not saved. */
+static ssize_t
+state_find_parent(state_t *state, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL)
+        return -1;
+
+    size_t len = slash == path ? 1 : slash - path;
+    char *parent = xmalloc(len + 1);
+
+    memcpy(parent, path, len);
+    parent[len] = '\0';
+
+    ssize_t i = state_find(state, parent);
+
+    free(parent);
+
+    return i;
+}
+
+static void
+state_on_diff(uint32_t mask, const char *name, unsigned char type,
+              void *data)
+{
+    state_diff_t *diff = data;
+    watcher_t *watcher = diff->watcher;
+
+    watcher->on_synthesized(watcher, mask, diff->wd, diff->path, name);
+}
+
+/* Report the differences between the saved directory I, or an empty one if
+   I is -1, and the snapshot NEW of the directory at PATH. A directory with
+   another inode was replaced, and all of its entries changed. */
+static void
+state_diff_dir(state_t *state, ssize_t i, snapshot_t *new, uint64_t ino,
+               watcher_t *watcher, int wd, const char *path)
+{
+    state_diff_t diff = { .watcher = watcher, .wd = wd, .path = path };
+    snapshot_t empty = { .mtime = SNAPSHOT_UNKNOWN, .sorted = true };
+    snapshot_t old;
+
+    if (i == -1)
+    {
+        snapshot_diff(&empty, new, &state_on_diff, &diff);
+        return;
+    }
+
+    state->marks[i] = STATE_SEEN;
+    state_dir_view(state->dirs[i], &old);
+
+    if (state->dirs[i]->ino != 0 && ino != 0 && state->dirs[i]->ino != ino)
+    {
+        snapshot_diff(&old, &empty, &state_on_diff, &diff);
+        snapshot_diff(&empty, new, &state_on_diff, &diff);
+    }
+    else
+        snapshot_diff(&old, new, &state_on_diff, &diff);
+}
+
+/* Report the differences in the directory ENTRY and below it. If KNOWN is
+   true, its parent was saved or is new, so it is reported whole if it was
+   not saved. */
+static void
+state_diff_tree(state_t *state, watcher_t *watcher, dirmap_entry_t *entry,
+                bool known)
+{
+    const char *dirpath = watcher_path(watcher, entry);
+    char *path = xmalloc(strlen(dirpath) + 1);
+
+    strcpy(path, dirpath);
+
+    ssize_t i = state_find(state, path);
+
+    if (entry->data != NULL && (i != -1 || known))
+    {
+        snapshot_sort(entry->data);
+        state_diff_dir(state, i, entry->data,
+                       i == -1 ? 0 : state_entry_ino(watcher, entry, path),
+                       watcher, entry->wd, path);
+        known = true;
+    }
+    else
+        known = false;
+
+    free(path);
+
+    for (dirmap_entry_t *child = entry->children; child != NULL;
+         child = child->next)
+        state_diff_tree(state, watcher, child, known);
+}
+
+/* Report, as the callbacks for synthesized events of the COUNT WATCHERS
+   would, the changes made to their trees since STATE was saved: entries
+   created, deleted, replaced or modified, and the contents of directories
+   created or removed meanwhile. Directories whose parent was not saved
+   either, such as new roots, are left out. */
+void
+state_diff(state_t *state, watcher_t **watchers, size_t count)
+{
+    assert(count > 0);
+
+    for (size_t i = 0; i < count; i++)
+    {
+        watcher_t *watcher = watchers[i];
+
+        if (watcher->on_synthesized == NULL)
+            continue;
+
+        for (size_t j = 0; j < watcher->dirmap.capacity; j++)
+        {
+            dirmap_entry_t *root = watcher->dirmap.by_wd[j];
+
+            if (root == NULL || root->parent != NULL)
+                continue;
+
+            state_diff_tree(state, watcher, root,
+                            state_find_parent(state, root->name) != -1);
+        }
+
+        for (size_t j = 0; j < watcher->polledcount; j++)
+        {
+            watcher_polled_t *polled = &watcher->polled[j];
+            ssize_t k;
+            struct stat st;
+
+            if (polled->path == NULL || polled->snapshot == NULL)
+                continue;
+
+            k = state_find(state, polled->path);
+
+            if (k == -1 && state_find_parent(state, polled->path) == -1)
+                continue;
+
+            snapshot_sort(polled->snapshot);
+            state_diff_dir(state, k, polled->snapshot,
+                           lstat(polled->path, &st) == 0 ? st.st_ino : 0,
+                           watcher, -1, polled->path);
+        }
+    }
+
+    /* The saved directories that are gone were reported as deleted by the
+       diff of their parent, or are below such a directory. Parents sort
+       before their children. */
+    for (size_t i = 0; i < state->count && watchers[0]->on_synthesized != NULL;
+         i++)
+    {
+        const char *path = state_dir_path(state->dirs[i]);
+        ssize_t parent;
+        struct stat st;
+
+        if (state->marks[i] != STATE_UNSEEN)
+            continue;
+
+        parent = state_find_parent(state, path);
+
+        if (parent == -1 || state->marks[parent] == STATE_UNSEEN
+            || (lstat(path, &st) == 0 && S_ISDIR(st.st_mode)))
+            continue;
+
+        state->marks[i] = STATE_REMOVED;
+
+        snapshot_t old;
+        snapshot_t empty = { .mtime = SNAPSHOT_UNKNOWN, .sorted = true };
+        state_diff_t diff = { .watcher = watchers[0], .wd = -1, .path = path };
+
+        state_dir_view(state->dirs[i], &old);
+        snapshot_diff(&old, &empty, &state_on_diff, &diff);
+    }
+}
+
+void
+state_free(state_t *state)
+{
+    if (state->map != NULL)
+        munmap(state->map, state->size);
+
+    free(state->dirs);
+    free(state->marks);
+    state->map = NULL;
+    state->dirs = NULL;
+    state->marks = NULL;
+    state->count = 0;
+}
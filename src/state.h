@@ -0,0 +1,76 @@
+/*
+    state.h -- typedefs and prototypes for state.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __STATE_H__
+#define __STATE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "watcher.h"
+
+#define STATE_MAGIC "DIRSTATE"
+#define STATE_VERSION 1
+
+/* Header of a state file. It is followed by COUNT directory records,
+   sorted by path. Fields are in host byte order, and every record is
+   8-byte aligned, so the file is used in place once mapped. */
+typedef struct
+{
+    char magic[8];       /* STATE_MAGIC, without the NUL. */
+    uint32_t version;    /* STATE_VERSION. */
+    uint32_t entry_size; /* sizeof(snapshot_entry_t). */
+    uint64_t count;      /* Number of directories. */
+    uint64_t size;       /* Size of the whole file. */
+} state_header_t;
+
+/* A directory in a state file. It is followed by its path, NUL-terminated
+   and padded to 8 bytes, then by the COUNT entries of its snapshot, sorted
+   by name, and by the pool of their names, padded to 8 bytes. */
+typedef struct
+{
+    uint32_t size;       /* Size of the whole record. */
+    uint32_t pathlen;    /* Length of the path, without the NUL. */
+    uint64_t ino;        /* Inode of the directory, or 0 if unknown. */
+    int64_t mtime;       /* As in snapshot_t. */
+    uint32_t count;      /* Number of entries. */
+    uint32_t names_size; /* Size of the pool of names. */
+} state_dir_t;
+
+/* A state file mapped in memory. */
+typedef struct
+{
+    void *map;
+    size_t size;
+    const state_dir_t **dirs; /* The records, sorted by path. */
+    size_t count;
+    uint8_t *marks; /* What became of each directory, while diffing. */
+} state_t;
+
+__BEGIN_DECLS
+
+bool state_save(const char *path, watcher_t **watchers, size_t count);
+bool state_load(state_t *state, const char *path);
+void state_diff(state_t *state, watcher_t **watchers, size_t count);
+void state_free(state_t *state);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,225 @@
+/*
+    throttle.c -- limit the rate and I/O priority of filesystem traversals.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "throttle.h"
+
+/* glibc does not provide a wrapper nor the constants for ioprio_set(2). */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_PRIO_VALUE(class, data) (((class) << IOPRIO_CLASS_SHIFT) | data)
+
+/* Weight of the latest sample in the moving average of the latency. */
+#define THROTTLE_LATENCY_WEIGHT 0.125
+
+/* Bounds of the extra delay added by the adaptive mode, in seconds. */
+#define THROTTLE_MIN_DELAY 0.0005
+#define THROTTLE_MAX_DELAY 1.0
+
+static double
+timespec_diff(const struct timespec *end, const struct timespec *start)
+{
+    return (end->tv_sec - start->tv_sec)
+           + (end->tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+throttle_sleep(double seconds)
+{
+    struct timespec ts;
+
+    ts.tv_sec = (time_t) seconds;
+    ts.tv_nsec = (long) ((seconds - ts.tv_sec) * 1e9);
+
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+void
+throttle_init(throttle_t *throttle, double rate, double latency_threshold)
+{
+    assert(throttle);
+
+    throttle->rate = rate;
+    /* Allow short bursts of up to 50ms worth of operations, so that
+       directories with many small entries do not sleep on every stat. */
+    throttle->burst = rate / 20 < 1 ? 1 : rate / 20;
+    throttle->tokens = throttle->burst;
+    throttle->latency_threshold = latency_threshold;
+    throttle->latency = 0;
+    throttle->delay = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &throttle->refilled);
+}
+
+bool
+throttle_enabled(throttle_t *throttle)
+{
+    return throttle->rate > 0 || throttle->latency_threshold > 0;
+}
+
+/* Called right before a throttled operation. Sleeps until the bucket has a
+   token for the operation and the adaptive delay has passed. */
+void
+throttle_begin(throttle_t *throttle)
+{
+    if (!throttle_enabled(throttle))
+        return;
+
+    if (throttle->delay > 0)
+        throttle_sleep(throttle->delay);
+
+    if (throttle->rate > 0)
+    {
+        struct timespec now;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        throttle->tokens
+            += timespec_diff(&now, &throttle->refilled) * throttle->rate;
+        throttle->refilled = now;
+
+        if (throttle->tokens > throttle->burst)
+            throttle->tokens = throttle->burst;
+
+        if (throttle->tokens < 1)
+        {
+            throttle_sleep((1 - throttle->tokens) / throttle->rate);
+            clock_gettime(CLOCK_MONOTONIC, &throttle->refilled);
+            throttle->tokens = 1;
+        }
+
+        throttle->tokens -= 1;
+    }
+
+    if (throttle->latency_threshold > 0)
+        clock_gettime(CLOCK_MONOTONIC, &throttle->started);
+}
+
+/* Called right after a throttled operation. In adaptive mode, the latency of
+   the operation is folded into the moving average and the extra delay is
+   doubled while the average is above the threshold, or halved otherwise.
+   Slow syscalls usually mean the disk is busy serving someone else. */
+void
+throttle_end(throttle_t *throttle)
+{
+    struct timespec now;
+
+    if (throttle->latency_threshold <= 0)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    throttle->latency
+        += (timespec_diff(&now, &throttle->started) - throttle->latency)
+           * THROTTLE_LATENCY_WEIGHT;
+
+    if (throttle->latency > throttle->latency_threshold)
+    {
+        throttle->delay = throttle->delay < THROTTLE_MIN_DELAY
+                              ? THROTTLE_MIN_DELAY
+                              : throttle->delay * 2;
+
+        if (throttle->delay > THROTTLE_MAX_DELAY)
+            throttle->delay = THROTTLE_MAX_DELAY;
+    }
+    else if (throttle->delay > 0)
+    {
+        throttle->delay /= 2;
+
+        if (throttle->delay < THROTTLE_MIN_DELAY)
+            throttle->delay = 0;
+    }
+}
+
+/* Parse an I/O priority in the form of CLASS[:LEVEL], where CLASS is one of
+   `realtime', `best-effort' or `idle' (or 1, 2 and 3 like ionice(1)) and
+   LEVEL is 0-7. */
+bool
+throttle_parse_ioprio(const char *input, ioprio_class_t *class, int *level)
+{
+    const char *colon = strchr(input, ':');
+    size_t len = colon == NULL ? strlen(input) : (size_t) (colon - input);
+
+    if ((len == 8 && strncmp(input, "realtime", len) == 0)
+        || (len == 1 && input[0] == '1'))
+        *class = THROTTLE_IOPRIO_RT;
+    else if ((len == 11 && strncmp(input, "best-effort", len) == 0)
+             || (len == 1 && input[0] == '2'))
+        *class = THROTTLE_IOPRIO_BE;
+    else if ((len == 4 && strncmp(input, "idle", len) == 0)
+             || (len == 1 && input[0] == '3'))
+        *class = THROTTLE_IOPRIO_IDLE;
+    else
+        return false;
+
+    *level = *class == THROTTLE_IOPRIO_IDLE ? 0 : 7;
+
+    if (colon != NULL)
+    {
+        char *end;
+        long value = strtol(colon + 1, &end, 10);
+
+        if (*end != '\0' || end == colon + 1 || value < 0 || value > 7)
+            return false;
+
+        *level = (int) value;
+    }
+
+    return true;
+}
+
+/* Parse a rate or a latency threshold, which must be a finite number
+   greater than 0, with nothing after it. */
+bool
+throttle_parse_value(const char *input, double *value)
+{
+    char *end;
+
+    errno = 0;
+    *value = strtod(input, &end);
+
+    return errno == 0 && end != input && *end == '\0' && isfinite(*value)
+           && *value > 0;
+}
+
+/* Set the I/O scheduling class and level of the calling process. */
+bool
+throttle_set_ioprio(ioprio_class_t class, int level)
+{
+#ifdef SYS_ioprio_set
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                   IOPRIO_PRIO_VALUE(class, level))
+           == 0;
+#else
+    errno = ENOSYS;
+    return false;
+#endif
+}
@@ -0,0 +1,69 @@
+/*
+    throttle.h -- typedefs and prototypes for throttle.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __THROTTLE_H__
+#define __THROTTLE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+
+#define THROTTLE_INIT                                                         \
+    {                                                                         \
+        .rate = 0, .latency_threshold = 0                                     \
+    }
+
+/* A token bucket limiting the rate of filesystem operations, optionally
+   combined with an adaptive delay that grows while the measured latency
+   of the operations stays above a threshold. */
+typedef struct
+{
+    double rate;              /* Operations per second, 0 for unlimited. */
+    double burst;             /* Size of the bucket in operations. */
+    double tokens;            /* Tokens currently in the bucket. */
+    struct timespec refilled; /* When the bucket was last refilled. */
+    double latency_threshold; /* In seconds, 0 disables the adaptive mode. */
+    double latency;           /* Moving average of operation latency. */
+    double delay;             /* Extra delay added by the adaptive mode. */
+    struct timespec started;  /* Start of the current operation. */
+} throttle_t;
+
+/* I/O scheduling classes accepted by throttle_set_ioprio(). */
+typedef enum
+{
+    THROTTLE_IOPRIO_RT = 1,
+    THROTTLE_IOPRIO_BE,
+    THROTTLE_IOPRIO_IDLE
+} ioprio_class_t;
+
+__BEGIN_DECLS
+
+void throttle_init(throttle_t *throttle, double rate,
+                   double latency_threshold);
+bool throttle_enabled(throttle_t *throttle);
+void throttle_begin(throttle_t *throttle);
+void throttle_end(throttle_t *throttle);
+bool throttle_parse_ioprio(const char *input, ioprio_class_t *class,
+                           int *level);
+bool throttle_parse_value(const char *input, double *value);
+bool throttle_set_ioprio(ioprio_class_t class, int level);
+
+__END_DECLS
+
+#endif
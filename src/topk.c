@@ -0,0 +1,295 @@
+/*
+    topk.c -- heavy hitters of a stream with a count-min sketch.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "topk.h"
+#include "utils.h"
+
+void
+topk_init(topk_t *topk, size_t capacity)
+{
+    assert(topk);
+    assert(capacity > 0);
+
+    topk->sketch = xmalloc(sizeof(uint32_t) * TOPK_DEPTH * TOPK_WIDTH);
+    topk->heap = xmalloc(sizeof(topk_item_t) * capacity);
+    topk->size = 0;
+    topk->capacity = capacity;
+
+    /* At most half full, so probes stay short. */
+    topk->index_capacity = 16;
+
+    while (topk->index_capacity < capacity * 2)
+        topk->index_capacity *= 2;
+
+    topk->index = xmalloc(sizeof(uint32_t) * topk->index_capacity);
+    topk_reset(topk);
+}
+
+/* Count WEIGHT more occurrences of the key of HASH, and return its
+   estimated count. Only the counters at the minimum are incremented
+   (conservative update), which keeps the overestimates lower. */
+static uint32_t
+topk_sketch_add(topk_t *topk, uint64_t hash, uint32_t weight)
+{
+    uint32_t *counters[TOPK_DEPTH];
+    uint32_t min = UINT32_MAX;
+    uint64_t step = (hash >> 32) | 1;
+
+    for (size_t i = 0; i < TOPK_DEPTH; i++)
+    {
+        counters[i] = &topk->sketch[i * TOPK_WIDTH
+                                    + (hash + i * step) % TOPK_WIDTH];
+
+        if (*counters[i] < min)
+            min = *counters[i];
+    }
+
+    uint32_t estimate = min > UINT32_MAX - weight ? UINT32_MAX : min + weight;
+
+    for (size_t i = 0; i < TOPK_DEPTH; i++)
+        if (*counters[i] < estimate)
+            *counters[i] = estimate;
+
+    return estimate;
+}
+
+/* Find the index slot of the key of HASH, or the empty slot where it would
+   go. */
+static size_t
+topk_index_slot(topk_t *topk, uint64_t hash, const char *key, size_t len)
+{
+    size_t mask = topk->index_capacity - 1;
+    size_t i = hash & mask;
+
+    while (topk->index[i] != 0)
+    {
+        topk_item_t *item = &topk->heap[topk->index[i] - 1];
+
+        if (item->hash == hash && strncmp(item->key, key, len) == 0
+            && item->key[len] == '\0')
+            break;
+
+        i = (i + 1) & mask;
+    }
+
+    return i;
+}
+
+/* Remove slot I from the index by shifting back the slots that follow it
+   in the same probe sequence. */
+static void
+topk_index_delete(topk_t *topk, size_t i)
+{
+    size_t mask = topk->index_capacity - 1;
+    size_t j = i;
+
+    while (true)
+    {
+        j = (j + 1) & mask;
+
+        if (topk->index[j] == 0)
+            break;
+
+        size_t home = topk->heap[topk->index[j] - 1].hash & mask;
+
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            topk->index[i] = topk->index[j];
+            i = j;
+        }
+    }
+
+    topk->index[i] = 0;
+}
+
+/* Find the index slot pointing to POS of the heap. */
+static size_t
+topk_index_find(topk_t *topk, size_t pos)
+{
+    size_t mask = topk->index_capacity - 1;
+    size_t i = topk->heap[pos].hash & mask;
+
+    while (topk->index[i] != pos + 1)
+        i = (i + 1) & mask;
+
+    return i;
+}
+
+/* Swap two items of the heap, and the index slots pointing to them. */
+static void
+topk_swap(topk_t *topk, size_t a, size_t b)
+{
+    size_t slot_a = topk_index_find(topk, a);
+    size_t slot_b = topk_index_find(topk, b);
+    topk_item_t item = topk->heap[a];
+
+    topk->heap[a] = topk->heap[b];
+    topk->heap[b] = item;
+    topk->index[slot_a] = b + 1;
+    topk->index[slot_b] = a + 1;
+}
+
+/* Restore the heap order below POS, after the count at POS grew. */
+static void
+topk_sift_down(topk_t *topk, size_t pos)
+{
+    while (true)
+    {
+        size_t smallest = pos;
+        size_t left = pos * 2 + 1;
+        size_t right = left + 1;
+
+        if (left < topk->size
+            && topk->heap[left].count < topk->heap[smallest].count)
+            smallest = left;
+
+        if (right < topk->size
+            && topk->heap[right].count < topk->heap[smallest].count)
+            smallest = right;
+
+        if (smallest == pos)
+            break;
+
+        topk_swap(topk, pos, smallest);
+        pos = smallest;
+    }
+}
+
+static void
+topk_sift_up(topk_t *topk, size_t pos)
+{
+    while (pos > 0)
+    {
+        size_t parent = (pos - 1) / 2;
+
+        if (topk->heap[parent].count <= topk->heap[pos].count)
+            break;
+
+        topk_swap(topk, pos, parent);
+        pos = parent;
+    }
+}
+
+/* Count WEIGHT occurrences of the first LEN bytes of KEY. */
+void
+topk_add(topk_t *topk, const char *key, size_t len, uint32_t weight)
+{
+    uint64_t hash = hash64(key, len, 0);
+    uint32_t estimate = topk_sketch_add(topk, hash, weight);
+    size_t slot = topk_index_slot(topk, hash, key, len);
+
+    topk->total += weight;
+
+    if (topk->index[slot] != 0)
+    {
+        size_t pos = topk->index[slot] - 1;
+
+        topk->heap[pos].count = estimate;
+        topk_sift_down(topk, pos);
+        return;
+    }
+
+    topk_item_t *item;
+
+    if (topk->size < topk->capacity)
+    {
+        item = &topk->heap[topk->size++];
+        item->key = NULL;
+    }
+    else if (estimate > topk->heap[0].count)
+    {
+        /* The smallest heavy hitter makes room for the new one. */
+        item = &topk->heap[0];
+        topk_index_delete(topk, topk_index_find(topk, 0));
+        slot = topk_index_slot(topk, hash, key, len);
+    }
+    else
+        return;
+
+    item->key = xrealloc(item->key, len + 1);
+    memcpy(item->key, key, len);
+    item->key[len] = '\0';
+    item->hash = hash;
+    item->count = estimate;
+
+    size_t pos = item - topk->heap;
+
+    topk->index[slot] = pos + 1;
+
+    if (pos == 0 && topk->size == topk->capacity)
+        topk_sift_down(topk, 0);
+    else
+        topk_sift_up(topk, pos);
+}
+
+static int
+topk_compare(const void *a, const void *b)
+{
+    const topk_item_t *ia = a;
+    const topk_item_t *ib = b;
+
+    if (ia->count != ib->count)
+        return ia->count > ib->count ? -1 : 1;
+
+    return strcmp(ia->key, ib->key);
+}
+
+/* Sort the heavy hitters by decreasing count, and return them. This breaks
+   the heap, so topk_reset() must be called before adding more keys. */
+topk_item_t *
+topk_sort(topk_t *topk)
+{
+    qsort(topk->heap, topk->size, sizeof(topk_item_t), &topk_compare);
+    return topk->heap;
+}
+
+/* Forget all the counts, to start a new interval. */
+void
+topk_reset(topk_t *topk)
+{
+    for (size_t i = 0; i < topk->size; i++)
+        free(topk->heap[i].key);
+
+    memset(topk->sketch, 0, sizeof(uint32_t) * TOPK_DEPTH * TOPK_WIDTH);
+    memset(topk->index, 0, sizeof(uint32_t) * topk->index_capacity);
+    topk->size = 0;
+    topk->total = 0;
+}
+
+void
+topk_free(topk_t *topk)
+{
+    for (size_t i = 0; i < topk->size; i++)
+        free(topk->heap[i].key);
+
+    free(topk->sketch);
+    free(topk->heap);
+    free(topk->index);
+    topk->sketch = NULL;
+    topk->heap = NULL;
+    topk->index = NULL;
+    topk->size = topk->capacity = topk->index_capacity = 0;
+}
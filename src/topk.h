@@ -0,0 +1,63 @@
+/*
+    topk.h -- typedefs and prototypes for topk.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __TOPK_H__
+#define __TOPK_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Rows and columns of the count-min sketch. */
+#define TOPK_DEPTH 4
+#define TOPK_WIDTH 4096
+
+/* A key tracked as a heavy hitter, with its estimated count. */
+typedef struct
+{
+    char *key;
+    uint64_t hash;
+    uint32_t count;
+} topk_item_t;
+
+/* Finds the keys seen most often in a stream, in fixed memory. Counts are
+   estimated with a count-min sketch, which may overestimate them but never
+   underestimates them, and the keys with the highest estimates are kept in
+   a min-heap of CAPACITY items, so the smallest one is replaced first. */
+typedef struct
+{
+    uint32_t *sketch; /* TOPK_DEPTH rows of TOPK_WIDTH counters. */
+    topk_item_t *heap;
+    size_t size;
+    size_t capacity;
+    uint32_t *index; /* Heap positions plus one, by hash of the key. */
+    size_t index_capacity;
+    uint64_t total; /* Sum of the weights added. */
+} topk_t;
+
+__BEGIN_DECLS
+
+void topk_init(topk_t *topk, size_t capacity);
+void topk_add(topk_t *topk, const char *key, size_t len, uint32_t weight);
+topk_item_t *topk_sort(topk_t *topk);
+void topk_reset(topk_t *topk);
+void topk_free(topk_t *topk);
+
+__END_DECLS
+
+#endif
@@ -0,0 +1,1603 @@
+/*
+    watcher.c -- maintain inotify watches on directory trees.
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "dirmap.h"
+#include "dirwalk.h"
+#include "exclude.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "watcher.h"
+
+#define INOTIFY_MAX_USER_WATCHES_FILE "/proc/sys/fs/inotify/max_user_watches"
+
+/* Events needed to keep the tree up to date in recursive mode. */
+#define WATCHER_TREE_EVENTS (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO)
+
+/* State of a crawl adding watches below a directory. FRAMES holds the
+   entries of the directories from the crawl root down to the current
+   one. */
+typedef struct
+{
+    watcher_t *watcher;
+    dirmap_entry_t **frames;
+    size_t frames_capacity;
+    bool synthesize;
+    bool failed;
+} watcher_crawl_t;
+
+/* A directory waiting to be read by a worker of a parallel crawl. ENTRY is
+   already watched and in the tree. */
+typedef struct watcher_job
+{
+    struct watcher_job *next;
+    dirmap_entry_t *entry;
+    char *path;
+} watcher_job_t;
+
+/* A subdirectory watched by a worker, waiting to be added to the tree. */
+typedef struct
+{
+    const char *name;
+    char *path;
+    int wd;
+} watcher_found_t;
+
+/* State shared by the workers of a parallel crawl. The tree and JOBS are
+   protected by LOCK. */
+typedef struct
+{
+    watcher_t *watcher;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    watcher_job_t *jobs;
+    size_t pending; /* Directories queued or being read. */
+    watcher_job_t *over; /* Directories found over the budget, to be polled
+                            once the crawl is done. */
+    bool failed;
+    int error;
+} watcher_pcrawl_t;
+
+/* A directory being compared with its snapshot after a queue overflow, or
+   when polled. DIR is NULL for polled directories. */
+typedef struct
+{
+    watcher_t *watcher;
+    dirmap_entry_t *dir;
+    const char *path;
+} watcher_rescan_t;
+
+/* A subtree whose watches are being given up. */
+typedef struct
+{
+    watcher_t *watcher;
+    dirmap_entry_t *top;
+} watcher_evict_t;
+
+static bool watcher_crawl(watcher_t *watcher, dirmap_entry_t *entry,
+                          bool synthesize);
+static void watcher_forget(dirmap_entry_t *entry, void *data);
+
+static int
+watcher_get_max_watches()
+{
+    FILE *fp = fopen(INOTIFY_MAX_USER_WATCHES_FILE, "r");
+
+    if (fp == NULL)
+        return -1;
+
+    int max_watches;
+
+    if (fscanf(fp, "%d", &max_watches) != 1)
+        max_watches = -1;
+
+    fclose(fp);
+
+    return max_watches;
+}
+
+/* The mask of the watches of a tree whose root watches MASK. */
+static uint32_t
+watcher_kernel_mask(watcher_t *watcher, uint32_t mask)
+{
+    return mask | (watcher->recursive ? WATCHER_TREE_EVENTS : 0);
+}
+
+/* Whether the directory NAME inside PARENT matches the exclusion patterns.
+   The path is built here rather than with watcher_path(), since the
+   workers of a parallel crawl call this concurrently. */
+static bool
+watcher_excluded(watcher_t *watcher, dirmap_entry_t *parent, const char *name)
+{
+    if (!watcher->exclude->paths)
+        return exclude_match(watcher->exclude, name);
+
+    char path[PATH_MAX];
+    size_t len = strlen(name);
+
+    if (len + 1 > sizeof path)
+        return false;
+
+    size_t pos = sizeof path - 1 - len;
+
+    path[sizeof path - 1] = '\0';
+    memcpy(path + pos, name, len);
+
+    for (dirmap_entry_t *e = parent; e != NULL; e = e->parent)
+    {
+        bool slash = e->namelen == 0 || e->name[e->namelen - 1] != '/';
+
+        if (e->namelen + slash > pos)
+            return false;
+
+        if (slash)
+            path[--pos] = '/';
+
+        pos -= e->namelen;
+        memcpy(path + pos, e->name, e->namelen);
+    }
+
+    return exclude_match(watcher->exclude, path + pos);
+}
+
+/* Whether the directory NAME inside PARENT is watched in recursive mode. */
+static bool
+watcher_wants(watcher_t *watcher, dirmap_entry_t *parent, const char *name)
+{
+    if (watcher->exclude != NULL && watcher_excluded(watcher, parent, name))
+        return false;
+
+    return watcher->filter == NULL || watcher->filter(watcher, parent, name);
+}
+
+/* Whether the directory at PATH, below a polled one, is polled as well. */
+static bool
+watcher_wants_path(watcher_t *watcher, const char *path)
+{
+    return watcher->exclude == NULL || !exclude_match(watcher->exclude, path);
+}
+
+static char *
+watcher_join(const char *dirpath, const char *name)
+{
+    size_t len = strlen(dirpath);
+    char *path = xmalloc(len + strlen(name) + 2);
+
+    strcpy(path, dirpath);
+
+    if (len == 0 || path[len - 1] != '/')
+        strcat(path, "/");
+
+    strcat(path, name);
+
+    return path;
+}
+
+static size_t
+watcher_depth(dirmap_entry_t *entry)
+{
+    size_t depth = 0;
+
+    for (; entry->parent != NULL; entry = entry->parent)
+        depth++;
+
+    return depth;
+}
+
+/* Start polling the directory at PATH, which has no watch, with SNAPSHOT
+   as its last known state. SNAPSHOT is owned by the watcher from now on. */
+static void
+watcher_poll_add(watcher_t *watcher, const char *path, snapshot_t *snapshot,
+                 int parent_wd)
+{
+    if (watcher->polledcount == watcher->polledcapacity)
+    {
+        watcher->polledcapacity = watcher->polledcapacity == 0
+                                      ? 64
+                                      : watcher->polledcapacity * 2;
+        watcher->polled = xrealloc(watcher->polled, sizeof(watcher_polled_t)
+                                                        * watcher->polledcapacity);
+    }
+
+    watcher_polled_t *polled = &watcher->polled[watcher->polledcount++];
+
+    polled->path = xmalloc(strlen(path) + 1);
+    strcpy(polled->path, path);
+    polled->snapshot = snapshot;
+    polled->parent_wd = parent_wd;
+
+    LOG_DEBUG_1(watcher->verbosity, "Polling directory: %s\n", path);
+}
+
+/* Poll the directory at PATH and every directory below it. If SYNTHESIZE is
+   true, a create event is synthesized for every entry found. */
+static void
+watcher_poll_subtree(watcher_t *watcher, const char *path, int parent_wd,
+                     bool synthesize)
+{
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (fd == -1)
+        return;
+
+    snapshot_t *snapshot = snapshot_read(fd, watcher->snapshot_stats);
+
+    close(fd);
+
+    if (snapshot == NULL)
+        return;
+
+    watcher_poll_add(watcher, path, snapshot, parent_wd);
+
+    for (uint32_t i = 0; i < snapshot->count; i++)
+    {
+        snapshot_entry_t *entry = &snapshot->entries[i];
+        const char *name = snapshot_name(snapshot, entry);
+
+        if (synthesize && watcher->on_synthesized != NULL)
+            watcher->on_synthesized(watcher,
+                                    IN_CREATE
+                                        | (entry->type == DT_DIR ? IN_ISDIR
+                                                                 : 0),
+                                    -1, path, name);
+
+        if (entry->type != DT_DIR)
+            continue;
+
+        char *child = watcher_join(path, name);
+
+        if (watcher_wants_path(watcher, child))
+            watcher_poll_subtree(watcher, child, -1, synthesize);
+
+        free(child);
+    }
+}
+
+/* Stop polling the directory at PATH and the ones below it. The records
+   are only marked, and dropped at the end of watcher_poll(). */
+static void
+watcher_unpoll(watcher_t *watcher, const char *dirpath)
+{
+    /* DIRPATH may be the path of one of the records. */
+    size_t len = strlen(dirpath);
+    char *path = xmalloc(len + 1);
+
+    strcpy(path, dirpath);
+
+    for (size_t i = 0; i < watcher->polledcount; i++)
+    {
+        watcher_polled_t *polled = &watcher->polled[i];
+
+        if (polled->path == NULL || strncmp(polled->path, path, len) != 0
+            || (polled->path[len] != '\0' && polled->path[len] != '/'))
+            continue;
+
+        free(polled->path);
+        snapshot_free(polled->snapshot);
+        polled->path = NULL;
+        polled->snapshot = NULL;
+    }
+
+    free(path);
+}
+
+/* Drop the records marked by watcher_unpoll(). */
+static void
+watcher_poll_compact(watcher_t *watcher)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < watcher->polledcount; i++)
+        if (watcher->polled[i].path != NULL)
+            watcher->polled[count++] = watcher->polled[i];
+
+    watcher->polledcount = count;
+}
+
+/* A watched directory was renamed from OLDPATH to NEWPATH: rename the
+   polled directories below it as well. */
+static void
+watcher_poll_rename(watcher_t *watcher, const char *oldpath,
+                    const char *newpath)
+{
+    size_t oldlen = strlen(oldpath);
+
+    for (size_t i = 0; i < watcher->polledcount; i++)
+    {
+        watcher_polled_t *polled = &watcher->polled[i];
+
+        if (polled->path == NULL || strncmp(polled->path, oldpath, oldlen) != 0
+            || polled->path[oldlen] != '/')
+            continue;
+
+        char *path = watcher_join(newpath, polled->path + oldlen + 1);
+
+        free(polled->path);
+        polled->path = path;
+    }
+}
+
+/* Give up the watches of ENTRY while its subtree is removed, and poll it
+   instead. */
+static void
+watcher_evict_one(dirmap_entry_t *entry, void *data)
+{
+    watcher_evict_t *evict = data;
+    watcher_t *watcher = evict->watcher;
+
+    watcher_poll_add(watcher, watcher_path(watcher, entry), entry->data,
+                     entry == evict->top ? entry->parent->wd : -1);
+    entry->data = NULL;
+    watcher_forget(entry, watcher);
+}
+
+/* Make room for a new watch in PARENT. Among the least recently active
+   directories, the deepest one is evicted with its subtree, unless the new
+   directory is not ACTIVE and would be deeper. Roots and the ancestors of
+   the new directory are never evicted. */
+static bool
+watcher_evict(watcher_t *watcher, dirmap_entry_t *parent, bool active)
+{
+    dirmap_entry_t *victim = NULL;
+    size_t victim_depth = 0;
+    size_t depth = parent == NULL ? 0 : watcher_depth(parent) + 1;
+    size_t seen = 0;
+
+    for (dirmap_entry_t *entry = watcher->dirmap.oldest;
+         entry != NULL && seen < WATCHER_EVICT_CANDIDATES;
+         entry = entry->newer, seen++)
+    {
+        if (entry->parent == NULL)
+            continue;
+
+        bool ancestor = false;
+
+        for (dirmap_entry_t *e = parent; e != NULL && !ancestor; e = e->parent)
+            ancestor = e == entry;
+
+        size_t entry_depth = watcher_depth(entry);
+
+        if (!ancestor && (victim == NULL || entry_depth > victim_depth))
+        {
+            victim = entry;
+            victim_depth = entry_depth;
+        }
+    }
+
+    if (victim == NULL || (!active && victim_depth < depth))
+        return false;
+
+    LOG_DEBUG_1(watcher->verbosity, "Evicting directory: %s\n",
+                watcher_path(watcher, victim));
+
+    watcher_evict_t evict = { .watcher = watcher, .top = victim };
+
+    dirmap_remove(&watcher->dirmap, victim, &watcher_evict_one, &evict);
+
+    return true;
+}
+
+const char *
+watcher_path(watcher_t *watcher, dirmap_entry_t *entry)
+{
+    size_t len = dirmap_path(&watcher->dirmap, entry, watcher->pathbuf,
+                             watcher->pathbufsize);
+
+    if (len + 1 > watcher->pathbufsize)
+    {
+        watcher->pathbufsize = len + 1 < 256 ? 256 : (len + 1) * 2;
+        watcher->pathbuf = xrealloc(watcher->pathbuf, watcher->pathbufsize);
+        dirmap_path(&watcher->dirmap, entry, watcher->pathbuf,
+                    watcher->pathbufsize);
+    }
+
+    return watcher->pathbuf;
+}
+
+/* Watch the directory at PATH, named NAME inside PARENT, for the events
+   of the root of PARENT, or for MASK if it is a root. Over the budget,
+   another directory is evicted if possible, which is more likely if the new
+   one is ACTIVE, and ENOBUFS is returned otherwise. */
+static dirmap_entry_t *
+watcher_add_watch(watcher_t *watcher, dirmap_entry_t *parent,
+                  const char *name, const char *path, uint32_t mask,
+                  bool active)
+{
+    if (parent != NULL)
+        mask = parent->root->mask;
+
+    if (watcher->budget > 0 && watcher->watchcount >= watcher->budget
+        && !watcher_evict(watcher, parent, active))
+    {
+        errno = ENOBUFS;
+        return NULL;
+    }
+
+    if (watcher->watchcount >= watcher->max_watches)
+    {
+        errno = ENOBUFS; /* Set error in case if the max limit was
+                            reached. */
+        return NULL;
+    }
+
+    LOG_DEBUG_2(watcher->verbosity, "Attempting to watch directory: %s\n",
+                path);
+
+    int wd = inotify_add_watch(watcher->fd, path,
+                               watcher_kernel_mask(watcher, mask) | IN_ONLYDIR);
+
+    if (wd == -1)
+    {
+        LOG_DEBUG_1(watcher->verbosity, "Failed to watch directory: %s\n",
+                    path);
+        return NULL;
+    }
+
+    size_t size = watcher->dirmap.size;
+    dirmap_entry_t *entry = dirmap_add(&watcher->dirmap, parent, name, wd);
+
+    if (entry == NULL)
+    {
+        LOG_DEBUG_1(watcher->verbosity,
+                    "Failed to add watched directory to map: %s\n", path);
+        inotify_rm_watch(watcher->fd, wd);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (parent == NULL)
+        entry->mask = mask;
+
+    if (watcher->on_watch != NULL)
+        watcher->on_watch(watcher, entry);
+
+    /* The wd may already have been mapped, when the same directory is
+       reached through another path. */
+    if (watcher->dirmap.size > size)
+        watcher->watchcount++;
+
+    LOG_DEBUG_1(watcher->verbosity, "Watching directory: %s\n", path);
+
+    return entry;
+}
+
+static dirwalk_action_t
+watcher_crawl_visit(dirwalk_t *walk, const dirwalk_entry_t *entry)
+{
+    watcher_crawl_t *crawl = walk->data;
+    watcher_t *watcher = crawl->watcher;
+    dirmap_entry_t *parent = crawl->frames[entry->depth - 1];
+
+    if (watcher->snapshots && parent->data != NULL)
+    {
+        struct stat st;
+        bool have_st
+            = watcher->snapshot_stats && dirwalk_stat(walk, entry, &st);
+
+        snapshot_append(parent->data, entry->name, entry->type, entry->ino,
+                        have_st ? &st : NULL);
+    }
+
+    if (crawl->synthesize && watcher->on_synthesized != NULL)
+        watcher->on_synthesized(watcher,
+                                IN_CREATE
+                                    | (entry->type == DT_DIR ? IN_ISDIR : 0),
+                                parent->wd, watcher_path(watcher, parent),
+                                entry->name);
+
+    if (entry->type != DT_DIR || !watcher_wants(watcher, parent, entry->name))
+        return DIRWALK_SKIP;
+
+    dirmap_entry_t *child = watcher_add_watch(
+        watcher, parent, entry->name, entry->path, 0, crawl->synthesize);
+
+    if (child == NULL)
+    {
+        /* The directory may be gone already, which is not an error. */
+        if (errno == ENOENT || errno == ENOTDIR)
+            return DIRWALK_SKIP;
+
+        /* Over the budget, the subtree is polled instead. */
+        if (watcher->budget > 0 && (errno == ENOBUFS || errno == ENOSPC))
+        {
+            watcher_poll_subtree(watcher, entry->path, parent->wd,
+                                 crawl->synthesize);
+            return DIRWALK_SKIP;
+        }
+
+        crawl->failed = true;
+        return DIRWALK_STOP;
+    }
+
+    if (entry->depth >= crawl->frames_capacity)
+    {
+        crawl->frames_capacity *= 2;
+        crawl->frames = xrealloc(crawl->frames, sizeof(dirmap_entry_t *)
+                                                    * crawl->frames_capacity);
+    }
+
+    crawl->frames[entry->depth] = child;
+
+    return DIRWALK_CONTINUE;
+}
+
+/* Start the snapshot of a directory once it is open. */
+static dirwalk_action_t
+watcher_crawl_pre(dirwalk_t *walk, const dirwalk_entry_t *entry)
+{
+    watcher_crawl_t *crawl = walk->data;
+    dirmap_entry_t *dir = crawl->frames[entry->depth];
+    struct stat st;
+
+    snapshot_free(dir->data);
+    dir->data = snapshot_new(fstat(entry->fd, &st) == 0 ? &st : NULL);
+
+    return DIRWALK_CONTINUE;
+}
+
+static dirwalk_action_t
+watcher_crawl_post(dirwalk_t *walk, const dirwalk_entry_t *entry)
+{
+    watcher_crawl_t *crawl = walk->data;
+    dirmap_entry_t *dir = crawl->frames[entry->depth];
+
+    if (dir->data != NULL)
+        snapshot_sort(dir->data);
+
+    return DIRWALK_CONTINUE;
+}
+
+static bool
+watcher_crawl_error(dirwalk_t *walk, const dirwalk_entry_t *entry)
+{
+    watcher_crawl_t *crawl = walk->data;
+
+    LOG_DEBUG_1(crawl->watcher->verbosity, "Recursive watch failed: %s\n",
+                entry->path);
+
+    /* Directories removed during the crawl are skipped. */
+    return errno == ENOENT || errno == ENOTDIR;
+}
+
+static void
+watcher_pcrawl_fail(watcher_pcrawl_t *crawl, int error)
+{
+    if (!crawl->failed)
+    {
+        crawl->failed = true;
+        crawl->error = error;
+    }
+}
+
+/* Read the directory of JOB and watch its subdirectories, without holding
+   the lock. The new watches are returned in FOUND, and the entries of the
+   directory in SNAPSHOT. */
+static bool
+watcher_pcrawl_read(watcher_pcrawl_t *crawl, watcher_job_t *job,
+                    snapshot_t **snapshot, watcher_found_t **found,
+                    size_t *count, size_t *capacity)
+{
+    watcher_t *watcher = crawl->watcher;
+    int fd = open(job->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    *snapshot = NULL;
+    *count = 0;
+
+    if (fd != -1)
+    {
+        *snapshot = snapshot_read(fd, watcher->snapshot_stats);
+
+        if (*snapshot == NULL)
+        {
+            int saved_errno = errno;
+
+            close(fd);
+            errno = saved_errno;
+        }
+        else
+            close(fd);
+    }
+
+    if (*snapshot == NULL)
+    {
+        LOG_DEBUG_1(watcher->verbosity, "Recursive watch failed: %s\n",
+                    job->path);
+
+        /* Directories removed during the crawl are skipped. */
+        return errno == ENOENT || errno == ENOTDIR;
+    }
+
+    size_t len = strlen(job->path);
+    bool slash = len > 0 && job->path[len - 1] == '/';
+
+    for (uint32_t i = 0; i < (*snapshot)->count; i++)
+    {
+        snapshot_entry_t *entry = &(*snapshot)->entries[i];
+        const char *name = snapshot_name(*snapshot, entry);
+
+        if (entry->type != DT_DIR || !watcher_wants(watcher, job->entry, name))
+            continue;
+
+        char *path = xmalloc(len + strlen(name) + 2);
+
+        sprintf(path, slash ? "%s%s" : "%s/%s", job->path, name);
+
+        LOG_DEBUG_2(watcher->verbosity, "Attempting to watch directory: %s\n",
+                    path);
+
+        int wd = inotify_add_watch(
+            watcher->fd, path,
+            watcher_kernel_mask(watcher, job->entry->root->mask) | IN_ONLYDIR);
+
+        if (wd == -1)
+        {
+            int saved_errno = errno;
+
+            LOG_DEBUG_1(watcher->verbosity, "Failed to watch directory: %s\n",
+                        path);
+            free(path);
+
+            if (saved_errno == ENOENT || saved_errno == ENOTDIR)
+                continue;
+
+            errno = saved_errno;
+            return false;
+        }
+
+        if (*count == *capacity)
+        {
+            *capacity = *capacity == 0 ? 64 : *capacity * 2;
+            *found = xrealloc(*found, sizeof(watcher_found_t) * *capacity);
+        }
+
+        (*found)[(*count)++] = (watcher_found_t){
+            .name = name,
+            .path = path,
+            .wd = wd,
+        };
+    }
+
+    return true;
+}
+
+/* Add the subdirectories found in the directory of JOB to the tree, all at
+   once, and queue them to be read. Called with the lock held. */
+static void
+watcher_pcrawl_insert(watcher_pcrawl_t *crawl, watcher_job_t *job,
+                      watcher_found_t *found, size_t count)
+{
+    watcher_t *watcher = crawl->watcher;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        dirmap_entry_t *child = NULL;
+        size_t size = watcher->dirmap.size;
+
+        if (crawl->failed)
+            ;
+        else if (watcher->budget > 0 && watcher->watchcount >= watcher->budget)
+        {
+            watcher_job_t *over = xmalloc(sizeof(watcher_job_t));
+
+            inotify_rm_watch(watcher->fd, found[i].wd);
+            over->entry = job->entry;
+            over->path = found[i].path;
+            over->next = crawl->over;
+            crawl->over = over;
+            continue;
+        }
+        else if (watcher->watchcount >= watcher->max_watches)
+            watcher_pcrawl_fail(crawl, ENOBUFS);
+        else if ((child = dirmap_add(&watcher->dirmap, job->entry,
+                                     found[i].name, found[i].wd))
+                 == NULL)
+            watcher_pcrawl_fail(crawl, ENOMEM);
+
+        if (child == NULL)
+        {
+            inotify_rm_watch(watcher->fd, found[i].wd);
+            free(found[i].path);
+            continue;
+        }
+
+        if (watcher->on_watch != NULL)
+            watcher->on_watch(watcher, child);
+
+        /* The wd may already have been mapped, when the same directory is
+           reached through another path, which is not read again. */
+        if (watcher->dirmap.size == size)
+        {
+            free(found[i].path);
+            continue;
+        }
+
+        watcher->watchcount++;
+
+        LOG_DEBUG_1(watcher->verbosity, "Watching directory: %s\n",
+                    found[i].path);
+
+        watcher_job_t *next = xmalloc(sizeof(watcher_job_t));
+
+        next->entry = child;
+        next->path = found[i].path;
+        next->next = crawl->jobs;
+        crawl->jobs = next;
+        crawl->pending++;
+    }
+}
+
+static void *
+watcher_pcrawl_worker(void *arg)
+{
+    watcher_pcrawl_t *crawl = arg;
+    watcher_found_t *found = NULL;
+    size_t capacity = 0;
+
+    pthread_mutex_lock(&crawl->lock);
+
+    while (true)
+    {
+        while (crawl->jobs == NULL && crawl->pending > 0 && !crawl->failed)
+            pthread_cond_wait(&crawl->changed, &crawl->lock);
+
+        if (crawl->jobs == NULL || crawl->failed)
+            break;
+
+        watcher_job_t *job = crawl->jobs;
+
+        crawl->jobs = job->next;
+        pthread_mutex_unlock(&crawl->lock);
+
+        snapshot_t *snapshot;
+        size_t count;
+        bool ok = watcher_pcrawl_read(crawl, job, &snapshot, &found, &count,
+                                      &capacity);
+        int error = errno;
+
+        pthread_mutex_lock(&crawl->lock);
+
+        if (!ok)
+            watcher_pcrawl_fail(crawl, error);
+
+        watcher_pcrawl_insert(crawl, job, found, count);
+
+        if (crawl->watcher->snapshots && snapshot != NULL)
+        {
+            snapshot_free(job->entry->data);
+            job->entry->data = snapshot;
+        }
+        else
+            snapshot_free(snapshot);
+
+        crawl->pending--;
+        pthread_cond_broadcast(&crawl->changed);
+
+        free(job->path);
+        free(job);
+    }
+
+    pthread_mutex_unlock(&crawl->lock);
+    free(found);
+
+    return NULL;
+}
+
+/* Add watches to every directory below ENTRY on the worker threads. Each
+   worker reads a directory and adds watches to its subdirectories on its
+   own, since inotify_add_watch() can be called concurrently on the same
+   inotify instance, then adds them to the tree at once. */
+static bool
+watcher_crawl_parallel(watcher_t *watcher, dirmap_entry_t *entry)
+{
+    watcher_pcrawl_t crawl = {
+        .watcher = watcher,
+        .jobs = xmalloc(sizeof(watcher_job_t)),
+        .pending = 1,
+        .over = NULL,
+        .failed = false,
+        .error = 0,
+    };
+
+    crawl.jobs->next = NULL;
+    crawl.jobs->entry = entry;
+    const char *path = watcher_path(watcher, entry);
+
+    crawl.jobs->path = xmalloc(strlen(path) + 1);
+    strcpy(crawl.jobs->path, path);
+
+    pthread_mutex_init(&crawl.lock, NULL);
+    pthread_cond_init(&crawl.changed, NULL);
+
+    pthread_t *threads = xmalloc(sizeof(pthread_t) * watcher->jobs);
+    int started = 0;
+
+    for (; started < watcher->jobs; started++)
+    {
+        if (pthread_create(&threads[started], NULL, &watcher_pcrawl_worker,
+                           &crawl)
+            != 0)
+            break;
+    }
+
+    /* If no thread could be started, do the work on this one. */
+    if (started == 0)
+        watcher_pcrawl_worker(&crawl);
+
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+
+    /* Jobs are left over when the crawl failed. */
+    while (crawl.jobs != NULL)
+    {
+        watcher_job_t *job = crawl.jobs;
+
+        crawl.jobs = job->next;
+        free(job->path);
+        free(job);
+    }
+
+    /* The workers are done with the tree, so the directories over the
+       budget can be read on this thread. */
+    while (crawl.over != NULL)
+    {
+        watcher_job_t *job = crawl.over;
+
+        crawl.over = job->next;
+
+        if (!crawl.failed)
+            watcher_poll_subtree(watcher, job->path, job->entry->wd, false);
+
+        free(job->path);
+        free(job);
+    }
+
+    pthread_cond_destroy(&crawl.changed);
+    pthread_mutex_destroy(&crawl.lock);
+
+    errno = crawl.error;
+
+    return !crawl.failed;
+}
+
+/* Add watches to every directory below ENTRY. If SYNTHESIZE is true, a
+   create event is synthesized for every entry found, which is only done
+   on this thread. */
+static bool
+watcher_crawl(watcher_t *watcher, dirmap_entry_t *entry, bool synthesize)
+{
+    if (watcher->jobs > 1 && !synthesize)
+        return watcher_crawl_parallel(watcher, entry);
+
+    watcher_crawl_t crawl = {
+        .watcher = watcher,
+        .frames = xmalloc(sizeof(dirmap_entry_t *) * 16),
+        .frames_capacity = 16,
+        .synthesize = synthesize,
+        .failed = false,
+    };
+
+    dirwalk_t walk = DIRWALK_INIT;
+
+    walk.visit = &watcher_crawl_visit;
+    walk.error = &watcher_crawl_error;
+
+    if (watcher->snapshots)
+    {
+        walk.pre = &watcher_crawl_pre;
+        walk.post = &watcher_crawl_post;
+    }
+    walk.data = &crawl;
+
+    crawl.frames[0] = entry;
+
+    bool ok = dirwalk_run(&walk, watcher_path(watcher, entry)) && !crawl.failed;
+    int saved_errno = errno;
+
+    dirwalk_free(&walk);
+    free(crawl.frames);
+    errno = saved_errno;
+
+    return ok;
+}
+
+static void
+watcher_free_snapshot(void *data)
+{
+    snapshot_free(data);
+}
+
+bool
+watcher_init(watcher_t *watcher, uint32_t mask, bool recursive)
+{
+    assert(watcher);
+
+    watcher->mask = mask;
+    watcher->recursive = recursive;
+    watcher->watchcount = 0;
+    watcher->movecount = 0;
+    watcher->snapshots = false;
+    watcher->snapshot_stats = false;
+    watcher->jobs = 1;
+    watcher->budget = 0;
+    watcher->exclude = NULL;
+    watcher->polled = NULL;
+    watcher->polledcount = 0;
+    watcher->polledcapacity = 0;
+    watcher->filter = NULL;
+    watcher->on_synthesized = NULL;
+    watcher->on_watch = NULL;
+    watcher->offline = false;
+    watcher->now = 0;
+    watcher->pathbuf = NULL;
+    watcher->pathbufsize = 0;
+    dirmap_init(&watcher->dirmap);
+    watcher->dirmap.free_data = &watcher_free_snapshot;
+
+    watcher->max_watches = watcher_get_max_watches();
+
+    if (watcher->max_watches == -1)
+        return false;
+
+    watcher->fd = inotify_init1(IN_CLOEXEC);
+
+    return watcher->fd != -1;
+}
+
+/* Watch the directory at PATH for the events in MASK, and in recursive
+   mode, every directory below it. If SYNTHESIZE is true, a create event is
+   synthesized for every entry found below it, as for directories that
+   appear inside the tree. */
+dirmap_entry_t *
+watcher_add_root(watcher_t *watcher, const char *path, uint32_t mask,
+                 bool synthesize)
+{
+    assert(path);
+
+    dirmap_entry_t *entry
+        = watcher_add_watch(watcher, NULL, path, path, mask, false);
+
+    if (entry == NULL)
+        return NULL;
+
+    if (watcher->recursive)
+        return watcher_crawl(watcher, entry, synthesize) ? entry : NULL;
+
+    if (watcher->snapshots)
+    {
+        int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+        if (fd == -1)
+            return NULL;
+
+        entry->data = snapshot_read(fd, watcher->snapshot_stats);
+        close(fd);
+    }
+
+    return entry;
+}
+
+static void
+watcher_forget(dirmap_entry_t *entry, void *data)
+{
+    watcher_t *watcher = data;
+
+    /* Harmless if the kernel removed the watch already. */
+    if (!watcher->offline)
+        inotify_rm_watch(watcher->fd, entry->wd);
+
+    watcher->watchcount--;
+
+    for (size_t i = 0; i < watcher->movecount; i++)
+        if (watcher->moves[i].entry == entry)
+            watcher->moves[i--] = watcher->moves[--watcher->movecount];
+}
+
+/* Add the directory NAME inside the directory watched as PARENT_WD, or the
+   root at NAME if PARENT_WD is 0, as watched by WD, without watching it.
+   This rebuilds the tree of a recording, which also sets the events of
+   the roots to MASK. */
+dirmap_entry_t *
+watcher_add_recorded(watcher_t *watcher, int parent_wd, const char *name,
+                     int wd, uint32_t mask)
+{
+    dirmap_entry_t *parent = NULL;
+
+    if (parent_wd != 0
+        && (parent = dirmap_find_by_wd(&watcher->dirmap, parent_wd)) == NULL)
+    {
+        errno = ENOENT;
+        return NULL;
+    }
+
+    size_t size = watcher->dirmap.size;
+    dirmap_entry_t *entry = dirmap_add(&watcher->dirmap, parent, name, wd);
+
+    if (entry == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    if (parent == NULL)
+        entry->mask = mask;
+
+    if (watcher->dirmap.size > size)
+        watcher->watchcount++;
+
+    return entry;
+}
+
+/* Stop watching ENTRY and every directory below it. */
+void
+watcher_remove(watcher_t *watcher, dirmap_entry_t *entry)
+{
+    dirmap_remove(&watcher->dirmap, entry, &watcher_forget, watcher);
+}
+
+/* A directory appeared in DIR, either created or moved in from outside of
+   the tree. Watch it and everything below it. */
+static void
+watcher_add_subtree(watcher_t *watcher, dirmap_entry_t *dir, const char *name)
+{
+    if (!watcher_wants(watcher, dir, name))
+        return;
+
+    char *path = watcher_join(watcher_path(watcher, dir), name);
+    dirmap_entry_t *entry
+        = watcher_add_watch(watcher, dir, name, path, 0, true);
+
+    /* Over the budget, it is polled instead. */
+    if (entry == NULL && watcher->budget > 0
+        && (errno == ENOBUFS || errno == ENOSPC))
+        watcher_poll_subtree(watcher, path, dir->wd, true);
+
+    /* Entries created in the new directory before its watch was added did
+       not generate any events, so report what is there now. */
+    else if (entry == NULL || !watcher_crawl(watcher, entry, true))
+    {
+        if (errno != ENOENT && errno != ENOTDIR)
+            print_error(true, false, "%s: cannot watch directory", path);
+    }
+
+    free(path);
+}
+
+/* A directory moved away was not paired with an IN_MOVED_TO, so it left
+   the tree. Stop watching it. */
+static void
+watcher_move_out(watcher_t *watcher, size_t i)
+{
+    dirmap_entry_t *entry = watcher->moves[i].entry;
+
+    watcher->moves[i] = watcher->moves[--watcher->movecount];
+    dirmap_remove(&watcher->dirmap, entry, &watcher_forget, watcher);
+}
+
+/* Returns the time of the events being handled, in milliseconds on the
+   monotonic clock. */
+static uint64_t
+watcher_now(watcher_t *watcher)
+{
+    struct timespec ts;
+
+    if (watcher->now != 0)
+        return watcher->now;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Treat the directories whose IN_MOVED_TO did not arrive by NOW, in
+   milliseconds on the monotonic clock, as moved out of the tree. Each one
+   waits WATCHER_MOVE_TIMEOUT after its own IN_MOVED_FROM, however many
+   other events arrive meanwhile. */
+static void
+watcher_expire_moves(watcher_t *watcher, uint64_t now)
+{
+    for (size_t i = 0; i < watcher->movecount; i++)
+        if (watcher->moves[i].deadline <= now)
+            watcher_move_out(watcher, i--);
+}
+
+/* Do the timed work of WATCHER due by NOW, in milliseconds on the
+   monotonic clock: a directory moved away is only known to have left the
+   tree if no IN_MOVED_TO follows shortly. Returns how many milliseconds
+   after NOW there is more to do, or -1 if there is nothing pending. */
+int
+watcher_tick(watcher_t *watcher, uint64_t now)
+{
+    int timeout = -1;
+
+    watcher_expire_moves(watcher, now);
+
+    for (size_t i = 0; i < watcher->movecount; i++)
+    {
+        uint64_t deadline = watcher->moves[i].deadline;
+        int left = deadline > now ? (int) (deadline - now) : 0;
+
+        if (timeout < 0 || left < timeout)
+            timeout = left;
+    }
+
+    return timeout;
+}
+
+/* Apply EVENT to the snapshot of its directory. The status of the entry is
+   not read: it is only recorded as unknown, as is the mtime of the
+   directory when its entries changed, so the next rescan reads it again. */
+static void
+watcher_update_snapshot(snapshot_t *snapshot, const struct inotify_event *event)
+{
+    if (event->mask & (IN_CREATE | IN_MOVED_TO))
+    {
+        snapshot_insert(snapshot, event->name,
+                        event->mask & IN_ISDIR ? DT_DIR : DT_REG);
+        snapshot->mtime = SNAPSHOT_UNKNOWN;
+    }
+    else if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+    {
+        snapshot_remove(snapshot, event->name);
+        snapshot->mtime = SNAPSHOT_UNKNOWN;
+    }
+    else if (event->mask & (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE))
+    {
+        snapshot_entry_t *entry = snapshot_find(snapshot, event->name);
+
+        if (entry != NULL)
+            entry->mtime = SNAPSHOT_UNKNOWN;
+    }
+}
+
+/* Report a difference found by snapshot_diff() and update the tree. */
+static void
+watcher_on_diff(uint32_t mask, const char *name, unsigned char type,
+                void *data)
+{
+    watcher_rescan_t *rescan = data;
+    watcher_t *watcher = rescan->watcher;
+
+    if (watcher->on_synthesized != NULL)
+        watcher->on_synthesized(watcher, mask,
+                                rescan->dir == NULL ? -1 : rescan->dir->wd,
+                                rescan->path, name);
+
+    if (!watcher->recursive || type != DT_DIR)
+        return;
+
+    if (rescan->dir == NULL)
+    {
+        char *path = watcher_join(rescan->path, name);
+
+        if (mask & IN_DELETE)
+            watcher_unpoll(watcher, path);
+        else if ((mask & IN_CREATE) && watcher_wants_path(watcher, path))
+            watcher_poll_subtree(watcher, path, -1, true);
+
+        free(path);
+        return;
+    }
+
+    if (mask & IN_DELETE)
+    {
+        dirmap_entry_t *child
+            = dirmap_find_child(&watcher->dirmap, rescan->dir, name);
+
+        if (child != NULL)
+            dirmap_remove(&watcher->dirmap, child, &watcher_forget, watcher);
+    }
+    else if (mask & IN_CREATE)
+        watcher_add_subtree(watcher, rescan->dir, name);
+}
+
+/* The namespace of the directory at PATH did not change, but its files may
+   have been modified. Compare their modification times with SNAPSHOT. */
+static void
+watcher_check_modified(watcher_t *watcher, int wd, const char *path,
+                       snapshot_t *snapshot, int fd)
+{
+    for (uint32_t i = 0; i < snapshot->count; i++)
+    {
+        snapshot_entry_t *entry = &snapshot->entries[i];
+        const char *name = snapshot_name(snapshot, entry);
+        struct stat st;
+
+        if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+
+        int64_t mtime = (int64_t) st.st_mtim.tv_sec * 1000000000
+                        + st.st_mtim.tv_nsec;
+
+        if (entry->mtime != SNAPSHOT_UNKNOWN && entry->mtime != mtime
+            && watcher->on_synthesized != NULL)
+            watcher->on_synthesized(watcher,
+                                    IN_MODIFY
+                                        | (entry->type == DT_DIR ? IN_ISDIR
+                                                                 : 0),
+                                    wd, path, name);
+
+        entry->mtime = mtime;
+        entry->size = st.st_size;
+    }
+}
+
+/* Compare the directory DIR with its snapshot, and report the changes. The
+   directory is only read again if its mtime changed. */
+static void
+watcher_rescan_dir(watcher_t *watcher, dirmap_entry_t *dir)
+{
+    int fd = open(watcher_path(watcher, dir),
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    /* A removed directory is reported by the rescan of its parent. */
+    if (fd == -1)
+        return;
+
+    snapshot_t *old = dir->data;
+    struct stat st;
+
+    if (old != NULL && old->mtime != SNAPSHOT_UNKNOWN && fstat(fd, &st) == 0
+        && old->mtime
+               == (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec)
+    {
+        if (watcher->snapshot_stats)
+            watcher_check_modified(watcher, dir->wd, watcher_path(watcher, dir),
+                                   old, fd);
+
+        close(fd);
+        return;
+    }
+
+    snapshot_t *new = snapshot_read(fd, watcher->snapshot_stats);
+
+    close(fd);
+
+    if (new == NULL)
+        return;
+
+    dir->data = new;
+
+    if (old != NULL)
+    {
+        /* The path is copied, since the callbacks build other paths. */
+        const char *dirpath = watcher_path(watcher, dir);
+        char *path = xmalloc(strlen(dirpath) + 1);
+
+        strcpy(path, dirpath);
+
+        watcher_rescan_t rescan = { .watcher = watcher, .dir = dir,
+                                    .path = path };
+
+        snapshot_diff(old, new, &watcher_on_diff, &rescan);
+        free(path);
+        snapshot_free(old);
+    }
+}
+
+/* Recover from a queue overflow: events were lost, so compare every watched
+   directory with its snapshot. Directories whose mtime did not change are
+   not read again. */
+void
+watcher_rescan(watcher_t *watcher)
+{
+    /* The IN_MOVED_TO events of pending moves may have been lost. */
+    watcher_expire_moves(watcher, UINT64_MAX);
+
+    /* Rescans add and remove directories, so work on a copy of the wds. */
+    size_t count = 0;
+    int *wds = xmalloc(sizeof(int) * (watcher->dirmap.size + 1));
+
+    for (size_t i = 0; i < watcher->dirmap.capacity; i++)
+        if (watcher->dirmap.by_wd[i] != NULL)
+            wds[count++] = watcher->dirmap.by_wd[i]->wd;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        dirmap_entry_t *dir = dirmap_find_by_wd(&watcher->dirmap, wds[i]);
+
+        if (dir != NULL)
+            watcher_rescan_dir(watcher, dir);
+    }
+
+    free(wds);
+}
+
+/* Poll the directory of the record I. Returns true if its entries
+   changed. */
+static bool
+watcher_poll_dir(watcher_t *watcher, size_t i)
+{
+    watcher_polled_t *polled = &watcher->polled[i];
+    int fd = open(polled->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    /* A removed directory is reported by the poll or the events of its
+       parent. */
+    if (fd == -1)
+    {
+        if (errno == ENOENT || errno == ENOTDIR)
+            watcher_unpoll(watcher, polled->path);
+
+        return false;
+    }
+
+    snapshot_t *old = polled->snapshot;
+    struct stat st;
+
+    if (old != NULL && old->mtime != SNAPSHOT_UNKNOWN && fstat(fd, &st) == 0
+        && old->mtime
+               == (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec)
+    {
+        if (watcher->snapshot_stats)
+            watcher_check_modified(watcher, -1, polled->path, old, fd);
+
+        close(fd);
+        return false;
+    }
+
+    snapshot_t *new = snapshot_read(fd, watcher->snapshot_stats);
+
+    close(fd);
+
+    if (new == NULL)
+        return false;
+
+    polled->snapshot = new;
+
+    if (old != NULL)
+    {
+        /* The record may move while the callbacks add others. */
+        char *path = xmalloc(strlen(polled->path) + 1);
+
+        strcpy(path, polled->path);
+
+        watcher_rescan_t rescan = { .watcher = watcher, .dir = NULL,
+                                    .path = path };
+
+        snapshot_diff(old, new, &watcher_on_diff, &rescan);
+        snapshot_free(old);
+        free(path);
+    }
+
+    return true;
+}
+
+/* Watch the top of a polled subtree again, if its parent is still watched
+   and there is room within the budget. */
+static void
+watcher_poll_promote(watcher_t *watcher, size_t i)
+{
+    watcher_polled_t *polled = &watcher->polled[i];
+
+    if (polled->parent_wd == -1 || watcher->watchcount >= watcher->budget)
+        return;
+
+    dirmap_entry_t *parent
+        = dirmap_find_by_wd(&watcher->dirmap, polled->parent_wd);
+    const char *name = strrchr(polled->path, '/');
+
+    if (parent == NULL || name == NULL)
+        return;
+
+    /* The wd may have been reused by another directory. */
+    const char *parentpath = watcher_path(watcher, parent);
+    size_t len = strlen(parentpath);
+
+    if (strncmp(polled->path, parentpath, len) != 0
+        || polled->path + len + (parentpath[len - 1] != '/') != name + 1)
+        return;
+
+    char *path = xmalloc(strlen(polled->path) + 1);
+
+    strcpy(path, polled->path);
+    name = path + (name - polled->path);
+    watcher_unpoll(watcher, path);
+
+    LOG_DEBUG_1(watcher->verbosity, "Watching polled directory again: %s\n",
+                path);
+
+    /* Its changes were just reported by the poll. */
+    dirmap_entry_t *entry
+        = watcher_add_watch(watcher, parent, name + 1, path, 0, false);
+
+    if (entry == NULL || !watcher_crawl(watcher, entry, false))
+    {
+        if (errno == ENOBUFS || errno == ENOSPC)
+            watcher_poll_subtree(watcher, path, parent->wd, false);
+        else if (errno != ENOENT && errno != ENOTDIR)
+            print_error(true, false, "%s: cannot watch directory", path);
+    }
+
+    free(path);
+}
+
+/* Compare the directories polled over the budget with their snapshots, and
+   report the changes. Directories whose mtime did not change are not read
+   again. The tops of polled subtrees that changed get their watches back if
+   there is room. */
+void
+watcher_poll(watcher_t *watcher)
+{
+    for (size_t i = 0; i < watcher->polledcount; i++)
+    {
+        if (watcher->polled[i].path != NULL && watcher_poll_dir(watcher, i)
+            && watcher->polled[i].path != NULL)
+            watcher_poll_promote(watcher, i);
+    }
+
+    watcher_poll_compact(watcher);
+}
+
+/* Watch ENTRY and everything below it for the events of their root, after
+   they moved to the tree of another root. Watching a directory again
+   replaces the mask of its watch. */
+static void
+watcher_remask(watcher_t *watcher, dirmap_entry_t *entry)
+{
+    uint32_t mask = watcher_kernel_mask(watcher, entry->root->mask);
+    const char *path = watcher_path(watcher, entry);
+
+    /* A directory removed meanwhile has its IN_DELETE_SELF coming. */
+    if (inotify_add_watch(watcher->fd, path, mask | IN_ONLYDIR) == -1
+        && errno != ENOENT && errno != ENOTDIR)
+        print_error(true, false, "%s: cannot watch directory", path);
+
+    for (dirmap_entry_t *child = entry->children; child != NULL;
+         child = child->next)
+        watcher_remask(watcher, child);
+}
+
+/* Update the tree of watched directories after EVENT. Call this after the
+   event was reported, since it may remove the directory of the event. */
+void
+watcher_handle_event(watcher_t *watcher, const struct inotify_event *event)
+{
+    if (event->mask & IN_Q_OVERFLOW)
+    {
+        if (watcher->snapshots && !watcher->offline)
+            watcher_rescan(watcher);
+
+        return;
+    }
+
+    if (event->wd <= 0)
+        return;
+
+    dirmap_entry_t *dir = dirmap_find_by_wd(&watcher->dirmap, event->wd);
+
+    if (dir == NULL)
+        return;
+
+    dirmap_touch(&watcher->dirmap, dir);
+
+    if (dir->data != NULL && event->len > 0)
+        watcher_update_snapshot(dir->data, event);
+
+    if (event->mask & IN_IGNORED)
+    {
+        /* The directory was deleted or its filesystem was unmounted. */
+        dirmap_remove(&watcher->dirmap, dir, &watcher_forget, watcher);
+        return;
+    }
+
+    if (!watcher->recursive || !(event->mask & IN_ISDIR) || event->len == 0)
+        return;
+
+    /* Offline, the new watches are added by the recording. */
+    if (event->mask & IN_CREATE)
+    {
+        if (!watcher->offline)
+            watcher_add_subtree(watcher, dir, event->name);
+    }
+    else if (event->mask & IN_MOVED_FROM)
+    {
+        dirmap_entry_t *entry
+            = dirmap_find_child(&watcher->dirmap, dir, event->name);
+
+        if (entry == NULL)
+            return;
+
+        if (watcher->movecount == WATCHER_MAX_MOVES)
+            watcher_move_out(watcher, 0);
+
+        watcher->moves[watcher->movecount++] = (watcher_move_t){
+            .cookie = event->cookie,
+            .entry = entry,
+            .deadline = watcher_now(watcher) + WATCHER_MOVE_TIMEOUT,
+        };
+    }
+    else if (event->mask & IN_MOVED_TO)
+    {
+        for (size_t i = 0; i < watcher->movecount; i++)
+        {
+            if (watcher->moves[i].cookie == event->cookie)
+            {
+                /* A rename inside the tree: the watches stay valid, only
+                   the name of the directory changes. */
+                dirmap_entry_t *entry = watcher->moves[i].entry;
+                char *oldpath = NULL;
+
+                watcher->moves[i] = watcher->moves[--watcher->movecount];
+
+                if (watcher->polledcount > 0)
+                {
+                    const char *path = watcher_path(watcher, entry);
+
+                    oldpath = xmalloc(strlen(path) + 1);
+                    strcpy(oldpath, path);
+                }
+
+                uint32_t mask = entry->root->mask;
+
+                if (!dirmap_move(&watcher->dirmap, entry, dir, event->name))
+                    print_error(true, false, "cannot track renamed directory");
+                else if (entry->root->mask != mask && !watcher->offline)
+                    watcher_remask(watcher, entry);
+
+                if (oldpath != NULL)
+                    watcher_poll_rename(watcher, oldpath,
+                                        watcher_path(watcher, entry));
+
+                free(oldpath);
+                return;
+            }
+        }
+
+        if (!watcher->offline)
+            watcher_add_subtree(watcher, dir, event->name);
+    }
+}
+
+void
+watcher_free(watcher_t *watcher)
+{
+    for (size_t i = 0; i < watcher->polledcount; i++)
+    {
+        free(watcher->polled[i].path);
+        snapshot_free(watcher->polled[i].snapshot);
+    }
+
+    free(watcher->polled);
+    watcher->polled = NULL;
+    watcher->polledcount = watcher->polledcapacity = 0;
+
+    dirmap_free(&watcher->dirmap);
+    free(watcher->pathbuf);
+    watcher->pathbuf = NULL;
+    watcher->pathbufsize = 0;
+
+    if (watcher->fd != -1)
+        close(watcher->fd);
+
+    watcher->fd = -1;
+}
@@ -0,0 +1,158 @@
+/*
+    watcher.h -- typedefs and prototypes for watcher.c
+
+    Copyright (C) 2023 OSN Inc.
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef __WATCHER_H__
+#define __WATCHER_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+
+#include "dirmap.h"
+#include "exclude.h"
+#include "snapshot.h"
+#include "utils.h"
+
+/* Maximum number of directory renames waiting for their IN_MOVED_TO. */
+#define WATCHER_MAX_MOVES 64
+
+/* How long to wait for the IN_MOVED_TO of a rename, in milliseconds. */
+#define WATCHER_MOVE_TIMEOUT 10
+
+/* How often directories without a watch are polled by default, in
+   milliseconds. */
+#define WATCHER_POLL_INTERVAL 2000
+
+/* Number of the least recently active directories considered when one
+   must be evicted to make room for another. */
+#define WATCHER_EVICT_CANDIDATES 64
+
+typedef struct watcher watcher_t;
+
+/* Called for events synthesized by the watcher, for entries that appeared
+   in a new directory before it could be watched, for changes found after a
+   queue overflow, or for changes found by polling. WD is the watch of the
+   directory at DIRPATH, or -1 if it is polled. */
+typedef void (*watcher_event_callback_t)(watcher_t *watcher, uint32_t mask,
+                                         int wd, const char *dirpath,
+                                         const char *name);
+
+/* Called for every directory added to the tree, or moved in it because
+   its watch was found again under another path. It may be called from the
+   threads of a parallel crawl, one at a time. */
+typedef void (*watcher_watch_callback_t)(watcher_t *watcher,
+                                         dirmap_entry_t *entry);
+
+/* Decides whether the directory NAME inside PARENT is watched. It may be
+   called from the threads of a parallel crawl. */
+typedef bool (*watcher_filter_t)(watcher_t *watcher, dirmap_entry_t *parent,
+                                 const char *name);
+
+/* A directory that was moved away, waiting to be paired with the
+   IN_MOVED_TO event of the same cookie. */
+typedef struct
+{
+    uint32_t cookie;
+    dirmap_entry_t *entry;
+    uint64_t deadline; /* When the directory is known to have left the
+                          tree, in milliseconds on the monotonic clock. */
+} watcher_move_t;
+
+/* A directory without a watch, over the budget. Its changes are found by
+   comparing its mtime with the one in its snapshot. */
+typedef struct
+{
+    char *path;
+    snapshot_t *snapshot;
+    int parent_wd; /* The watched parent if this is the top of a polled
+                      subtree, or -1. */
+} watcher_polled_t;
+
+/* An inotify instance together with the tree of watched directories. In
+   recursive mode, the tree follows the changes of the filesystem: new
+   directories are watched, removed ones are forgotten, and renamed ones
+   are moved in the tree.
+
+   With snapshots enabled, the entries of every watched directory are also
+   recorded and kept up to date from the events. When the kernel queue
+   overflows, the directories whose mtime changed are read again, and the
+   differences are reported as synthesized events.
+
+   With a budget, at most that many watches are used. Past it, a new
+   directory takes the watches of the least recently active subtree if it
+   is deeper, and is polled otherwise. Evicted subtrees are polled too, and
+   get their watches back once there is room and they change. */
+struct watcher
+{
+    int fd;                /* The file descriptor from inotify_init(). */
+    uint32_t mask;         /* The events requested by the user. Each root
+                              may be watched for its own instead. */
+    bool recursive;        /* Watch subdirectories as well. */
+    int watchcount;        /* Count of the watches in total. */
+    int max_watches;       /* Max count of the watches in total. */
+    verbosity_t verbosity; /* Verbosity level. */
+    bool snapshots;        /* Keep a snapshot of every watched directory,
+                              to recover from queue overflows. */
+    bool snapshot_stats;   /* Record modification times and sizes in the
+                              snapshots, to detect modified files. */
+    int jobs;              /* Threads used to crawl new roots. */
+    int budget;            /* Max count of the watches to use, or 0. */
+    exclude_t *exclude;    /* Directories not to watch, if not NULL. */
+    dirmap_t dirmap;       /* The watched directories. */
+    watcher_move_t moves[WATCHER_MAX_MOVES];
+    size_t movecount;
+    watcher_filter_t filter; /* Called before watching subdirectories, if
+                                not NULL. */
+    watcher_event_callback_t on_synthesized;
+    watcher_watch_callback_t on_watch;
+    void *data;   /* User data for the callbacks. */
+    bool offline; /* The events are replayed from a recording, which adds
+                     the watched directories itself, so the filesystem is
+                     never read and no watch is added. */
+    uint64_t now; /* Time of the events being handled in milliseconds on
+                     the monotonic clock, or 0 to read the clock. Set when
+                     replaying events at their recorded times. */
+    char *pathbuf;
+    size_t pathbufsize;
+    watcher_polled_t *polled; /* Directories polled over the budget. */
+    size_t polledcount;
+    size_t polledcapacity;
+};
+
+__BEGIN_DECLS
+
+bool watcher_init(watcher_t *watcher, uint32_t mask, bool recursive);
+dirmap_entry_t *watcher_add_root(watcher_t *watcher, const char *path,
+                                 uint32_t mask, bool synthesize);
+dirmap_entry_t *watcher_add_recorded(watcher_t *watcher, int parent_wd,
+                                     const char *name, int wd,
+                                     uint32_t mask);
+void watcher_remove(watcher_t *watcher, dirmap_entry_t *entry);
+void watcher_handle_event(watcher_t *watcher,
+                          const struct inotify_event *event);
+int watcher_tick(watcher_t *watcher, uint64_t now);
+void watcher_rescan(watcher_t *watcher);
+void watcher_poll(watcher_t *watcher);
+const char *watcher_path(watcher_t *watcher, dirmap_entry_t *entry);
+void watcher_free(watcher_t *watcher);
+
+__END_DECLS
+
+#endif